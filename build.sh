@@ -0,0 +1,11 @@
+#!/bin/sh
+# NOTE: the linux build, the same unity build as build.bat. the arguments
+# go to gcc, ./build.sh -DBC_JIT=0 builds without the JIT. OUT names the
+# executable in build/
+
+OUT=${OUT:-lang}
+
+mkdir -p build
+cd build
+
+gcc -std=gnu11 -fgnu89-inline -O2 -g -Wall -Wno-unused-function -Wno-unused-variable -Wno-unused-but-set-variable -Wno-missing-braces -Wno-switch "$@" ../code/win32_main.c -o "$OUT" -lm -ldl -lpthread
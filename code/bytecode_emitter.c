@@ -1,12 +1,12 @@
 typedef enum {
   I_NONE,
-  I_COMMENT,
   
   I_CONST,
   I_CONST_STACK,
   I_CONST_BSS,
   
   I_STACK_CHANGE,
+  I_STACK_PROBE,
   
   I_ADD_int,
   I_ADD_f32,
@@ -37,7 +37,16 @@ typedef enum {
   I_OR,
   I_NOT,
   
-  I_LOAD,
+  // NOTE(lvl5): pop an address, push what's there. narrow ints are sign
+  // or zero extended to 64 bits
+  I_LOAD_64,
+  I_LOAD_i8,
+  I_LOAD_u8,
+  I_LOAD_i16,
+  I_LOAD_u16,
+  I_LOAD_i32,
+  I_LOAD_u32,
+  I_LOAD_f32,
   
   I_STORE_8,
   I_STORE_16,
@@ -47,11 +56,12 @@ typedef enum {
   I_GT_int,
   I_GT_f32,
   I_GT_f64,
-  
+  I_GT_u,
   
   I_GTE_int,
   I_GTE_f32,
   I_GTE_f64,
+  I_GTE_u,
   
   I_EQ,
   I_NE,
@@ -68,19 +78,69 @@ typedef enum {
   I_JMP,
   
   I_MEMCOPY,
+  // NOTE(lvl5): the size comes off the exec stack instead, pushed last.
+  // MEMCOPY_N takes from and to like MEMCOPY, MEMSET_N a byte value and to
+  I_MEMCOPY_N,
+  I_MEMSET_N,
+  // NOTE(lvl5): the callee's frame starts frame bytes into the caller's,
+  // its return value goes at the start of it and the arguments after.
+  // CALL pops the signature index and the callee, CALL_DIRECT knows the
+  // callee and takes a Bc_Call. TAIL_CALL reuses the current frame
   I_CALL,
+  I_CALL_DIRECT,
+  I_TAIL_CALL,
   I_RET,
   I_HLT,
+  
+  // NOTE(lvl5): register forms, operands are byte offsets of 8 byte
+  // slots in the current stack frame, they don't touch the exec stack
+  I_MOV_RR,
+  I_MOV_RI,
+  I_ADD_int_RR,
+  I_ADD_int_RI,
+  I_SUB_int_RR,
+  I_SUB_int_RI,
+  I_MUL_int_RR,
+  I_MUL_int_RI,
+  
+  // NOTE(lvl5): superinstructions, only produced by bc_peephole
+  I_LOAD_LOCAL,
+  I_STORE_LOCAL_64,
+  I_ADD_IMM,
+  
+  // NOTE(lvl5): compare and branch, pop right, then left, and jump if
+  // left <op> right. _u compares unsigned. the LT..GE groups are in
+  // Bc_Compare order with one kind per Bc_Compare_Type, see bc_branch_kind
+  I_JLT_int, I_JLT_u, I_JLT_f32, I_JLT_f64,
+  I_JLE_int, I_JLE_u, I_JLE_f32, I_JLE_f64,
+  I_JGT_int, I_JGT_u, I_JGT_f32, I_JGT_f64,
+  I_JGE_int, I_JGE_u, I_JGE_f32, I_JGE_f64,
+  I_JEQ,
+  I_JNE,
+  
+  // NOTE(lvl5): the same against an immediate right side, the param is a
+  // Bc_Branch. only produced by bc_peephole
+  I_JLT_int_IMM,
+  I_JLE_int_IMM,
+  I_JGT_int_IMM,
+  I_JGE_int_IMM,
+  I_JEQ_IMM,
+  I_JNE_IMM,
+  
+  I_EMIT_FUNC,
+  I_LOOP,
+  
+  I_COUNT,
 } Instruction_Kind;
 
 char *Instruction_Kind_To_String[] = {
   [I_NONE] = "NONE",
   
-  [I_COMMENT] = "//",
   [I_CONST] = "CONST",
   [I_CONST_STACK] = "CONST_STACK",
   [I_CONST_BSS] = "CONST_BSS",
   [I_STACK_CHANGE] = "STACK_CHANGE",
+  [I_STACK_PROBE] = "STACK_PROBE",
   
   [I_ADD_int] = "ADD_int",
   [I_ADD_f32] = "ADD_f32",
@@ -111,7 +171,14 @@ char *Instruction_Kind_To_String[] = {
   [I_AND] = "AND",
   [I_OR] = "OR",
   
-  [I_LOAD] = "LOAD",
+  [I_LOAD_64] = "LOAD_64",
+  [I_LOAD_i8] = "LOAD_i8",
+  [I_LOAD_u8] = "LOAD_u8",
+  [I_LOAD_i16] = "LOAD_i16",
+  [I_LOAD_u16] = "LOAD_u16",
+  [I_LOAD_i32] = "LOAD_i32",
+  [I_LOAD_u32] = "LOAD_u32",
+  [I_LOAD_f32] = "LOAD_f32",
   
   [I_STORE_8] = "STORE_8",
   [I_STORE_16] = "STORE_16",
@@ -125,6 +192,8 @@ char *Instruction_Kind_To_String[] = {
   [I_GTE_int] = "GTE_int",
   [I_GTE_f32] = "GTE_f32",
   [I_GTE_f64] = "GTE_f64",
+  [I_GT_u] = "GT_u",
+  [I_GTE_u] = "GTE_u",
   
   [I_EQ] = "EQ",
   [I_NE] = "NE",
@@ -141,11 +210,74 @@ char *Instruction_Kind_To_String[] = {
   [I_JMP] = "JMP",
   
   [I_MEMCOPY] = "MEMCOPY",
+  [I_MEMCOPY_N] = "MEMCOPY_N",
+  [I_MEMSET_N] = "MEMSET_N",
   [I_CALL] = "CALL",
+  [I_CALL_DIRECT] = "CALL_DIRECT",
+  [I_TAIL_CALL] = "TAIL_CALL",
   [I_RET] = "RET",
   [I_HLT] = "HLT",
+  
+  [I_MOV_RR] = "MOV_RR",
+  [I_MOV_RI] = "MOV_RI",
+  [I_ADD_int_RR] = "ADD_int_RR",
+  [I_ADD_int_RI] = "ADD_int_RI",
+  [I_SUB_int_RR] = "SUB_int_RR",
+  [I_SUB_int_RI] = "SUB_int_RI",
+  [I_MUL_int_RR] = "MUL_int_RR",
+  [I_MUL_int_RI] = "MUL_int_RI",
+  
+  [I_LOAD_LOCAL] = "LOAD_LOCAL",
+  [I_STORE_LOCAL_64] = "STORE_LOCAL_64",
+  [I_ADD_IMM] = "ADD_IMM",
+  [I_JLT_int] = "JLT_int",
+  [I_JLT_u] = "JLT_u",
+  [I_JLT_f32] = "JLT_f32",
+  [I_JLT_f64] = "JLT_f64",
+  [I_JLE_int] = "JLE_int",
+  [I_JLE_u] = "JLE_u",
+  [I_JLE_f32] = "JLE_f32",
+  [I_JLE_f64] = "JLE_f64",
+  [I_JGT_int] = "JGT_int",
+  [I_JGT_u] = "JGT_u",
+  [I_JGT_f32] = "JGT_f32",
+  [I_JGT_f64] = "JGT_f64",
+  [I_JGE_int] = "JGE_int",
+  [I_JGE_u] = "JGE_u",
+  [I_JGE_f32] = "JGE_f32",
+  [I_JGE_f64] = "JGE_f64",
+  [I_JEQ] = "JEQ",
+  [I_JNE] = "JNE",
+  [I_JLT_int_IMM] = "JLT_int_IMM",
+  [I_JLE_int_IMM] = "JLE_int_IMM",
+  [I_JGT_int_IMM] = "JGT_int_IMM",
+  [I_JGE_int_IMM] = "JGE_int_IMM",
+  [I_JEQ_IMM] = "JEQ_IMM",
+  [I_JNE_IMM] = "JNE_IMM",
+  
+  [I_EMIT_FUNC] = "EMIT_FUNC",
+  [I_LOOP] = "LOOP",
 };
 
+typedef struct {
+  u16 dst;
+  u16 a;
+  union {
+    u32 b;
+    i32 imm;
+  };
+} Bc_Regs;
+
+typedef struct {
+  i32 offset;
+  i32 imm;
+} Bc_Branch;
+
+typedef struct {
+  i32 function;
+  i32 frame;
+} Bc_Call;
+
 typedef union {
   i8 _i8;
   i16 _i16;
@@ -157,472 +289,1858 @@ typedef union {
   u32 _u32;
   u16 _u16;
   u8 _u8;
-  String *_comment;
   void *_ptr;
+  Bc_Regs _regs;
+  Bc_Branch _branch;
+  Bc_Call _call;
 } Bc_Param;
 
+// NOTE(lvl5): 16 bytes per instruction, even the ones with no operand. a
+// packed encoding, one byte opcodes with 0 to 8 byte immediates and a
+// constant pool, was slower in both dispatch loops, decoding the operand
+// costs more than the smaller code saves
 typedef struct {
   Instruction_Kind kind;
   Bc_Param param;
 } Bc_Instruction;
 
-struct Bc_Emitter {
+// NOTE(lvl5): maps an instruction index back to the source it came from.
+// kept out of the instruction stream so the VM never sees it, only
+// bytecode_print, error reporting and profiling look at it
+typedef struct {
+  i64 instruction_index;
+  i32 first_token;
+  i32 last_token;
+  i32 line; // kept here too, a loaded image has no tokens
+} Bc_Source_Span;
+
+#define BC_FOREIGN_MAX_ARGS 32
+
+typedef enum {
+  Bc_Arg_Class_NONE,
+  Bc_Arg_Class_INT,
+  Bc_Arg_Class_SSE,
+  Bc_Arg_Class_MEMORY,
+} Bc_Arg_Class;
+
+// NOTE(lvl5): an argument or the return value. integers smaller than 4
+// bytes get extended, the ABI wants them widened to 32 bits
+typedef struct {
+  i32 size;
+  b32 is_signed;
+  b32 is_func; // VM functions are turned into callbacks on the way out
+  Bc_Arg_Class classes[2]; // one per eightbyte
+} Bc_Foreign_Value;
+
+// NOTE(lvl5): all a foreign call or a callback needs to know about a
+// function type, see bytecode_foreign.c. the emitter keeps one of each in
+// its signature table and CALL takes the index, so the code never points
+// at the AST
+typedef struct {
+  Bc_Foreign_Value ret;
+  Bc_Foreign_Value args[BC_FOREIGN_MAX_ARGS];
+  i32 arg_count;
+} Bc_Foreign_Sig;
+
+// NOTE(lvl5): one code object per function. calls go through the function
+// table by index, and jumps are relative, so a function's code can be
+// emitted, moved or thrown away without touching anything else
+typedef struct {
+  String name;
+  i64 index;
+  Code_Stmt_Decl *decl;
+  i32 signature; // for callbacks
+  b32 emitted;
+  
+  // NOTE(lvl5): bytecode_jit.c
+  void *native;
+  i32 call_count;
+  b32 jit_failed;
+  u32 jit_epoch;
+  
   Bc_Instruction *instructions;
   i64 instruction_count;
+  i64 instruction_capacity;
+  Bc_Source_Span *source_spans;
+} Bc_Function;
+
+// NOTE(lvl5): a while loop. the LOOP instruction at its head counts the
+// iterations, hot ones are compiled by bytecode_jit.c
+typedef struct {
+  i64 function;
+  i32 count;
+  b32 jit_failed;
+  void *native;
+  i64 *exits; // instruction each side exit resumes at
+} Bc_Loop;
+
+// NOTE(lvl5): a #foreign function, its address goes in the BSS at offset
+typedef struct {
+  String module;
+  String name;
+  i32 offset;
+} Bc_Import;
+
+// NOTE(lvl5): the BSS and heap as the #init functions left them, see
+// bytecode_snapshot.c. the pointers in there hold an offset into the
+// segment they point to, relocations says where they are. a #foreign
+// function value holds the offset of the function's BSS slot instead, and
+// the heap allocator #init functions get holds nothing, both are filled
+// in wherever the snapshot is used
+typedef enum {
+  Bc_Segment_BSS,
+  Bc_Segment_HEAP,
+  Bc_Segment_FOREIGN,
+  Bc_Segment_ALLOCATOR,
+} Bc_Segment;
+
+typedef struct {
+  u64 offset; // of the pointer in segment
+  Bc_Segment segment;
+  Bc_Segment to;
+} Bc_Relocation;
+
+typedef struct {
+  byte *bss; // the rest of the BSS is 0
+  u64 bss_size;
+  byte *heap;
+  u64 heap_size;
+  Bc_Relocation *relocations;
+} Bc_Snapshot;
+
+// NOTE(lvl5): where the allocator is in the ctx #init functions get
+typedef struct {
+  i32 size;
+  i32 allocator;
+  i32 allocator_data;
+} Bc_Context_Layout;
+
+// NOTE(lvl5): where break and continue in the loop being emitted go,
+// both are chains of jumps, see bc_patch_jumps
+typedef struct {
+  i64 breaks;
+  i64 continues;
+  u32 defer_count; // the defers from before the loop aren't run
+} Bc_Jump_Target;
+
+typedef struct Bc_Emitter Bc_Emitter;
+typedef struct Bc_Vm Bc_Vm;
+struct Bc_Emitter {
+  Arena *arena;
+  Bc_Function **functions;
+  Bc_Function *func; // the one being emitted into
+  Bc_Loop *loops;
+  Bc_Foreign_Sig **signatures;
+  Bc_Import *imports;
+  i64 *init_functions; // run before __entry, unless they're in the snapshot
+  Bc_Context_Layout context;
+  Bc_Snapshot *snapshot;
   
   byte *bss_segment;
+  byte *heap; // the snapshot's, its pointers point here
   Code_Func *current_func;
   Parser *parser;
-  i64 entry_instruction_index;
+  i64 entry_function;
+  
+  Code_Node **defers; // the deferred statements of the blocks being emitted
+  u32 defer_base; // the first one of current_func
+  Bc_Jump_Target *jump_targets;
+  i32 call_frame; // see bc_frame
+  
+  Bc_Function **run_functions; // __run, one for each #run being run at once
+  u32 run_depth;
+  Bc_Vm *run_vm; // what every #run runs on
 };
 
-Bc_Instruction *bc_instruction(Bc_Emitter *e, Instruction_Kind kind, Bc_Param param) {
+Bc_Function *bc_function(Bc_Emitter *e, String name) {
+  Bc_Function *func = arena_push_struct(e->arena, Bc_Function);
+  zero_memory(func, sizeof(Bc_Function));
+  func->name = name;
+  func->index = sb_count(e->functions);
+  func->instruction_capacity = 64;
+  func->instructions = arena_push_array(e->arena, Bc_Instruction, func->instruction_capacity);
+  func->source_spans = sb_new(e->arena, Bc_Source_Span, 16);
+  func->emitted = true;
+  sb_push(e->functions, func);
+  return func;
+}
+
+// NOTE(lvl5): every BSS segment has a header in front of it. the word
+// right before the BSS is where the VM running on it keeps the frame for
+// callbacks, see bytecode_foreign.c. jitted code can't see the VM, only
+// its BSS, so this is how a foreign call made from there finds it
+#define BC_BSS_SIZE megabytes(2)
+#define BC_BSS_HEADER 16
+#define bc_callback_slot(bss) ((byte **)(bss) - 1)
+
+byte *bc_alloc_bss(Arena *arena) {
+  byte *result = arena_push_array(arena, byte, BC_BSS_HEADER + BC_BSS_SIZE) + BC_BSS_HEADER;
+  return result;
+}
+
+// NOTE(lvl5): global initializers that run outside of any function go
+// into the __global code object, function 0
+void bc_emitter_init(Bc_Emitter *e, Arena *arena, Parser *parser) {
+  zero_memory(e, sizeof(Bc_Emitter));
+  e->arena = arena;
+  e->parser = parser;
+  e->bss_segment = bc_alloc_bss(arena);
+  e->functions = sb_new(arena, Bc_Function *, 64);
+  e->loops = sb_new(arena, Bc_Loop, 16);
+  e->signatures = sb_new(arena, Bc_Foreign_Sig *, 16);
+  e->imports = sb_new(arena, Bc_Import, 16);
+  e->init_functions = sb_new(arena, i64, 16);
+  e->defers = sb_new(arena, Code_Node *, 16);
+  e->jump_targets = sb_new(arena, Bc_Jump_Target, 16);
+  e->run_functions = sb_new(arena, Bc_Function *, 4);
+  e->func = bc_function(e, const_string("__global"));
+}
+
+i64 bc_instruction(Bc_Emitter *e, Instruction_Kind kind, Bc_Param param) {
+  Bc_Function *func = e->func;
+  if (func->instruction_count == func->instruction_capacity) {
+    i64 capacity = func->instruction_capacity*2;
+    Bc_Instruction *instructions = arena_push_array(e->arena, Bc_Instruction, capacity);
+    copy_memory(instructions, func->instructions, func->instruction_count*sizeof(Bc_Instruction));
+    func->instructions = instructions;
+    func->instruction_capacity = capacity;
+  }
+  
   Bc_Instruction instr = {0};
   instr.kind = kind;
   instr.param = param;
-  e->instructions[e->instruction_count] = instr;
-  return e->instructions + e->instruction_count++;
+  func->instructions[func->instruction_count] = instr;
+  return func->instruction_count++;
 }
 
 
+void bc_source_span(Bc_Emitter *e, i32 first_token, i32 last_token) {
+  Bc_Source_Span span = {0};
+  span.instruction_index = e->func->instruction_count;
+  span.first_token = first_token;
+  span.last_token = last_token;
+  span.line = e->parser ? e->parser->tokens[first_token].line : 0;
+  sb_push(e->func->source_spans, span);
+}
+
+// NOTE(lvl5): last span that starts at or before the instruction
+Bc_Source_Span *bc_find_source_span(Bc_Function *func, i64 instruction_index) {
+  Bc_Source_Span *result = 0;
+  i64 low = 0;
+  i64 high = (i64)sb_count(func->source_spans) - 1;
+  while (low <= high) {
+    i64 mid = (low + high)/2;
+    Bc_Source_Span *span = func->source_spans + mid;
+    if (span->instruction_index <= instruction_index) {
+      result = span;
+      low = mid + 1;
+    } else {
+      high = mid - 1;
+    }
+  }
+  return result;
+}
+
+String bc_source_span_text(Bc_Emitter *e, Bc_Source_Span *span) {
+  Token t = e->parser->tokens[span->first_token];
+  String result = get_line_from_index(e->parser->src, (u32)(t.value.data - e->parser->src.data));
+  return result;
+}
+
 Bc_Param call_foreign(void *fn, Bc_Param *args, i32 count);
 
+// NOTE(lvl5): calls proc with the arguments on the VM stack, see
+// bytecode_foreign.c. callback_stack is the slot in front of the caller's BSS
+typedef void (*Bc_Foreign_Thunk)(void *proc, byte *stack, byte **callback_stack);
+
 #define FOREIGN_FUNCTION_PTR_BIT (1LL << 63)
-void bytecode_run(Arena *arena, Bc_Emitter *emitter) {
-  byte *func_segment = (byte *)emitter->instructions;
-  byte *bss_segment = emitter->bss_segment;
-  byte *stack = arena_push_array(arena, byte, kilobytes(100));
-  byte *heap = arena_push_array(arena, byte, megabytes(10));
+
+// NOTE(lvl5): with GCC/clang the VM is direct-threaded: opcodes are
+// translated into label addresses before running and every handler
+// jumps to the next one itself. MSVC has no labels-as-values, so it
+// gets the plain switch loop. Handlers are written once for both.
+#ifndef BC_THREADED
+#if defined(__GNUC__) || defined(__clang__)
+#define BC_THREADED 1
+#else
+#define BC_THREADED 0
+#endif
+#endif
+
+// NOTE(lvl5): with BC_LAZY a function's bytecode is generated the first
+// time it is called, functions that never run are never emitted
+#ifndef BC_LAZY
+#define BC_LAZY 1
+#endif
+
+// NOTE(lvl5): linux x86-64 gets native code: the foreign call thunks in
+// bytecode_foreign.c, and hot functions are compiled to x86-64 unless
+// BC_JIT is off, see bytecode_jit.c
+#if defined(__linux__) && defined(__x86_64__)
+#define BC_SYSV 1
+#else
+#define BC_SYSV 0
+#endif
+
+// NOTE(lvl5): BC_PROFILE builds the sampling profiler in, see
+// bytecode_profile.c. the JIT is off by default then, native code
+// doesn't go through dispatch and would never be sampled
+#ifndef BC_PROFILE
+#define BC_PROFILE 0
+#endif
+
+// NOTE(lvl5): BC_STATS counts opcodes, opcode sequences, MEMCOPY sizes and
+// call targets, see bytecode_stats.c. same as profiling, the JIT is off
+// by default so every instruction is counted
+#ifndef BC_STATS
+#define BC_STATS 0
+#endif
+
+#ifndef BC_JIT
+#define BC_JIT (BC_SYSV && !BC_PROFILE && !BC_STATS)
+#endif
+
+typedef struct {
+  void *handler;
+  Bc_Param param;
+} Bc_Threaded_Instruction;
+
+b32 bc_is_jump(Instruction_Kind kind);
+b32 bc_is_branch_imm(Instruction_Kind kind);
+i64 bc_jump_offset(Bc_Instruction *instr);
+
+#if BC_THREADED
+typedef Bc_Threaded_Instruction Bc_Code;
+#else
+typedef Bc_Instruction Bc_Code;
+#endif
+
+// NOTE(lvl5): index of the instruction at in a function's loaded code, -1
+// when it isn't in there
+i64 bc_code_index(Bc_Code *code, i64 count, Bc_Code *at) {
+  i64 result = -1;
+  if (at >= code && at < code + count) {
+    result = at - code;
+  }
+  return result;
+}
+
+#define VM_PARAM (instr->param)
+#define VM_KIND (instr->kind)
+#define VM_HANDLER (instr->handler)
+#define VM_ADVANCE() instr++
+#define VM_NEXT_ADDRESS (instr + 1)
+
+#if BC_THREADED
+#define VM_CASE(kind) LABEL_##kind: VM_STATS_COUNT(kind)
+#define VM_LABEL(kind) [kind] = &&LABEL_##kind
+#define VM_LOOP_BEGIN VM_DISPATCH();
+#define VM_LOOP_END
+#define VM_DISPATCH() VM_PROFILE_TICK(); goto *VM_HANDLER
+#else
+#define VM_LOOP_BEGIN for (;;) { switch (VM_KIND) {
+#define VM_LOOP_END default: assert(false); } }
+#define VM_CASE(kind) case kind: VM_STATS_COUNT(kind)
+#define VM_DISPATCH() VM_PROFILE_TICK(); continue
+#endif
+
+#define VM_NEXT() VM_ADVANCE(); VM_DISPATCH()
+
+#if BC_PROFILE
+#define VM_PROFILE_TICK() if (--profile_countdown == 0) { \
+  profile_countdown = BC_PROFILE_PERIOD; \
+  bc_profile_sample(&vm->profile, emitter, func_code, instr); \
+}
+#define VM_PROFILE_CALL(function) vm->profile.stack[vm->profile.depth++] = (i32)(function)
+#define VM_PROFILE_TAIL(function) vm->profile.stack[vm->profile.depth - 1] = (i32)(function)
+#define VM_PROFILE_RET() vm->profile.depth--
+// NOTE(lvl5): the countdown goes on in callbacks, a short one that runs
+// many times still gets sampled
+#define VM_PROFILE_LEAVE() vm->profile.countdown = profile_countdown
+#define VM_PROFILE_RELOAD() profile_countdown = vm->profile.countdown
+#else
+#define VM_PROFILE_TICK()
+#define VM_PROFILE_CALL(function)
+#define VM_PROFILE_TAIL(function)
+#define VM_PROFILE_RET()
+#define VM_PROFILE_LEAVE()
+#define VM_PROFILE_RELOAD()
+#endif
+
+#if BC_STATS
+#define VM_STATS_COUNT(kind) { \
+  stats->ops[kind]++; \
+  stats->pairs[stats_last*I_COUNT + kind]++; \
+  stats->triples[(stats_before_last*I_COUNT + stats_last)*I_COUNT + kind]++; \
+  stats_before_last = stats_last; \
+  stats_last = kind; \
+}
+#define VM_STATS_CALL(function) bc_stats_call(stats, function)
+#define VM_STATS_SIZE(sizes, size) bc_stats_size(&stats->sizes, size)
+#else
+#define VM_STATS_COUNT(kind)
+#define VM_STATS_CALL(function)
+#define VM_STATS_SIZE(sizes, size)
+#endif
+
+// NOTE(lvl5): address of an instruction in a function's loaded code
+Bc_Code *bc_code_at(Bc_Code *code, i64 index) {
+  Bc_Code *result = code + index;
+  return result;
+}
+
+// NOTE(lvl5): the VM stack and the exec stack are mapped with a guard
+// region after them that faults on access, so running off the end is
+// caught by the OS instead of a check in every handler. a frame bigger
+// than the guard could step over it, a function with one starts with a
+// STACK_PROBE
+#ifndef BC_STACK_SIZE
+#define BC_STACK_SIZE megabytes(8)
+#endif
+#ifndef BC_EXEC_COUNT
+#define BC_EXEC_COUNT (1 << 20)
+#endif
+#ifndef BC_HEAP_SIZE
+#define BC_HEAP_SIZE megabytes(10)
+#endif
+// NOTE(lvl5): what a VM the compiler runs by itself gets, heap included
+#define BC_RUN_ARENA_SIZE megabytes(32)
+#define BC_STACK_GUARD megabytes(1)
+
+#ifdef _WIN32
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#include <signal.h>
+#include <setjmp.h>
+#endif
+
+FILE *bc_open_file(char *name) {
+  FILE *result = 0;
+#ifdef _WIN32
+  fopen_s(&result, name, "wb");
+#else
+  result = fopen(name, "wb");
+#endif
+  return result;
+}
+
+#include "bytecode_profile.c"
+#include "bytecode_stats.c"
+
+#ifdef _MSC_VER
+#define bc_thread_local __declspec(thread)
+#else
+#define bc_thread_local __thread
+#include <pthread.h>
+#endif
+
+// NOTE(lvl5): VMs share the emitter, the jitted code and the foreign
+// thunks. anything that adds to those (emitting a function lazily,
+// compiling, making a thunk or a callback stub) holds this lock. a thread
+// can take it again, code run while emitting a function still tiers up
+#ifdef _WIN32
+SRWLOCK bc_code_mutex = SRWLOCK_INIT;
+#else
+pthread_mutex_t bc_code_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+bc_thread_local i32 bc_code_lock_depth;
+
+// NOTE(lvl5): what the VMs read without the lock. native is stored with
+// release once the code is all there, the counters are only heuristics
+#ifdef _MSC_VER
+#define bc_atomic_load_ptr(p) InterlockedCompareExchangePointer((void *volatile *)(p), 0, 0)
+#define bc_atomic_store_ptr(p, value) InterlockedExchangePointer((void *volatile *)(p), (value))
+#define bc_atomic_load_i32(p) InterlockedCompareExchange((volatile long *)(p), 0, 0)
+#define bc_atomic_store_i32(p, value) InterlockedExchange((volatile long *)(p), (value))
+#define bc_atomic_increment(p) InterlockedIncrement((volatile long *)(p))
+#else
+#define bc_atomic_load_ptr(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define bc_atomic_store_ptr(p, value) __atomic_store_n((p), (value), __ATOMIC_RELEASE)
+#define bc_atomic_load_i32(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define bc_atomic_store_i32(p, value) __atomic_store_n((p), (value), __ATOMIC_RELEASE)
+#define bc_atomic_increment(p) __atomic_add_fetch((p), 1, __ATOMIC_RELAXED)
+#endif
+
+void bc_code_lock() {
+  if (bc_code_lock_depth++ == 0) {
+#ifdef _WIN32
+    AcquireSRWLockExclusive(&bc_code_mutex);
+#else
+    pthread_mutex_lock(&bc_code_mutex);
+#endif
+  }
+}
+
+void bc_code_unlock() {
+  if (--bc_code_lock_depth == 0) {
+#ifdef _WIN32
+    ReleaseSRWLockExclusive(&bc_code_mutex);
+#else
+    pthread_mutex_unlock(&bc_code_mutex);
+#endif
+  }
+}
+
+typedef struct Bc_Foreign_Cache_Entry Bc_Foreign_Cache_Entry;
+
+// NOTE(lvl5): one instance of the VM. it owns its stacks, heap, BSS and
+// scratch memory and only reads the code, so instances can run on
+// different threads at once as long as each has an arena of its own.
+// bytecode_run enters it at __entry and native code re-enters it through
+// callbacks, each entry has its own registers and part of the exec stack
+struct Bc_Vm {
+  Arena *arena;
+  Arena scratch;
+  Bc_Emitter *emitter;
+  byte *bss;
+  byte *stack;
+  u64 stack_size;
+  Bc_Param *exec;
+  u64 exec_count;
+  Bc_Param *exec_top; // where the next entry's exec stack starts
+  Arena heap; // what #init functions allocate
+#ifndef _WIN32
+  sigjmp_buf overflow; // back to bc_vm_run
+#endif
+  
+  Bc_Foreign_Cache_Entry *foreign_cache;
+
+  Bc_Code **func_code;
+  Bc_Code ***loop_exits; // per loop, where each side exit resumes in func_code
+  void **callbacks; // native entry of a function, made on first use
+  void *handlers;
+  Bc_Code *halt; // every entry returns here last
+#if BC_PROFILE
+  Bc_Profile profile;
+#endif
+#if BC_STATS
+  Bc_Stats stats;
+#endif
+  b32 compile_time; // runs #run, which can't make foreign calls
+  Bc_Code *call_site; // the last call the interpreter made
+  char *error; // why the last bc_vm_run stopped
+  char error_text[256]; // error with where it happened
+};
+
+// NOTE(lvl5): the innermost VM running on this thread, callbacks made
+// while it runs enter it
+bc_thread_local Bc_Vm *bc_vm_active;
+
+void bc_vm_execute(Bc_Vm *vm, i64 function, byte *frame);
+
+// NOTE(lvl5): does what a forward byte by byte copy loop does. when the
+// ranges overlap that is neither memcpy nor memmove, so those take the loop
+void bc_copy_bytes(byte *to, byte *from, u64 size) {
+  if ((u64)(to - from) < size || (u64)(from - to) < size) {
+    copy_memory_slow(to, from, size);
+  } else {
+    copy_memory(to, from, size);
+  }
+}
+
+// NOTE(lvl5): on windows a stack is only reserved, the first pages are
+// committed here and the rest by bc_vm_filter when they're first touched
+#define BC_COMMIT_SIZE kilobytes(64)
+
+byte *bc_alloc_guarded(u64 size) {
+#ifdef _WIN32
+  byte *result = VirtualAlloc(0, size + BC_STACK_GUARD, MEM_RESERVE, PAGE_NOACCESS);
+  assert(result);
+  VirtualAlloc(result, size < BC_COMMIT_SIZE ? size : BC_COMMIT_SIZE, MEM_COMMIT, PAGE_READWRITE);
+#else
+  byte *result = mmap(0, size + BC_STACK_GUARD, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  assert(result != MAP_FAILED);
+  mprotect(result, size, PROT_READ | PROT_WRITE);
+#endif
+  return result;
+}
+
+void bc_free_guarded(byte *memory, u64 size) {
+#ifdef _WIN32
+  VirtualFree(memory, 0, MEM_RELEASE);
+#else
+  munmap(memory, size + BC_STACK_GUARD);
+#endif
+}
+
+b32 bc_in_guard(byte *address, byte *memory, u64 size) {
+  b32 result = address >= memory + size && address < memory + size + BC_STACK_GUARD;
+  return result;
+}
+
+#ifdef _WIN32
+// NOTE(lvl5): commits the part of a stack address is in, false if it
+// isn't in the stack
+b32 bc_commit_guarded(byte *address, byte *memory, u64 size) {
+  b32 result = address >= memory && address < memory + size;
+  if (result) {
+    u64 offset = (u64)(address - memory) & ~(u64)(BC_COMMIT_SIZE - 1);
+    u64 commit = size - offset < BC_COMMIT_SIZE ? size - offset : BC_COMMIT_SIZE;
+    result = VirtualAlloc(memory + offset, commit, MEM_COMMIT, PAGE_READWRITE) != 0;
+  }
+  return result;
+}
+
+// NOTE(lvl5): the __except filter around a VM run. a touch of a stack page
+// that isn't committed yet commits it and goes on, one in a guard region
+// or a native stack overflow goes back to bc_vm_run, anything else isn't
+// ours
+int bc_vm_filter(Bc_Vm *vm, EXCEPTION_POINTERS *exception) {
+  EXCEPTION_RECORD *record = exception->ExceptionRecord;
+  int result = EXCEPTION_CONTINUE_SEARCH;
+  if (record->ExceptionCode == EXCEPTION_STACK_OVERFLOW) {
+    result = EXCEPTION_EXECUTE_HANDLER;
+  } else if (record->ExceptionCode == EXCEPTION_ACCESS_VIOLATION) {
+    byte *address = (byte *)record->ExceptionInformation[1];
+    byte *exec = (byte *)vm->exec;
+    u64 exec_size = vm->exec_count*sizeof(Bc_Param);
+    if (bc_commit_guarded(address, vm->stack, vm->stack_size) ||
+        bc_commit_guarded(address, exec, exec_size)) {
+      result = EXCEPTION_CONTINUE_EXECUTION;
+    } else if (bc_in_guard(address, vm->stack, vm->stack_size) ||
+               bc_in_guard(address, exec, exec_size)) {
+      result = EXCEPTION_EXECUTE_HANDLER;
+    }
+  }
+  return result;
+}
+#else
+// NOTE(lvl5): the lowest address this thread's C stack can grow to
+bc_thread_local byte *bc_native_stack_end;
+
+// NOTE(lvl5): a fault in a guard region of the running VM goes back to
+// bc_vm_run, anything else is a real crash and gets the default action.
+// jitted functions keep their return addresses on the C stack, so deep
+// recursion runs out of that before the VM stack and counts too
+void bc_vm_fault(int signal_number, siginfo_t *info, void *context) {
+  Bc_Vm *vm = bc_vm_active;
+  byte *address = (byte *)info->si_addr;
+  if (vm && (bc_in_guard(address, vm->stack, vm->stack_size) ||
+             bc_in_guard(address, (byte *)vm->exec, vm->exec_count*sizeof(Bc_Param)) ||
+             (address < bc_native_stack_end && address >= bc_native_stack_end - BC_STACK_GUARD))) {
+    siglongjmp(vm->overflow, 1);
+  }
+  signal(signal_number, SIG_DFL);
+}
+
+// NOTE(lvl5): the alternate signal stack and the C stack's bounds are per
+// thread, so every thread that runs a VM sets them up
+void bc_vm_catch_faults() {
+  static bc_thread_local b32 installed = false;
+  if (!installed) {
+    installed = true;
+    pthread_attr_t attributes;
+    void *stack_end = 0;
+    size_t stack_size = 0;
+    if (pthread_getattr_np(pthread_self(), &attributes) == 0) {
+      pthread_attr_getstack(&attributes, &stack_end, &stack_size);
+      pthread_attr_destroy(&attributes);
+    }
+    bc_native_stack_end = (byte *)stack_end;
+    
+    // NOTE(lvl5): the handler can't run on a stack that just overflowed
+    stack_t alternate = {0};
+    alternate.ss_size = kilobytes(64);
+    alternate.ss_sp = mmap(0, alternate.ss_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    sigaltstack(&alternate, 0);
+    
+    struct sigaction action = {0};
+    action.sa_sigaction = bc_vm_fault;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigaction(SIGSEGV, &action, 0);
+  }
+}
+#endif
+
+void bc_emit_function(Bc_Emitter *, Bc_Function *);
+
+#include "bytecode_jit.c"
+#include "bytecode_foreign.c"
+
+// NOTE(lvl5): arguments are on the VM stack after the return value slot,
+// the result is written back to stack + 0
+void bc_call_foreign_function(Bc_Vm *vm, u64 address, Bc_Foreign_Sig *sig, byte *stack) {
+#if BC_SYSV
+  Bc_Foreign_Thunk thunk = bc_foreign_thunk(vm->foreign_cache, sig);
+  thunk((void *)address, stack, bc_callback_slot(vm->bss));
+#else
+  i32 arg_count = sig->arg_count;
+  if (arg_count < 4) arg_count = 4;
   
-  u32 stack_size = 0;
+  // NOTE(lvl5): on the C stack, this runs on every foreign call
+  Bc_Param args[32] = {0};
+  assert(arg_count <= array_count(args));
   
-  Bc_Param exec[64];
-  u32 exec_count = 0;
+  i32 return_size = sig->ret.size;
+  i32 stack_offset = return_size; // for return value
   
-  b32 is_running = true;
-  Bc_Instruction *instr = emitter->instructions + emitter->entry_instruction_index;
+  for (i32 arg_index = 0; arg_index < sig->arg_count; arg_index++) {
+    i32 size = sig->args[arg_index].size;
+    Bc_Param *arg = (Bc_Param *)(stack + stack_offset);
+    stack_offset += size;
+    
+    if (size <= 8) {
+      args[arg_index] = *arg;
+    } else {
+      args[arg_index] = (Bc_Param){._ptr = arg};
+    }
+  }
   
-  while (is_running) {
-    switch (instr->kind) {
-      case I_COMMENT: {
-        
-      } break;
-      
-      case I_STACK_CHANGE: {
-        Bc_Param param = instr->param;
-        stack += param._i64;
-      } break;
-      
-      case I_CALL: {
-        Bc_Param func_param = exec[--exec_count];
-        Bc_Param address = exec[--exec_count];
-        
-        exec[exec_count++] = instr->param;
-        Code_Type_Func *func = (Code_Type_Func *)func_param._ptr;
-        
-        u64 is_foreign = address._u64 & FOREIGN_FUNCTION_PTR_BIT;
-        if (is_foreign) {
-          address._u64 &= ~FOREIGN_FUNCTION_PTR_BIT;
-          i32 arg_count = sb_count(func->params);
-          if (arg_count < 4) arg_count = 4;
-          
-          Bc_Param *args = sb_new(scratch_arena, Bc_Param, arg_count);
-          
-          Code_Type *return_type = get_final_type(func->return_type);
-          i32 return_size = 0;
-          if (return_type != builtin_void) {
-            return_size = get_size_of_type(func->return_type);
-          }
-          i32 stack_offset = return_size; // for return value
-          
-          for (u32 arg_index = 0; arg_index < sb_count(func->params); arg_index++) {
-            Code_Stmt_Decl *param = func->params[arg_index];
-            i32 size = get_size_of_type(param->type);
-            Bc_Param *arg = (Bc_Param *)(stack + stack_offset);
-            stack_offset += size;
-            
-            if (size <= 8) {
-              sb_push(args, *arg);
-            } else {
-              sb_push(args, (Bc_Param){._ptr = arg});
-            }
-          }
-          
-          // NOTE(lvl5): the call_foreign() function is kinda shitty,
-          // the first 4 args in the array need to point to valid memory
-          // and arg_count has to be >=4
-          Bc_Param result = call_foreign(address._ptr, args, arg_count);
-          
-          if (return_type != builtin_void) {
-            void *dst = stack + 0;
-            switch (return_size) {
-              case 1:
-              *(i8 *)dst = result._i8;
-              break;
-              case 2:
-              *(i16 *)dst = result._i16;
-              break;
-              case 4:
-              *(i32 *)dst = result._i32;
-              break;
-              case 8:
-              *(i64 *)dst = result._i64;
-              break;
-              
-              default:
-              copy_memory_slow(dst, result._ptr, return_size);
-              break;
-            }
-            
-          }
-          
-          // NOTE(lvl5): pop the return instruction address off the exec, we don't need it
-          exec_count--;
-        } else {
-          instr = (Bc_Instruction *)address._u64;
-          continue;
-        }
-      } break;
-      
-      case I_RET: {
-        Bc_Param address = exec[--exec_count];
-        instr = (Bc_Instruction *)(emitter->instructions + address._u64);
-        continue;
-      } break;
-      
-      case I_CONST: {
-        Bc_Param param = instr->param;
-        exec[exec_count++] = param;
-      } break;
-      
-      case I_CONST_STACK: {
-        Bc_Param param = instr->param;
-        param._u64 += (u64)stack;
-        exec[exec_count++] = param;
-      } break;
-      
-      case I_CONST_BSS: {
-        Bc_Param param = instr->param;
-        param._u64 += (u64)bss_segment;
-        exec[exec_count++] = param;
-      } break;
-      
-      case I_LOAD: {
-        Bc_Param address = exec[--exec_count];
-        u64 *item = address._ptr;
-        exec[exec_count++] = (Bc_Param){ ._u64 = *item };
-      } break;
-      
-      case I_MUL_int: {
-        Bc_Param right = exec[--exec_count];
-        Bc_Param left = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._i64 = left._i64*right._i64 };
-      } break;
-      
-      case I_MUL_f32: {
-        Bc_Param right = exec[--exec_count];
-        Bc_Param left = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._f32 = left._f32*right._f32 };
-      } break;
-      
-      case I_MUL_f64: {
-        Bc_Param right = exec[--exec_count];
-        Bc_Param left = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._f64 = left._f64*right._f64 };
-      } break;
-      
-      case I_ADD_int: {
-        Bc_Param right = exec[--exec_count];
-        Bc_Param left = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._i64 = left._i64 + right._i64 };
-      } break;
-      
-      case I_ADD_f32: {
-        Bc_Param right = exec[--exec_count];
-        Bc_Param left = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._f32 = left._f32 + right._f32 };
-      } break;
-      
-      case I_ADD_f64: {
-        Bc_Param right = exec[--exec_count];
-        Bc_Param left = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._f64 = left._f64 + right._f64 };
-      } break;
-      
-      case I_SUB_int: {
-        Bc_Param right = exec[--exec_count];
-        Bc_Param left = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._i64 = left._i64 + right._i64 };
-      } break;
-      
-      case I_SUB_f32: {
-        Bc_Param right = exec[--exec_count];
-        Bc_Param left = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._f32 = left._f32 + right._f32 };
-      } break;
-      
-      case I_SUB_f64: {
-        Bc_Param right = exec[--exec_count];
-        Bc_Param left = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._f64 = left._f64 + right._f64 };
-      } break;
-      
-      case I_STORE_8: {
-        Bc_Param address = exec[--exec_count];
-        Bc_Param value = exec[--exec_count];
-        i8 *loc = (i8 *)(address._u64);
-        *loc = value._i8;
-      } break;
-      
-      case I_STORE_16: {
-        Bc_Param address = exec[--exec_count];
-        Bc_Param value = exec[--exec_count];
-        i16 *loc = (i16 *)(address._u64);
-        *loc = value._i16;
-      } break;
-      
-      case I_STORE_32: {
-        Bc_Param address = exec[--exec_count];
-        Bc_Param value = exec[--exec_count];
-        i32 *loc = (i32 *)(address._u64);
-        *loc = value._i32;
-      } break;
-      
-      case I_STORE_64: {
-        Bc_Param address = exec[--exec_count];
-        Bc_Param value = exec[--exec_count];
-        i64 *loc = (i64 *)(address._u64);
-        *loc = value._i64;
-      } break;
-      
-      case I_HLT: {
-        is_running = false;
-      } break;
-      
-      
-      case I_DIV_int: {
-        Bc_Param right = exec[--exec_count];
-        Bc_Param left = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._i64 = left._i64/right._i64 };
-      } break;
-      
-      case I_DIV_f32: {
-        Bc_Param right = exec[--exec_count];
-        Bc_Param left = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._f32 = left._f32/right._f32 };
-      } break;
-      
-      case I_DIV_f64: {
-        Bc_Param right = exec[--exec_count];
-        Bc_Param left = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._f64 = left._f64/right._f64 };
-      } break;
-      
-      case I_NEG_int: {
-        Bc_Param right = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._i64 = -right._i64 };
-      } break;
-      
-      case I_NEG_f32: {
-        Bc_Param right = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._f32 = -right._f32 };
-      } break;
-      
-      case I_NEG_f64: {
-        Bc_Param right = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._f64 = -right._f64 };
-      } break;
-      
-      case I_MOD: {
-        Bc_Param right = exec[--exec_count];
-        Bc_Param left = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._i64 = left._i64 % right._i64 };
-      } break;
-      
-      case I_BIT_AND: {
-        Bc_Param right = exec[--exec_count];
-        Bc_Param left = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._i64 = left._i64 & right._i64 };
-      } break;
-      
-      case I_BIT_OR: {
-        Bc_Param right = exec[--exec_count];
-        Bc_Param left = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._i64 = left._i64 | right._i64 };
-      } break;
-      
-      case I_BIT_NOT: {
-        Bc_Param right = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._i64 = ~right._i64 };
-      } break;
-      
-      case I_BIT_XOR: {
-        Bc_Param right = exec[--exec_count];
-        Bc_Param left = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._i64 = left._i64 ^ right._i64 };
-      } break;
-      
-      case I_AND: {
-        Bc_Param right = exec[--exec_count];
-        Bc_Param left = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._i64 = left._i64 && right._i64 };
-      } break;
-      
-      case I_OR: {
-        Bc_Param right = exec[--exec_count];
-        Bc_Param left = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._i64 = left._i64 || right._i64 };
-      } break;
-      
-      case I_NOT: {
-        Bc_Param right = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._i64 = !right._i64 };
-      } break;
-      
-      case I_GT_int: {
-        Bc_Param right = exec[--exec_count];
-        Bc_Param left = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._i64 = left._i64 > right._i64 };
-      } break;
-      
-      case I_GT_f32: {
-        Bc_Param right = exec[--exec_count];
-        Bc_Param left = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._i64 = left._f32 > right._f32 };
-      } break;
-      
-      case I_GT_f64: {
-        Bc_Param right = exec[--exec_count];
-        Bc_Param left = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._i64 = left._f64 > right._f64 };
-      } break;
-      
-      
-      case I_GTE_int: {
-        Bc_Param right = exec[--exec_count];
-        Bc_Param left = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._i64 = left._i64 >= right._i64 };
-      } break;
-      
-      case I_GTE_f32: {
-        Bc_Param right = exec[--exec_count];
-        Bc_Param left = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._i64 = left._f32 >= right._f32 };
-      } break;
-      
-      case I_GTE_f64: {
-        Bc_Param right = exec[--exec_count];
-        Bc_Param left = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._i64 = left._f64 >= right._f64 };
-      } break;
-      
-      case I_EQ: {
-        Bc_Param right = exec[--exec_count];
-        Bc_Param left = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._i64 = left._i64 == right._i64 };
-      } break;
-      
-      case I_NE: {
-        Bc_Param right = exec[--exec_count];
-        Bc_Param left = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._i64 = left._i64 != right._i64 };
-      } break;
-      
-      case I_CAST_int_f32: {
-        Bc_Param right = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._f32 = (f32)right._i64 };
-      } break;
-      
-      case I_CAST_int_f64: {
-        Bc_Param right = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._f64 = (f64)right._i64 };
-      } break;
-      
-      case I_CAST_f32_int: {
-        Bc_Param right = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._i64 = (i64)right._f32 };
-      } break;
-      
-      case I_CAST_f64_int: {
-        Bc_Param right = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._i64 = (i64)right._f64 };
-      } break;
-      
-      case I_CAST_f64_f32: {
-        Bc_Param right = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._f32 = (f32)right._f64 };
-      } break;
-      
-      case I_CAST_f32_f64: {
-        Bc_Param right = exec[--exec_count];
-        exec[exec_count++] = (Bc_Param){ ._f64 = (f64)right._f32 };
-      } break;
-      
-      case I_JMP_TRUE: {
-        Bc_Param right = exec[--exec_count];
-        if (right._i64) {
-          instr += right._i64;
-          continue;
-        }
-      } break;
-      
-      case I_JMP_FALSE: {
-        Bc_Param right = exec[--exec_count];
-        Bc_Param offset = instr->param;
-        if (!right._i64) {
-          instr += offset._i64;
-          continue;
-        }
-      } break;
-      
-      case I_JMP: {
-        Bc_Param offset = instr->param;
-        instr += offset._i64;
-        continue;
-      } break;
-      
-      case I_MEMCOPY: {
-        Bc_Param to = exec[--exec_count];
-        Bc_Param from = exec[--exec_count];
-        Bc_Param size = instr->param;
-        copy_memory_slow((byte *)to._u64, (byte *)from._u64, size._u64);
-      } break;
+  // NOTE(lvl5): the call_foreign() function is kinda shitty,
+  // the first 4 args in the array need to point to valid memory
+  // and arg_count has to be >=4
+  Bc_Param result = call_foreign((void *)address, args, arg_count);
+  
+  if (return_size) {
+    void *dst = stack + 0;
+    switch (return_size) {
+      case 1:
+      *(i8 *)dst = result._i8;
+      break;
+      case 2:
+      *(i16 *)dst = result._i16;
+      break;
+      case 4:
+      *(i32 *)dst = result._i32;
+      break;
+      case 8:
+      *(i64 *)dst = result._i64;
+      break;
       
-      default: assert(false);
+      default:
+      copy_memory(dst, result._ptr, return_size);
+      break;
     }
-    instr++;
+    
   }
+#endif
 }
 
-#define NULL_PARAM (Bc_Param){0}
+// NOTE(lvl5): turns a function's instructions into what the VM runs, in
+// the VM's own arena. vm->handlers is the label table of the threaded VM
+Bc_Code *bc_load_code(Bc_Vm *vm, Bc_Function *func) {
+  Bc_Code *result;
+#if BC_THREADED
+  void **table = vm->handlers;
+  result = arena_push_array(vm->arena, Bc_Code, func->instruction_count);
+  for (i64 i = 0; i < func->instruction_count; i++) {
+    Bc_Instruction *src = func->instructions + i;
+    assert(src->kind < I_COUNT && table[src->kind]);
+    result[i].handler = table[src->kind];
+    result[i].param = src->param;
+  }
+#else
+  result = func->instructions;
+#endif
+  return result;
+}
 
+// NOTE(lvl5): appends code for every function added to the table since the
+// last call. functions that weren't emitted get a one instruction stub,
+// EMIT_FUNC, that emits them on the first call and patches their slot
+void bc_load_new_functions(Bc_Vm *vm) {
+  Bc_Emitter *e = vm->emitter;
+  bc_code_lock();
+  for (u32 i = sb_count(vm->func_code); i < sb_count(e->functions); i++) {
+    Bc_Function *func = e->functions[i];
+    Bc_Code *code;
+    if (func->emitted) {
+      code = bc_load_code(vm, func);
+    } else {
+      Bc_Function stub = {0};
+      stub.instructions = arena_push_struct(vm->arena, Bc_Instruction);
+      stub.instructions->kind = I_EMIT_FUNC;
+      stub.instructions->param._i64 = i;
+      stub.instruction_count = 1;
+      code = bc_load_code(vm, &stub);
+    }
+    sb_push(vm->func_code, code);
+    sb_push(vm->callbacks, 0);
+  }
+  bc_code_unlock();
+}
 
+// NOTE(lvl5): where side exit exit_index of a jitted loop resumes. the
+// loop is shared, the code it resumes in is this VM's, so every VM has a
+// table of its own. exits only change while a loop is compiled, before
+// native is set
+Bc_Code *bc_vm_loop_exit(Bc_Vm *vm, i64 loop_index, i64 exit_index) {
+  Bc_Loop *loop = vm->emitter->loops + loop_index;
+  while (sb_count(vm->loop_exits) <= loop_index) {
+    sb_push(vm->loop_exits, 0);
+  }
+  Bc_Code **exits = vm->loop_exits[loop_index];
+  if (!exits) {
+    u32 count = sb_count(loop->exits);
+    exits = arena_push_array(vm->arena, Bc_Code *, count);
+    zero_memory(exits, count*sizeof(Bc_Code *));
+    vm->loop_exits[loop_index] = exits;
+  }
+  if (!exits[exit_index]) {
+    exits[exit_index] = bc_code_at(vm->func_code[loop->function], loop->exits[exit_index]);
+  }
+  return exits[exit_index];
+}
 
-void bytecode_print(Bc_Emitter *e) {
-  for (u32 i = 0; i < e->instruction_count; i++) {
-    Bc_Instruction instr = e->instructions[i];
-    char *mnemonic = Instruction_Kind_To_String[instr.kind];
-    printf("%04d  %s", i, mnemonic);
+// NOTE(lvl5): runs function on the given frame until it returns. the
+// first entry also loads the code, the handler table only exists in here.
+//
+// frame is the frame pointer register: locals, CONST_STACK and the
+// register forms are addressed off it, the calls move it to the callee's
+// frame and RET moves it back
+void bc_vm_execute(Bc_Vm *vm, i64 function, byte *frame) {
+  Arena *arena = vm->arena;
+  Bc_Emitter *emitter = vm->emitter;
+  byte *bss_segment = vm->bss;
+  
+  Bc_Vm *outer_vm = bc_vm_active;
+  bc_vm_active = vm;
+  
+  // NOTE(lvl5): vm->exec_top is kept up to date before anything that
+  // can come back in, so a callback's exec stack goes after ours
+  Bc_Param *exec_top = vm->exec_top;
+  Bc_Param *exec = exec_top;
+  u32 exec_count = 0;
+  
+#if BC_THREADED
+  static void *handlers[I_COUNT] = {
+    VM_LABEL(I_CONST),
+    VM_LABEL(I_CONST_STACK),
+    VM_LABEL(I_CONST_BSS),
+    VM_LABEL(I_STACK_CHANGE),
+    VM_LABEL(I_STACK_PROBE),
+    VM_LABEL(I_ADD_int),
+    VM_LABEL(I_ADD_f32),
+    VM_LABEL(I_ADD_f64),
+    VM_LABEL(I_SUB_int),
+    VM_LABEL(I_SUB_f32),
+    VM_LABEL(I_SUB_f64),
+    VM_LABEL(I_MUL_int),
+    VM_LABEL(I_MUL_f32),
+    VM_LABEL(I_MUL_f64),
+    VM_LABEL(I_DIV_int),
+    VM_LABEL(I_DIV_f32),
+    VM_LABEL(I_DIV_f64),
+    VM_LABEL(I_NEG_int),
+    VM_LABEL(I_NEG_f32),
+    VM_LABEL(I_NEG_f64),
+    VM_LABEL(I_MOD),
+    VM_LABEL(I_BIT_AND),
+    VM_LABEL(I_BIT_OR),
+    VM_LABEL(I_BIT_NOT),
+    VM_LABEL(I_BIT_XOR),
+    VM_LABEL(I_AND),
+    VM_LABEL(I_OR),
+    VM_LABEL(I_NOT),
+    VM_LABEL(I_LOAD_64),
+    VM_LABEL(I_LOAD_i8),
+    VM_LABEL(I_LOAD_u8),
+    VM_LABEL(I_LOAD_i16),
+    VM_LABEL(I_LOAD_u16),
+    VM_LABEL(I_LOAD_i32),
+    VM_LABEL(I_LOAD_u32),
+    VM_LABEL(I_LOAD_f32),
+    VM_LABEL(I_STORE_8),
+    VM_LABEL(I_STORE_16),
+    VM_LABEL(I_STORE_32),
+    VM_LABEL(I_STORE_64),
+    VM_LABEL(I_GT_int),
+    VM_LABEL(I_GT_f32),
+    VM_LABEL(I_GT_f64),
+    VM_LABEL(I_GTE_int),
+    VM_LABEL(I_GTE_f32),
+    VM_LABEL(I_GTE_f64),
+    VM_LABEL(I_GT_u),
+    VM_LABEL(I_GTE_u),
+    VM_LABEL(I_EQ),
+    VM_LABEL(I_NE),
+    VM_LABEL(I_CAST_int_f32),
+    VM_LABEL(I_CAST_int_f64),
+    VM_LABEL(I_CAST_f32_int),
+    VM_LABEL(I_CAST_f64_int),
+    VM_LABEL(I_CAST_f64_f32),
+    VM_LABEL(I_CAST_f32_f64),
+    VM_LABEL(I_JMP_TRUE),
+    VM_LABEL(I_JMP_FALSE),
+    VM_LABEL(I_JMP),
+    VM_LABEL(I_MEMCOPY),
+    VM_LABEL(I_MEMCOPY_N),
+    VM_LABEL(I_MEMSET_N),
+    VM_LABEL(I_MOV_RR),
+    VM_LABEL(I_MOV_RI),
+    VM_LABEL(I_ADD_int_RR),
+    VM_LABEL(I_ADD_int_RI),
+    VM_LABEL(I_SUB_int_RR),
+    VM_LABEL(I_SUB_int_RI),
+    VM_LABEL(I_MUL_int_RR),
+    VM_LABEL(I_MUL_int_RI),
+    VM_LABEL(I_LOAD_LOCAL),
+    VM_LABEL(I_STORE_LOCAL_64),
+    VM_LABEL(I_ADD_IMM),
+    VM_LABEL(I_JLT_int),
+    VM_LABEL(I_JLT_u),
+    VM_LABEL(I_JLT_f32),
+    VM_LABEL(I_JLT_f64),
+    VM_LABEL(I_JLE_int),
+    VM_LABEL(I_JLE_u),
+    VM_LABEL(I_JLE_f32),
+    VM_LABEL(I_JLE_f64),
+    VM_LABEL(I_JGT_int),
+    VM_LABEL(I_JGT_u),
+    VM_LABEL(I_JGT_f32),
+    VM_LABEL(I_JGT_f64),
+    VM_LABEL(I_JGE_int),
+    VM_LABEL(I_JGE_u),
+    VM_LABEL(I_JGE_f32),
+    VM_LABEL(I_JGE_f64),
+    VM_LABEL(I_JEQ),
+    VM_LABEL(I_JNE),
+    VM_LABEL(I_JLT_int_IMM),
+    VM_LABEL(I_JLE_int_IMM),
+    VM_LABEL(I_JGT_int_IMM),
+    VM_LABEL(I_JGE_int_IMM),
+    VM_LABEL(I_JEQ_IMM),
+    VM_LABEL(I_JNE_IMM),
+    VM_LABEL(I_EMIT_FUNC),
+    VM_LABEL(I_LOOP),
+    VM_LABEL(I_CALL),
+    VM_LABEL(I_CALL_DIRECT),
+    VM_LABEL(I_TAIL_CALL),
+    VM_LABEL(I_RET),
+    VM_LABEL(I_HLT),
+  };
+#endif
+  
+  if (!vm->func_code) {
+#if BC_THREADED
+    vm->handlers = handlers;
+#endif
+    vm->func_code = sb_new(arena, Bc_Code *, 64);
+    vm->callbacks = sb_new(arena, void *, 64);
+    vm->loop_exits = sb_new(arena, Bc_Code **, 16);
+    bc_load_new_functions(vm);
     
-    switch (instr.kind) {
-      case I_COMMENT:
-      printf(" %s", tcstring(*instr.param._comment));
-      break;
-      
-      case I_CONST:
-      case I_CONST_STACK:
-      case I_CONST_BSS:
-      case I_CALL:
-      case I_JMP_TRUE:
-      case I_JMP_FALSE:
-      case I_JMP:
-      case I_STACK_CHANGE:
-      case I_MEMCOPY:
-      printf(" %lld", instr.param._i64);
-      break;
-      
-      case I_SUB_f64:
-      case I_ADD_f64:
+    Bc_Function halt = {0};
+    halt.instructions = arena_push_struct(arena, Bc_Instruction);
+    halt.instructions->kind = I_HLT;
+    halt.instruction_count = 1;
+    vm->halt = bc_load_code(vm, &halt);
+  }
+  
+  // NOTE(lvl5): I_CALL looks the callee up here by function index. a call
+  // that leaves the interpreter can come back in and load more functions,
+  // so these are reloaded after one
+  Bc_Code **func_code = vm->func_code;
+  
+#define VM_RELOAD() func_code = vm->func_code; VM_PROFILE_RELOAD()
+#define VM_LEAVE() vm->exec_top = exec + exec_count; VM_PROFILE_LEAVE()
+  
+  exec[exec_count++] = (Bc_Param){ ._ptr = frame };
+  exec[exec_count++] = (Bc_Param){ ._ptr = vm->halt };
+  Bc_Code *instr = func_code[function];
+  
+#if BC_PROFILE
+  i32 profile_depth = vm->profile.depth;
+  i32 profile_countdown = vm->profile.countdown;
+  VM_PROFILE_CALL(function);
+#endif
+#if BC_STATS
+  // NOTE(lvl5): I_NONE stands for nothing ran before, in a new entry
+  // the last instructions are in some other part of the program
+  Bc_Stats *stats = &vm->stats;
+  u32 stats_last = I_NONE;
+  u32 stats_before_last = I_NONE;
+  VM_STATS_CALL(function);
+#endif
+  
+  VM_LOOP_BEGIN
+    VM_CASE(I_STACK_CHANGE) {
+      Bc_Param param = VM_PARAM;
+      frame += param._i64;
+    } VM_NEXT();
+    
+    // NOTE(lvl5): a frame that doesn't fit touches the guard, so it's
+    // reported like any other overflow
+    VM_CASE(I_STACK_PROBE) {
+      if (frame + VM_PARAM._i64 > vm->stack + vm->stack_size) {
+        *(volatile byte *)(vm->stack + vm->stack_size) = 0;
+      }
+    } VM_NEXT();
+    
+    // NOTE(lvl5): a call into the VM pushes the caller's frame and the
+    // return address, RET pops both
+    VM_CASE(I_CALL) {
+      vm->call_site = instr;
+      byte *callee_frame = frame + VM_PARAM._i64;
+      Bc_Param signature = exec[--exec_count];
+      Bc_Param address = exec[--exec_count];
+      
+      u64 is_foreign = address._u64 & FOREIGN_FUNCTION_PTR_BIT;
+      if (is_foreign && vm->compile_time) {
+        vm->error = "#run can't call #foreign functions";
+        VM_LEAVE();
+        goto bytecode_halt;
+      } else if (is_foreign) {
+#if BC_STATS
+        stats->foreign_calls++;
+#endif
+        Bc_Foreign_Sig *sig = emitter->signatures[signature._i64];
+        VM_LEAVE();
+        bc_call_foreign_function(vm, address._u64 & ~FOREIGN_FUNCTION_PTR_BIT, sig, callee_frame);
+        VM_RELOAD();
+#if BC_JIT
+      } else if (bc_jit_tier_up(vm, emitter->functions[address._i64])) {
+        Bc_Jit_Func native = (Bc_Jit_Func)bc_atomic_load_ptr(&emitter->functions[address._i64]->native);
+        VM_LEAVE();
+        native(callee_frame, bss_segment);
+        VM_RELOAD();
+#endif
+      } else {
+        VM_STATS_CALL(address._i64);
+        assert(address._u64 < sb_count(func_code));
+        exec[exec_count++] = (Bc_Param){ ._ptr = frame };
+        exec[exec_count++] = (Bc_Param){ ._ptr = VM_NEXT_ADDRESS };
+        VM_PROFILE_CALL(address._i64);
+        frame = callee_frame;
+        instr = func_code[address._i64];
+        VM_DISPATCH();
+      }
+    } VM_NEXT();
+    
+    VM_CASE(I_CALL_DIRECT) {
+      vm->call_site = instr;
+      Bc_Call call = VM_PARAM._call;
+      byte *callee_frame = frame + call.frame;
+      VM_STATS_CALL(call.function);
+#if BC_JIT
+      if (bc_jit_tier_up(vm, emitter->functions[call.function])) {
+        Bc_Jit_Func native = (Bc_Jit_Func)bc_atomic_load_ptr(&emitter->functions[call.function]->native);
+        VM_LEAVE();
+        native(callee_frame, bss_segment);
+        VM_RELOAD();
+        VM_NEXT();
+      }
+#endif
+      exec[exec_count++] = (Bc_Param){ ._ptr = frame };
+      exec[exec_count++] = (Bc_Param){ ._ptr = VM_NEXT_ADDRESS };
+      VM_PROFILE_CALL(call.function);
+      frame = callee_frame;
+      instr = func_code[call.function];
+    } VM_DISPATCH();
+    
+    // NOTE(lvl5): the arguments have already been moved down into this
+    // frame, the callee returns straight to our caller
+    VM_CASE(I_TAIL_CALL) {
+      vm->call_site = instr;
+      i64 function = VM_PARAM._i64;
+      VM_STATS_CALL(function);
+#if BC_JIT
+      if (bc_jit_tier_up(vm, emitter->functions[function])) {
+        Bc_Jit_Func native = (Bc_Jit_Func)bc_atomic_load_ptr(&emitter->functions[function]->native);
+        VM_LEAVE();
+        native(frame, bss_segment);
+        VM_RELOAD();
+        instr = (Bc_Code *)exec[--exec_count]._ptr;
+        frame = (byte *)exec[--exec_count]._ptr;
+        VM_PROFILE_RET();
+        VM_DISPATCH();
+      }
+#endif
+      VM_PROFILE_TAIL(function);
+      instr = func_code[function];
+    } VM_DISPATCH();
+    
+    VM_CASE(I_RET) {
+      instr = (Bc_Code *)exec[--exec_count]._ptr;
+      frame = (byte *)exec[--exec_count]._ptr;
+      VM_PROFILE_RET();
+    } VM_DISPATCH();
+    
+    VM_CASE(I_CONST) {
+      Bc_Param param = VM_PARAM;
+      exec[exec_count++] = param;
+    } VM_NEXT();
+    
+    VM_CASE(I_CONST_STACK) {
+      Bc_Param param = VM_PARAM;
+      param._u64 += (u64)frame;
+      exec[exec_count++] = param;
+    } VM_NEXT();
+    
+    VM_CASE(I_CONST_BSS) {
+      Bc_Param param = VM_PARAM;
+      param._u64 += (u64)bss_segment;
+      exec[exec_count++] = param;
+    } VM_NEXT();
+    
+    VM_CASE(I_LOAD_64) {
+      Bc_Param address = exec[--exec_count];
+      u64 *item = address._ptr;
+      exec[exec_count++] = (Bc_Param){ ._u64 = *item };
+    } VM_NEXT();
+    
+    VM_CASE(I_LOAD_i8) {
+      Bc_Param address = exec[exec_count-1];
+      exec[exec_count-1]._i64 = *(i8 *)address._ptr;
+    } VM_NEXT();
+    
+    VM_CASE(I_LOAD_u8) {
+      Bc_Param address = exec[exec_count-1];
+      exec[exec_count-1]._u64 = *(u8 *)address._ptr;
+    } VM_NEXT();
+    
+    VM_CASE(I_LOAD_i16) {
+      Bc_Param address = exec[exec_count-1];
+      exec[exec_count-1]._i64 = *(i16 *)address._ptr;
+    } VM_NEXT();
+    
+    VM_CASE(I_LOAD_u16) {
+      Bc_Param address = exec[exec_count-1];
+      exec[exec_count-1]._u64 = *(u16 *)address._ptr;
+    } VM_NEXT();
+    
+    VM_CASE(I_LOAD_i32) {
+      Bc_Param address = exec[exec_count-1];
+      exec[exec_count-1]._i64 = *(i32 *)address._ptr;
+    } VM_NEXT();
+    
+    VM_CASE(I_LOAD_u32) {
+      Bc_Param address = exec[exec_count-1];
+      exec[exec_count-1]._u64 = *(u32 *)address._ptr;
+    } VM_NEXT();
+    
+    VM_CASE(I_LOAD_f32) {
+      Bc_Param address = exec[exec_count-1];
+      Bc_Param value = {0};
+      value._f32 = *(f32 *)address._ptr;
+      exec[exec_count-1] = value;
+    } VM_NEXT();
+    
+    VM_CASE(I_MUL_int) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param left = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._i64 = left._i64*right._i64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_MUL_f32) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param left = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._f32 = left._f32*right._f32 };
+    } VM_NEXT();
+    
+    VM_CASE(I_MUL_f64) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param left = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._f64 = left._f64*right._f64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_ADD_int) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param left = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._i64 = left._i64 + right._i64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_ADD_f32) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param left = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._f32 = left._f32 + right._f32 };
+    } VM_NEXT();
+    
+    VM_CASE(I_ADD_f64) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param left = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._f64 = left._f64 + right._f64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_SUB_int) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param left = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._i64 = left._i64 - right._i64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_SUB_f32) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param left = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._f32 = left._f32 - right._f32 };
+    } VM_NEXT();
+    
+    VM_CASE(I_SUB_f64) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param left = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._f64 = left._f64 - right._f64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_STORE_8) {
+      Bc_Param address = exec[--exec_count];
+      Bc_Param value = exec[--exec_count];
+      i8 *loc = (i8 *)(address._u64);
+      *loc = value._i8;
+    } VM_NEXT();
+    
+    VM_CASE(I_STORE_16) {
+      Bc_Param address = exec[--exec_count];
+      Bc_Param value = exec[--exec_count];
+      i16 *loc = (i16 *)(address._u64);
+      *loc = value._i16;
+    } VM_NEXT();
+    
+    VM_CASE(I_STORE_32) {
+      Bc_Param address = exec[--exec_count];
+      Bc_Param value = exec[--exec_count];
+      i32 *loc = (i32 *)(address._u64);
+      *loc = value._i32;
+    } VM_NEXT();
+    
+    VM_CASE(I_STORE_64) {
+      Bc_Param address = exec[--exec_count];
+      Bc_Param value = exec[--exec_count];
+      i64 *loc = (i64 *)(address._u64);
+      *loc = value._i64;
+    } VM_NEXT();
+    
+    VM_CASE(I_HLT) {
+      goto bytecode_halt;
+    }
+    
+    
+    VM_CASE(I_DIV_int) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param left = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._i64 = left._i64/right._i64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_DIV_f32) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param left = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._f32 = left._f32/right._f32 };
+    } VM_NEXT();
+    
+    VM_CASE(I_DIV_f64) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param left = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._f64 = left._f64/right._f64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_NEG_int) {
+      Bc_Param right = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._i64 = -right._i64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_NEG_f32) {
+      Bc_Param right = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._f32 = -right._f32 };
+    } VM_NEXT();
+    
+    VM_CASE(I_NEG_f64) {
+      Bc_Param right = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._f64 = -right._f64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_MOD) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param left = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._i64 = left._i64 % right._i64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_BIT_AND) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param left = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._i64 = left._i64 & right._i64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_BIT_OR) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param left = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._i64 = left._i64 | right._i64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_BIT_NOT) {
+      Bc_Param right = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._i64 = ~right._i64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_BIT_XOR) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param left = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._i64 = left._i64 ^ right._i64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_AND) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param left = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._i64 = left._i64 && right._i64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_OR) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param left = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._i64 = left._i64 || right._i64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_NOT) {
+      Bc_Param right = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._i64 = !right._i64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_GT_int) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param left = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._i64 = left._i64 > right._i64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_GT_f32) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param left = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._i64 = left._f32 > right._f32 };
+    } VM_NEXT();
+    
+    VM_CASE(I_GT_f64) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param left = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._i64 = left._f64 > right._f64 };
+    } VM_NEXT();
+    
+    
+    VM_CASE(I_GTE_int) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param left = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._i64 = left._i64 >= right._i64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_GTE_f32) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param left = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._i64 = left._f32 >= right._f32 };
+    } VM_NEXT();
+    
+    VM_CASE(I_GTE_f64) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param left = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._i64 = left._f64 >= right._f64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_GT_u) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param left = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._i64 = left._u64 > right._u64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_GTE_u) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param left = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._i64 = left._u64 >= right._u64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_EQ) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param left = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._i64 = left._i64 == right._i64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_NE) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param left = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._i64 = left._i64 != right._i64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_CAST_int_f32) {
+      Bc_Param right = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._f32 = (f32)right._i64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_CAST_int_f64) {
+      Bc_Param right = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._f64 = (f64)right._i64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_CAST_f32_int) {
+      Bc_Param right = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._i64 = (i64)right._f32 };
+    } VM_NEXT();
+    
+    VM_CASE(I_CAST_f64_int) {
+      Bc_Param right = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._i64 = (i64)right._f64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_CAST_f64_f32) {
+      Bc_Param right = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._f32 = (f32)right._f64 };
+    } VM_NEXT();
+    
+    VM_CASE(I_CAST_f32_f64) {
+      Bc_Param right = exec[--exec_count];
+      exec[exec_count++] = (Bc_Param){ ._f64 = (f64)right._f32 };
+    } VM_NEXT();
+    
+    VM_CASE(I_JMP_TRUE) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param offset = VM_PARAM;
+      if (right._i64) {
+        instr += offset._i64;
+        VM_DISPATCH();
+      }
+    } VM_NEXT();
+    
+    VM_CASE(I_JMP_FALSE) {
+      Bc_Param right = exec[--exec_count];
+      Bc_Param offset = VM_PARAM;
+      if (!right._i64) {
+        instr += offset._i64;
+        VM_DISPATCH();
+      }
+    } VM_NEXT();
+    
+    VM_CASE(I_JMP) {
+      Bc_Param offset = VM_PARAM;
+      instr += offset._i64;
+    } VM_DISPATCH();
+    
+    VM_CASE(I_MEMCOPY) {
+      Bc_Param to = exec[--exec_count];
+      Bc_Param from = exec[--exec_count];
+      Bc_Param size = VM_PARAM;
+      VM_STATS_SIZE(memcopy, size._u64);
+      copy_memory((byte *)to._u64, (byte *)from._u64, size._u64);
+    } VM_NEXT();
+    
+    VM_CASE(I_MEMCOPY_N) {
+      Bc_Param size = exec[--exec_count];
+      Bc_Param to = exec[--exec_count];
+      Bc_Param from = exec[--exec_count];
+      VM_STATS_SIZE(memcopy_n, size._u64);
+      bc_copy_bytes((byte *)to._u64, (byte *)from._u64, size._u64);
+    } VM_NEXT();
+    
+    VM_CASE(I_MEMSET_N) {
+      Bc_Param size = exec[--exec_count];
+      Bc_Param to = exec[--exec_count];
+      Bc_Param value = exec[--exec_count];
+      set_memory((byte *)to._u64, value._u8, size._u64);
+    } VM_NEXT();
+    
+#define REG(offset) (*(i64 *)(frame + (offset)))
+    
+    VM_CASE(I_MOV_RR) {
+      Bc_Regs r = VM_PARAM._regs;
+      REG(r.dst) = REG(r.a);
+    } VM_NEXT();
+    
+    VM_CASE(I_MOV_RI) {
+      Bc_Regs r = VM_PARAM._regs;
+      REG(r.dst) = r.imm;
+    } VM_NEXT();
+    
+    VM_CASE(I_ADD_int_RR) {
+      Bc_Regs r = VM_PARAM._regs;
+      REG(r.dst) = REG(r.a) + REG(r.b);
+    } VM_NEXT();
+    
+    VM_CASE(I_ADD_int_RI) {
+      Bc_Regs r = VM_PARAM._regs;
+      REG(r.dst) = REG(r.a) + r.imm;
+    } VM_NEXT();
+    
+    VM_CASE(I_SUB_int_RR) {
+      Bc_Regs r = VM_PARAM._regs;
+      REG(r.dst) = REG(r.a) - REG(r.b);
+    } VM_NEXT();
+    
+    VM_CASE(I_SUB_int_RI) {
+      Bc_Regs r = VM_PARAM._regs;
+      REG(r.dst) = REG(r.a) - r.imm;
+    } VM_NEXT();
+    
+    VM_CASE(I_MUL_int_RR) {
+      Bc_Regs r = VM_PARAM._regs;
+      REG(r.dst) = REG(r.a)*REG(r.b);
+    } VM_NEXT();
+    
+    VM_CASE(I_MUL_int_RI) {
+      Bc_Regs r = VM_PARAM._regs;
+      REG(r.dst) = REG(r.a)*r.imm;
+    } VM_NEXT();
+    
+#undef REG
+    
+    VM_CASE(I_LOAD_LOCAL) {
+      Bc_Param offset = VM_PARAM;
+      exec[exec_count++] = (Bc_Param){ ._u64 = *(u64 *)(frame + offset._i64) };
+    } VM_NEXT();
+    
+    VM_CASE(I_STORE_LOCAL_64) {
+      Bc_Param offset = VM_PARAM;
+      Bc_Param value = exec[--exec_count];
+      *(i64 *)(frame + offset._i64) = value._i64;
+    } VM_NEXT();
+    
+    VM_CASE(I_ADD_IMM) {
+      Bc_Param imm = VM_PARAM;
+      exec[exec_count-1]._i64 += imm._i64;
+    } VM_NEXT();
+    
+#define VM_CMP_JMP(kind, field, op) \
+    VM_CASE(kind) { \
+      Bc_Param right = exec[--exec_count]; \
+      Bc_Param left = exec[--exec_count]; \
+      if (left.field op right.field) { \
+        instr += VM_PARAM._i64; \
+        VM_DISPATCH(); \
+      } \
+    } VM_NEXT();
+    
+    VM_CMP_JMP(I_JLT_int, _i64, <)
+    VM_CMP_JMP(I_JLT_u, _u64, <)
+    VM_CMP_JMP(I_JLT_f32, _f32, <)
+    VM_CMP_JMP(I_JLT_f64, _f64, <)
+
+    VM_CMP_JMP(I_JLE_int, _i64, <=)
+    VM_CMP_JMP(I_JLE_u, _u64, <=)
+    VM_CMP_JMP(I_JLE_f32, _f32, <=)
+    VM_CMP_JMP(I_JLE_f64, _f64, <=)
+
+    VM_CMP_JMP(I_JGT_int, _i64, >)
+    VM_CMP_JMP(I_JGT_u, _u64, >)
+    VM_CMP_JMP(I_JGT_f32, _f32, >)
+    VM_CMP_JMP(I_JGT_f64, _f64, >)
+
+    VM_CMP_JMP(I_JGE_int, _i64, >=)
+    VM_CMP_JMP(I_JGE_u, _u64, >=)
+    VM_CMP_JMP(I_JGE_f32, _f32, >=)
+    VM_CMP_JMP(I_JGE_f64, _f64, >=)
+
+    VM_CMP_JMP(I_JEQ, _i64, ==)
+    VM_CMP_JMP(I_JNE, _i64, !=)
+    
+#define VM_CMP_JMP_IMM(kind, op) \
+    VM_CASE(kind) { \
+      Bc_Branch branch = VM_PARAM._branch; \
+      Bc_Param left = exec[--exec_count]; \
+      if (left._i64 op (i64)branch.imm) { \
+        instr += branch.offset; \
+        VM_DISPATCH(); \
+      } \
+    } VM_NEXT();
+    
+    VM_CMP_JMP_IMM(I_JLT_int_IMM, <)
+    VM_CMP_JMP_IMM(I_JLE_int_IMM, <=)
+    VM_CMP_JMP_IMM(I_JGT_int_IMM, >)
+    VM_CMP_JMP_IMM(I_JGE_int_IMM, >=)
+    VM_CMP_JMP_IMM(I_JEQ_IMM, ==)
+    VM_CMP_JMP_IMM(I_JNE_IMM, !=)
+    
+    VM_CASE(I_LOOP) {
+#if BC_JIT
+      i64 index = VM_PARAM._i64;
+      if (bc_jit_trace_up(vm, index)) {
+        Bc_Jit_Trace native = (Bc_Jit_Trace)bc_atomic_load_ptr(&emitter->loops[index].native);
+        Bc_Jit_Exit exit = {0};
+        exit.exec = exec + exec_count;
+        VM_LEAVE();
+        i64 exit_index = native(frame, bss_segment, &exit);
+        VM_RELOAD();
+        frame = exit.stack;
+        exec_count += (u32)exit.exec_count;
+        instr = bc_vm_loop_exit(vm, index, exit_index);
+        VM_DISPATCH();
+      }
+#endif
+    } VM_NEXT();
+    
+    VM_CASE(I_EMIT_FUNC) {
+      i64 index = VM_PARAM._i64;
+      VM_LEAVE();
+      bc_code_lock();
+      bc_emit_function(emitter, emitter->functions[index]);
+      bc_code_unlock();
+      vm->func_code[index] = bc_load_code(vm, emitter->functions[index]);
+      // NOTE(lvl5): the body may have declared functions of its own
+      bc_load_new_functions(vm);
+      VM_RELOAD();
+      instr = func_code[index];
+    } VM_DISPATCH();
+    
+  VM_LOOP_END
+  
+  bytecode_halt:;
+  vm->exec_top = exec_top;
+#if BC_PROFILE
+  // NOTE(lvl5): HLT leaves without returning
+  vm->profile.depth = profile_depth;
+  vm->profile.countdown = profile_countdown;
+#endif
+  bc_vm_active = outer_vm;
+#undef VM_RELOAD
+#undef VM_LEAVE
+}
+
+// NOTE(lvl5): bss is the segment the VM runs on, 0 gives it a copy of the
+// emitter's. everything the instance allocates goes in arena, which is
+// its own if it runs next to other instances
+void bc_vm_init(Bc_Vm *vm, Arena *arena, Bc_Emitter *emitter, byte *bss) {
+  zero_memory(vm, sizeof(Bc_Vm));
+  vm->arena = arena;
+  vm->emitter = emitter;
+  arena_init_subarena(arena, &vm->scratch, megabytes(1));
+  if (!bss) {
+    bss = bc_alloc_bss(arena);
+    copy_memory(bss, emitter->bss_segment, BC_BSS_SIZE);
+  }
+  vm->bss = bss;
+  vm->stack_size = BC_STACK_SIZE;
+  vm->stack = bc_alloc_guarded(vm->stack_size);
+  vm->exec_count = BC_EXEC_COUNT;
+  vm->exec = (Bc_Param *)bc_alloc_guarded(vm->exec_count*sizeof(Bc_Param));
+  vm->exec_top = vm->exec;
+  arena_init_subarena(arena, &vm->heap, BC_HEAP_SIZE);
+#if BC_SYSV
+  vm->foreign_cache = arena_push_array(arena, Bc_Foreign_Cache_Entry, BC_FOREIGN_CACHE_SIZE);
+  zero_memory(vm->foreign_cache, BC_FOREIGN_CACHE_SIZE*sizeof(Bc_Foreign_Cache_Entry));
+#endif
+#if BC_PROFILE
+  // NOTE(lvl5): every call takes two exec slots
+  bc_profile_init(&vm->profile, arena, vm->exec_count/2 + 1);
+#endif
+#if BC_STATS
+  bc_stats_init(&vm->stats, arena);
+#endif
+}
+
+void bc_vm_free(Bc_Vm *vm) {
+  bc_free_guarded(vm->stack, vm->stack_size);
+  bc_free_guarded((byte *)vm->exec, vm->exec_count*sizeof(Bc_Param));
+}
+
+// NOTE(lvl5): a stack overflow or a #foreign call from #run happens on a
+// call, the last one the interpreter made says which function and line
+// the error is in. jitted code doesn't record its calls, an overflow in
+// there is reported at the call into it
+void bc_vm_locate_error(Bc_Vm *vm) {
+  Bc_Emitter *e = vm->emitter;
+  for (u32 i = 0; vm->call_site && i < sb_count(vm->func_code); i++) {
+    Bc_Function *func = e->functions[i];
+    i64 index = func->emitted ? bc_code_index(vm->func_code[i], func->instruction_count, vm->call_site) : -1;
+    Bc_Source_Span *span = index >= 0 ? bc_find_source_span(func, index) : 0;
+    if (span) {
+      snprintf(vm->error_text, sizeof(vm->error_text), "%s (in %.*s, line %d)",
+               vm->error, (i32)func->name.count, func->name.data, span->line);
+      vm->error = vm->error_text;
+      break;
+    }
+  }
+}
+
+// NOTE(lvl5): runs function on an empty stack until it returns, false if
+// it overflowed. callbacks come back in through bc_vm_execute, this
+// isn't for a VM that's already running
+b32 bc_vm_run(Bc_Vm *vm, i64 function) {
+  vm->error = 0;
+  vm->call_site = 0;
+  vm->exec_top = vm->exec;
+  Bc_Vm *outer_vm = bc_vm_active;
+  i32 lock_depth = bc_code_lock_depth;
+  b32 overflow = false;
+#ifdef _WIN32
+  __try {
+    bc_vm_execute(vm, function, vm->stack);
+  } __except (bc_vm_filter(vm, GetExceptionInformation())) {
+    if (GetExceptionCode() == EXCEPTION_STACK_OVERFLOW) {
+      _resetstkoflw();
+    }
+    overflow = true;
+  }
+#else
+  bc_vm_catch_faults();
+  if (!sigsetjmp(vm->overflow, 1)) {
+    bc_vm_execute(vm, function, vm->stack);
+  } else {
+    overflow = true;
+  }
+#endif
+  if (overflow) {
+    // NOTE(lvl5): the frames that would have put these back are gone. the
+    // code lock can be held, running code emits functions and compiles
+    bc_vm_active = outer_vm;
+    if (bc_code_lock_depth > lock_depth) {
+      bc_code_lock_depth = lock_depth + 1;
+      bc_code_unlock();
+    }
+#if BC_PROFILE
+    vm->profile.depth = 0;
+#endif
+    vm->error = "VM stack overflow";
+  }
+  if (vm->error) {
+    bc_vm_locate_error(vm);
+  }
+  b32 result = !vm->error;
+  return result;
+}
+
+#include "bytecode_snapshot.c"
+
+// NOTE(lvl5): the program runs on the emitter's BSS, what it leaves there
+// can be looked at afterwards
+void bytecode_run(Arena *arena, Bc_Emitter *emitter) {
+  Bc_Vm vm;
+  bc_vm_init(&vm, arena, emitter, emitter->bss_segment);
+  if (!bc_vm_run_init(&vm) || !bc_vm_run(&vm, emitter->entry_function)) {
+    printf("Runtime error: %s\n", vm.error);
+  }
+  
+#if BC_PROFILE
+  bc_profile_report(&vm.profile, emitter, &vm.scratch);
+#endif
+#if BC_STATS
+  bc_stats_report(&vm.stats, emitter, &vm.scratch);
+#endif
+  
+  bc_vm_free(&vm);
+}
+
+// NOTE(lvl5): one of the VMs bytecode_run_threads starts, with an arena
+// and a copy of the BSS of its own
+typedef struct {
+  Bc_Emitter *emitter;
+  Arena arena;
+  Bc_Vm vm;
+} Bc_Vm_Thread;
+
+#ifdef _WIN32
+DWORD WINAPI bc_vm_thread_main(void *data) {
+#else
+void *bc_vm_thread_main(void *data) {
+#endif
+  Bc_Vm_Thread *thread = (Bc_Vm_Thread *)data;
+  Bc_Vm *vm = &thread->vm;
+  bc_vm_init(vm, &thread->arena, thread->emitter, 0);
+  if (!bc_vm_run_init(vm) || !bc_vm_run(vm, thread->emitter->entry_function)) {
+    printf("Runtime error: %s\n", vm->error);
+  }
+  bc_vm_free(vm);
+  return 0;
+}
+
+// NOTE(lvl5): runs the program on count VMs at once, one per thread. they
+// emit, tier up and compile the same functions and loops at the same
+// time, and each sees only its own globals
+void bytecode_run_threads(Bc_Emitter *emitter, i32 count) {
+  Bc_Vm_Thread *threads = (Bc_Vm_Thread *)calloc(count, sizeof(Bc_Vm_Thread));
+#ifdef _WIN32
+  HANDLE *handles = (HANDLE *)calloc(count, sizeof(HANDLE));
+#else
+  pthread_t *handles = (pthread_t *)calloc(count, sizeof(pthread_t));
+#endif
+  for (i32 i = 0; i < count; i++) {
+    Bc_Vm_Thread *thread = threads + i;
+    thread->emitter = emitter;
+    arena_init(&thread->arena, malloc(BC_RUN_ARENA_SIZE), BC_RUN_ARENA_SIZE);
+#ifdef _WIN32
+    handles[i] = CreateThread(0, 0, bc_vm_thread_main, thread, 0, 0);
+#else
+    pthread_create(handles + i, 0, bc_vm_thread_main, thread);
+#endif
+  }
+  for (i32 i = 0; i < count; i++) {
+#ifdef _WIN32
+    WaitForSingleObject(handles[i], INFINITE);
+    CloseHandle(handles[i]);
+#else
+    pthread_join(handles[i], 0);
+#endif
+    free(threads[i].arena.data);
+  }
+  free(handles);
+  free(threads);
+}
+
+#include "bytecode_image.c"
+
+#define NULL_PARAM (Bc_Param){0}
+
+
+
+void bytecode_print_function(Bc_Emitter *e, Bc_Function *func) {
+  printf("func %s (#%lld)\n", tcstring(func->name), func->index);
+  if (!func->emitted) {
+    printf("      // not emitted\n\n");
+    return;
+  }
+  u32 span_index = 0;
+  u32 span_count = sb_count(func->source_spans);
+  
+  for (u32 i = 0; i < func->instruction_count; i++) {
+    for (; span_index < span_count &&
+         func->source_spans[span_index].instruction_index <= i; span_index++) {
+      Bc_Source_Span *span = func->source_spans + span_index;
+      if (e->parser) {
+        printf("      // %s\n", tcstring(bc_source_span_text(e, span)));
+      } else {
+        printf("      // line %d\n", span->line);
+      }
+    }
+    
+    Bc_Instruction instr = func->instructions[i];
+    char *mnemonic = Instruction_Kind_To_String[instr.kind];
+    printf("%04d  %s", i, mnemonic);
+    
+    switch (instr.kind) {
+      case I_CONST:
+      case I_CONST_STACK:
+      case I_CONST_BSS:
+      case I_JMP_TRUE:
+      case I_JMP_FALSE:
+      case I_JMP:
+      case I_STACK_CHANGE:
+      case I_STACK_PROBE:
+      case I_MEMCOPY:
+      case I_LOAD_LOCAL:
+      case I_STORE_LOCAL_64:
+      case I_ADD_IMM:
+      case I_JLT_int:
+      case I_JLT_u:
+      case I_JLT_f32:
+      case I_JLT_f64:
+      case I_JLE_int:
+      case I_JLE_u:
+      case I_JLE_f32:
+      case I_JLE_f64:
+      case I_JGT_int:
+      case I_JGT_u:
+      case I_JGT_f32:
+      case I_JGT_f64:
+      case I_JGE_int:
+      case I_JGE_u:
+      case I_JGE_f32:
+      case I_JGE_f64:
+      case I_JEQ:
+      case I_JNE:
+      case I_EMIT_FUNC:
+      case I_LOOP:
+      case I_CALL:
+      case I_TAIL_CALL:
+      printf(" %lld", instr.param._i64);
+      break;
+      
+      case I_CALL_DIRECT:
+      printf(" #%d %d", instr.param._call.function, instr.param._call.frame);
+      break;
+      
+      case I_JLT_int_IMM:
+      case I_JLE_int_IMM:
+      case I_JGT_int_IMM:
+      case I_JGE_int_IMM:
+      case I_JEQ_IMM:
+      case I_JNE_IMM:
+      printf(" %d %d", instr.param._branch.offset, instr.param._branch.imm);
+      break;
+      
+      case I_SUB_f64:
+      case I_ADD_f64:
       case I_MUL_f64:
       case I_DIV_f64:
       case I_NEG_f64:
@@ -653,13 +2171,22 @@ void bytecode_print(Bc_Emitter *e) {
       case I_AND:
       case I_OR:
       case I_NOT:
-      case I_LOAD:
+      case I_LOAD_64:
+      case I_LOAD_i8:
+      case I_LOAD_u8:
+      case I_LOAD_i16:
+      case I_LOAD_u16:
+      case I_LOAD_i32:
+      case I_LOAD_u32:
+      case I_LOAD_f32:
       case I_STORE_8:
       case I_STORE_16:
       case I_STORE_32:
       case I_STORE_64:
       case I_GT_int:
       case I_GTE_int:
+      case I_GT_u:
+      case I_GTE_u:
       case I_EQ:
       case I_NE:
       case I_CAST_int_f32:
@@ -667,7 +2194,28 @@ void bytecode_print(Bc_Emitter *e) {
       break;
       
       case I_RET:
-      printf("\n");
+      case I_MEMCOPY_N:
+      case I_MEMSET_N:
+      break;
+      
+      case I_MOV_RR:
+      printf(" [%d] [%d]", instr.param._regs.dst, instr.param._regs.a);
+      break;
+      
+      case I_MOV_RI:
+      printf(" [%d] %d", instr.param._regs.dst, instr.param._regs.imm);
+      break;
+      
+      case I_ADD_int_RR:
+      case I_SUB_int_RR:
+      case I_MUL_int_RR:
+      printf(" [%d] [%d] [%d]", instr.param._regs.dst, instr.param._regs.a, instr.param._regs.b);
+      break;
+      
+      case I_ADD_int_RI:
+      case I_SUB_int_RI:
+      case I_MUL_int_RI:
+      printf(" [%d] [%d] %d", instr.param._regs.dst, instr.param._regs.a, instr.param._regs.imm);
       break;
       
       default: assert(false);
@@ -676,385 +2224,1688 @@ void bytecode_print(Bc_Emitter *e) {
     
     printf("\n");
   }
+  printf("\n");
+}
+
+void bytecode_print(Bc_Emitter *e) {
+  for (u32 i = 0; i < sb_count(e->functions); i++) {
+    bytecode_print_function(e, e->functions[i]);
+  }
+}
+
+void bytecode_print_function_stats(Bc_Emitter *e) {
+  u32 function_count = sb_count(e->functions);
+  u32 emitted_count = 0;
+  i64 instruction_count = 0;
+  for (u32 i = 0; i < function_count; i++) {
+    Bc_Function *func = e->functions[i];
+    if (func->emitted) {
+      emitted_count++;
+      instruction_count += func->instruction_count;
+    }
+  }
+  printf("functions: %u, emitted: %u, never emitted: %u, instructions: %lld\n",
+         function_count, emitted_count, function_count - emitted_count, instruction_count);
+}
+
+b32 bc_is_jump(Instruction_Kind kind) {
+  b32 result = kind == I_JMP || kind == I_JMP_TRUE || kind == I_JMP_FALSE ||
+    (kind >= I_JLT_int && kind <= I_JNE_IMM);
+  return result;
+}
+
+b32 bc_is_branch_imm(Instruction_Kind kind) {
+  b32 result = kind >= I_JLT_int_IMM && kind <= I_JNE_IMM;
+  return result;
+}
+
+i64 bc_jump_offset(Bc_Instruction *instr) {
+  i64 result = instr->param._i64;
+  if (bc_is_branch_imm(instr->kind)) {
+    result = instr->param._branch.offset;
+  }
+  return result;
+}
+
+void bc_set_jump_offset(Bc_Instruction *instr, i64 offset) {
+  if (bc_is_branch_imm(instr->kind)) {
+    instr->param._branch.offset = (i32)offset;
+  } else {
+    instr->param._i64 = offset;
+  }
+}
+
+typedef enum {
+  Bc_Compare_LT,
+  Bc_Compare_LE,
+  Bc_Compare_GT,
+  Bc_Compare_GE,
+  Bc_Compare_EQ,
+  Bc_Compare_NE,
+} Bc_Compare;
+
+typedef enum {
+  Bc_Compare_Type_INT,
+  Bc_Compare_Type_U,
+  Bc_Compare_Type_F32,
+  Bc_Compare_Type_F64,
+} Bc_Compare_Type;
+
+Instruction_Kind bc_branch_kind(Bc_Compare cmp, Bc_Compare_Type type) {
+  Instruction_Kind result;
+  if (cmp == Bc_Compare_EQ) {
+    result = I_JEQ;
+  } else if (cmp == Bc_Compare_NE) {
+    result = I_JNE;
+  } else {
+    result = (Instruction_Kind)(I_JLT_int + 4*cmp + type);
+  }
+  return result;
+}
+
+Bc_Compare bc_negate_compare(Bc_Compare cmp) {
+  Bc_Compare result;
+  switch (cmp) {
+    case Bc_Compare_LT: result = Bc_Compare_GE; break;
+    case Bc_Compare_LE: result = Bc_Compare_GT; break;
+    case Bc_Compare_GT: result = Bc_Compare_LE; break;
+    case Bc_Compare_GE: result = Bc_Compare_LT; break;
+    case Bc_Compare_EQ: result = Bc_Compare_NE; break;
+    default: result = Bc_Compare_EQ; break;
+  }
+  return result;
+}
+
+// NOTE(lvl5): the branch a compare followed by JMP_TRUE or JMP_FALSE
+// becomes, I_NONE if there isn't one. float compares don't fuse with
+// JMP_FALSE, !(a < b) isn't a >= b when either is a NaN
+Instruction_Kind bc_peephole_branch(Instruction_Kind cmp, Instruction_Kind jmp) {
+  Instruction_Kind result = I_NONE;
+  b32 on_true = jmp == I_JMP_TRUE;
+  switch (cmp) {
+    case I_GT_int: result = on_true ? I_JGT_int : I_JLE_int; break;
+    case I_GTE_int: result = on_true ? I_JGE_int : I_JLT_int; break;
+    case I_GT_u: result = on_true ? I_JGT_u : I_JLE_u; break;
+    case I_GTE_u: result = on_true ? I_JGE_u : I_JLT_u; break;
+    case I_GT_f32: result = on_true ? I_JGT_f32 : I_NONE; break;
+    case I_GTE_f32: result = on_true ? I_JGE_f32 : I_NONE; break;
+    case I_GT_f64: result = on_true ? I_JGT_f64 : I_NONE; break;
+    case I_GTE_f64: result = on_true ? I_JGE_f64 : I_NONE; break;
+    case I_EQ: result = on_true ? I_JEQ : I_JNE; break;
+    case I_NE: result = on_true ? I_JNE : I_JEQ; break;
+  }
+  return result;
+}
+
+Instruction_Kind bc_peephole_branch_imm(Instruction_Kind kind) {
+  Instruction_Kind result = I_NONE;
+  switch (kind) {
+    case I_JLT_int: result = I_JLT_int_IMM; break;
+    case I_JLE_int: result = I_JLE_int_IMM; break;
+    case I_JGT_int: result = I_JGT_int_IMM; break;
+    case I_JGE_int: result = I_JGE_int_IMM; break;
+    case I_JEQ: result = I_JEQ_IMM; break;
+    case I_JNE: result = I_JNE_IMM; break;
+  }
+  return result;
+}
+
+typedef struct {
+  Bc_Instruction instr;
+  i64 old_index; // index of the first instruction this one came from
+  i64 old_target; // absolute jump target before the pass, or -1
+} Bc_Peephole_Entry;
+
+// NOTE(lvl5): for the dead store check, instructions that don't jump,
+// don't call and don't read memory other than their own local slot
+b32 bc_peephole_is_pure(Bc_Instruction instr, i64 slot) {
+  b32 result = false;
+  switch (instr.kind) {
+    case I_CONST:
+    case I_ADD_IMM:
+    case I_ADD_int:
+    case I_SUB_int:
+    case I_MUL_int:
+    case I_BIT_AND:
+    case I_BIT_OR:
+    case I_BIT_XOR:
+    case I_BIT_NOT:
+    case I_NEG_int:
+    case I_GT_int:
+    case I_GTE_int:
+    case I_GT_u:
+    case I_GTE_u:
+    case I_EQ:
+    case I_NE:
+    case I_NOT:
+    case I_NONE:
+    result = true;
+    break;
+    
+    case I_LOAD_LOCAL:
+    case I_STORE_LOCAL_64:
+    result = instr.param._i64 != slot;
+    break;
+  }
+  return result;
+}
+
+// NOTE(lvl5): runs over a function's instructions after it has been
+// emitted. patterns are matched on the tail of the output as instructions
+// are pushed; an instruction that is a jump target is never folded into
+// the one before it, so every jump still lands on a boundary. jumps are
+// re-targeted at the end
+void bc_peephole(Bc_Emitter *e, Bc_Function *func) {
+  i64 count = func->instruction_count;
+  if (count <= 1) return;
+  
+  // NOTE(lvl5): the side tables are as long as the function, they go on
+  // the emitter's arena and are dropped at the end
+  Arena *arena = e->arena;
+  u64 mark = arena_get_mark(arena);
+  
+  b32 *is_target = arena_push_array(arena, b32, count + 1);
+  zero_memory(is_target, sizeof(b32)*(count + 1));
+  for (i64 i = 0; i < count; i++) {
+    Bc_Instruction *instr = func->instructions + i;
+    if (bc_is_jump(instr->kind)) {
+      i64 target = i + bc_jump_offset(instr);
+      assert(target >= 0 && target <= count);
+      is_target[target] = true;
+    }
+  }
+  
+  // NOTE(lvl5): new_index[old] is the output position an old index maps to
+  i64 *new_index = arena_push_array(arena, i64, count + 1);
+  Bc_Peephole_Entry *out = arena_push_array(arena, Bc_Peephole_Entry, count);
+  i64 out_count = 0;
+  
+#define TAIL(n) (out[out_count - 1 - (n)].instr)
+#define TAIL_IS(n, k) (out_count > (n) && TAIL(n).kind == (k))
+#define FOLDABLE(n) (out_count > (n) && !is_target[out[out_count - 1 - (n)].old_index])
+  
+  for (i64 i = 0; i < count; i++) {
+    Bc_Instruction *instr = func->instructions + i;
+    new_index[i] = out_count;
+    
+    Bc_Peephole_Entry entry;
+    entry.instr = *instr;
+    entry.old_index = i;
+    entry.old_target = bc_is_jump(instr->kind) ? i + bc_jump_offset(instr) : -1;
+    out[out_count++] = entry;
+    
+    b32 changed = true;
+    while (changed) {
+      changed = false;
+      
+      if (TAIL_IS(0, I_LOAD_64) && TAIL_IS(1, I_CONST_STACK) && FOLDABLE(0)) {
+        // CONST_STACK x, LOAD -> LOAD_LOCAL x
+        out_count--;
+        TAIL(0).kind = I_LOAD_LOCAL;
+        changed = true;
+      } else if (TAIL_IS(0, I_STORE_64) && TAIL_IS(1, I_CONST_STACK) && FOLDABLE(0)) {
+        // CONST_STACK x, STORE_64 -> STORE_LOCAL_64 x
+        out_count--;
+        TAIL(0).kind = I_STORE_LOCAL_64;
+        changed = true;
+      } else if ((TAIL_IS(0, I_ADD_int) || TAIL_IS(0, I_SUB_int) || TAIL_IS(0, I_MUL_int)) &&
+                 TAIL_IS(1, I_CONST) && TAIL_IS(2, I_CONST) && 
+                 FOLDABLE(0) && FOLDABLE(1)) {
+        // CONST a, CONST b, op -> CONST (a op b)
+        Instruction_Kind kind = TAIL(0).kind;
+        i64 a = TAIL(2).param._i64;
+        i64 b = TAIL(1).param._i64;
+        i64 value = kind == I_ADD_int ? a + b : kind == I_SUB_int ? a - b : a*b;
+        out_count -= 2;
+        TAIL(0).param._i64 = value;
+        changed = true;
+      } else if (TAIL_IS(0, I_ADD_IMM) && TAIL_IS(1, I_CONST) && FOLDABLE(0)) {
+        // CONST a, ADD_IMM b -> CONST (a + b)
+        i64 b = TAIL(0).param._i64;
+        out_count--;
+        TAIL(0).param._i64 += b;
+        changed = true;
+      } else if ((TAIL_IS(0, I_ADD_int) || TAIL_IS(0, I_SUB_int)) &&
+                 TAIL_IS(1, I_CONST) && FOLDABLE(0)) {
+        // CONST k, ADD_int -> ADD_IMM k
+        i64 k = TAIL(1).param._i64;
+        if (TAIL(0).kind == I_SUB_int) k = -k;
+        out_count--;
+        TAIL(0).kind = I_ADD_IMM;
+        TAIL(0).param._i64 = k;
+        changed = true;
+      } else if (TAIL_IS(0, I_ADD_IMM) && TAIL(0).param._i64 == 0) {
+        // ADD_IMM 0 -> nothing
+        out_count--;
+        changed = true;
+      } else if ((TAIL_IS(0, I_JMP_FALSE) || TAIL_IS(0, I_JMP_TRUE)) && FOLDABLE(0) &&
+                 out_count > 1 && bc_peephole_branch(TAIL(1).kind, TAIL(0).kind)) {
+        // compare, JMP_TRUE/JMP_FALSE t -> compare and branch
+        Instruction_Kind branch = bc_peephole_branch(TAIL(1).kind, TAIL(0).kind);
+        Bc_Peephole_Entry jmp = out[out_count - 1];
+        out_count--;
+        TAIL(0).kind = branch;
+        TAIL(0).param = jmp.instr.param;
+        out[out_count - 1].old_target = jmp.old_target;
+        changed = true;
+      } else if (TAIL_IS(1, I_CONST) && FOLDABLE(0) && bc_peephole_branch_imm(TAIL(0).kind) &&
+                 TAIL(1).param._i64 >= I32_MIN && TAIL(1).param._i64 <= I32_MAX) {
+        // CONST k, JLT_int t -> JLT_int_IMM t k
+        i32 k = (i32)TAIL(1).param._i64;
+        Bc_Peephole_Entry jmp = out[out_count - 1];
+        out_count--;
+        TAIL(0).kind = bc_peephole_branch_imm(jmp.instr.kind);
+        TAIL(0).param._branch.offset = 0;
+        TAIL(0).param._branch.imm = k;
+        out[out_count - 1].old_target = jmp.old_target;
+        changed = true;
+      } else if (TAIL_IS(0, I_STORE_LOCAL_64) && TAIL_IS(1, I_LOAD_LOCAL) &&
+                 TAIL(0).param._i64 == TAIL(1).param._i64 && FOLDABLE(0)) {
+        // LOAD_LOCAL x, STORE_LOCAL_64 x -> nothing
+        out_count -= 2;
+        changed = true;
+      } else if (TAIL_IS(0, I_MOV_RR) && TAIL(0).param._regs.dst == TAIL(0).param._regs.a) {
+        // MOV_RR x x -> nothing
+        out_count--;
+        changed = true;
+      } else if (TAIL_IS(0, I_STORE_LOCAL_64)) {
+        // NOTE(lvl5): dead store: an earlier `CONST/LOAD_LOCAL, STORE_LOCAL_64 x`
+        // followed only by pure instructions up to this store to x. the scan
+        // stops at a jump target, a path that comes in there may have left
+        // the value the store takes
+        i64 slot = TAIL(0).param._i64;
+        for (i64 back = 1; back < 16 && back < out_count && FOLDABLE(back - 1); back++) {
+          Bc_Instruction prev = TAIL(back);
+          if (prev.kind == I_STORE_LOCAL_64 && prev.param._i64 == slot) {
+            if (back + 1 < out_count && FOLDABLE(back) && FOLDABLE(back + 1) &&
+                (TAIL(back + 1).kind == I_CONST ||
+                 (TAIL(back + 1).kind == I_LOAD_LOCAL && TAIL(back + 1).param._i64 != slot))) {
+              TAIL(back).kind = I_NONE;
+              TAIL(back + 1).kind = I_NONE;
+            }
+            break;
+          }
+          if (!bc_peephole_is_pure(prev, slot)) break;
+        }
+      }
+    }
+  }
+  
+#undef TAIL
+#undef TAIL_IS
+#undef FOLDABLE
+  
+  // NOTE(lvl5): drop the entries killed by the dead store check
+  i64 *final_index = arena_push_array(arena, i64, out_count + 1);
+  i64 final_count = 0;
+  for (i64 i = 0; i < out_count; i++) {
+    final_index[i] = final_count;
+    if (out[i].instr.kind != I_NONE) {
+      out[final_count++] = out[i];
+    }
+  }
+  final_index[out_count] = final_count;
+  new_index[count] = out_count;
+  
+  for (i64 i = 0; i < final_count; i++) {
+    Bc_Peephole_Entry *entry = out + i;
+    Bc_Instruction *dst = func->instructions + i;
+    *dst = entry->instr;
+    
+    if (entry->old_target >= 0) {
+      i64 target = final_index[new_index[entry->old_target]];
+      bc_set_jump_offset(dst, target - i);
+    }
+  }
+  func->instruction_count = final_count;
+  
+  for (u32 i = 0; i < sb_count(func->source_spans); i++) {
+    Bc_Source_Span *span = func->source_spans + i;
+    span->instruction_index = final_index[new_index[span->instruction_index]];
+  }
+  
+  arena_set_mark(arena, mark);
 }
 
 #define PARAM(T, val) (Bc_Param){ ._##T = val }
 
-void bc_emit_expr(Bc_Emitter *, Code_Expr *);
+void bc_emit_expr(Bc_Emitter *, Code_Node *);
+
+b32 bc_is_load(Instruction_Kind kind) {
+  b32 result = kind >= I_LOAD_64 && kind <= I_LOAD_f32;
+  return result;
+}
+
+// NOTE(lvl5): structs and arrays don't fit on the exec stack, their
+// address is used instead
+b32 bc_by_address(Code_Node *type) {
+  Code_Kind kind = get_final_type(type)->kind;
+  b32 result = kind == Code_Kind_TYPE_STRUCT || kind == Code_Kind_TYPE_ARRAY;
+  return result;
+}
+
+// NOTE(lvl5): the load for a value of this type. a struct or an array is
+// used by address, its LOAD_64 gets dropped again
+Instruction_Kind bc_load_kind(Code_Node *type) {
+  Code_Node *final_type = get_final_type(type);
+  if (final_type->kind == Code_Kind_TYPE_ENUM) {
+    final_type = get_final_type(final_type->t_enum.item_type);
+  }
+  i32 size = get_size_of_type(final_type);
+  b32 is_signed = final_type->kind == Code_Kind_TYPE_INT && final_type->t_int.is_signed;
+
+  Instruction_Kind result = I_LOAD_64;
+  if (bc_by_address(final_type)) {
+  } else if (final_type->kind == Code_Kind_TYPE_FLOAT && size == 4) {
+    result = I_LOAD_f32;
+  } else if (size == 1) {
+    result = is_signed ? I_LOAD_i8 : I_LOAD_u8;
+  } else if (size == 2) {
+    result = is_signed ? I_LOAD_i16 : I_LOAD_u16;
+  } else if (size == 4) {
+    result = is_signed ? I_LOAD_i32 : I_LOAD_u32;
+  }
+  return result;
+}
+
+// NOTE(lvl5): every lvalue ends in its load, without it the address is
+// left on the exec stack
+void bc_drop_load(Bc_Emitter *e) {
+  assert(bc_is_load(e->func->instructions[e->func->instruction_count-1].kind));
+  e->func->instruction_count--;
+}
+
+void bc_emit_address(Bc_Emitter *e, Code_Node *expr) {
+  bc_emit_expr(e, expr);
+  bc_drop_load(e);
+}
+
+// NOTE(lvl5): what goes on the exec stack for expr, its address if it's
+// used by address
+void bc_emit_value(Bc_Emitter *e, Code_Node *expr) {
+  bc_emit_expr(e, expr);
+  if (bc_by_address(expr->type)) {
+    bc_drop_load(e);
+  }
+}
 
 void bc_store_size(Bc_Emitter *e, i32 size) {
   switch (size) {
     case 1:
     bc_instruction(e, I_STORE_8, NULL_PARAM);
     break;
-    
+
     case 2:
     bc_instruction(e, I_STORE_16, NULL_PARAM);
     break;
-    
+
     case 4:
     bc_instruction(e, I_STORE_32, NULL_PARAM);
     break;
-    
+
     case 8:
     bc_instruction(e, I_STORE_64, NULL_PARAM);
     break;
-    
+
     default:
     bc_instruction(e, I_MEMCOPY, PARAM(i64, size));
     break;
   }
 };
 
+// NOTE(lvl5): pops the address, then the value from bc_emit_value
+void bc_store_type(Bc_Emitter *e, Code_Node *type) {
+  i32 size = get_size_of_type(type);
+  if (bc_by_address(type)) {
+    bc_instruction(e, I_MEMCOPY, PARAM(i64, size));
+  } else {
+    bc_store_size(e, size);
+  }
+}
+
+// NOTE(lvl5): where the next call's frame starts in ours. the arguments
+// of a call are evaluated with call_frame past its own frame, so a call
+// in one of them doesn't write over the ones before it
+i32 bc_frame(Bc_Emitter *e) {
+  i32 result = (e->current_func ? e->current_func->stack_size : 0) + e->call_frame;
+  return result;
+}
+
+// NOTE(lvl5): the f32 and f64 versions come right after the int one
+Instruction_Kind bc_arith_kind(Instruction_Kind int_kind, Code_Node *type) {
+  Code_Node *final_type = get_final_type(type);
+  Instruction_Kind result = int_kind;
+  if (final_type->kind == Code_Kind_TYPE_FLOAT) {
+    result = (Instruction_Kind)(int_kind + (final_type->t_float.size == 4 ? 1 : 2));
+  }
+  return result;
+}
+
+i32 bc_pointer_item_size(Code_Node *type) {
+  i32 result = get_size_of_type(get_final_type(type)->t_pointer.base);
+  return result;
+}
+
+// NOTE(lvl5): values on the exec stack are 64 bits, a narrower int is cut
+// down to its size and extended again, like a store and a load would
+void bc_emit_narrow(Bc_Emitter *e, Code_Node *type) {
+  Code_Node *final_type = get_final_type(type);
+  i32 size = get_size_of_type(final_type);
+  if (final_type->kind == Code_Kind_TYPE_INT && size < 8) {
+    i64 mask = ((i64)1 << (8*size)) - 1;
+    bc_instruction(e, I_CONST, PARAM(i64, mask));
+    bc_instruction(e, I_BIT_AND, NULL_PARAM);
+    if (final_type->t_int.is_signed) {
+      i64 sign = (i64)1 << (8*size - 1);
+      bc_instruction(e, I_CONST, PARAM(i64, sign));
+      bc_instruction(e, I_BIT_XOR, NULL_PARAM);
+      bc_instruction(e, I_CONST, PARAM(i64, sign));
+      bc_instruction(e, I_SUB_int, NULL_PARAM);
+    }
+  }
+}
+
+i64 bc_narrow_value(i64 value, Code_Node *type) {
+  Code_Node *final_type = get_final_type(type);
+  i32 size = get_size_of_type(final_type);
+  i64 result = value;
+  if (size < 8) {
+    u32 shift = 64 - 8*size;
+    result = final_type->t_int.is_signed
+      ? (i64)((u64)value << shift) >> shift
+      : (i64)((u64)value << shift >> shift);
+  }
+  return result;
+}
+
+// NOTE(lvl5): a literal, maybe negated, cast to an int or float type is
+// one CONST. false if expr isn't one
+b32 bc_constant(Code_Node *expr, Code_Node *type, Bc_Param *param) {
+  b32 negate = false;
+  if (expr->kind == Code_Kind_EXPR_UNARY && expr->e_unary.op == T_SUB) {
+    negate = true;
+    expr = expr->e_unary.val;
+  }
+  Code_Node *final_type = get_final_type(type);
+
+  b32 result = false;
+  b32 is_literal = (expr->kind == Code_Kind_EXPR_INT && !expr->e_int.placeholder) ||
+    expr->kind == Code_Kind_EXPR_CHAR || expr->kind == Code_Kind_EXPR_FLOAT;
+  if (is_literal && (final_type->kind == Code_Kind_TYPE_INT ||
+                     final_type->kind == Code_Kind_TYPE_FLOAT)) {
+    i64 int_value;
+    f64 float_value;
+    if (expr->kind == Code_Kind_EXPR_FLOAT) {
+      float_value = expr->e_float.value;
+      int_value = (i64)float_value;
+    } else {
+      int_value = expr->kind == Code_Kind_EXPR_INT ? (i64)expr->e_int.value : expr->e_char.value;
+      float_value = (f64)int_value;
+    }
+    if (negate) {
+      int_value = -int_value;
+      float_value = -float_value;
+    }
+
+    param->_u64 = 0;
+    if (final_type->kind == Code_Kind_TYPE_INT) {
+      param->_i64 = bc_narrow_value(int_value, final_type);
+    } else if (final_type->t_float.size == 4) {
+      param->_f32 = (f32)float_value;
+    } else {
+      param->_f64 = float_value;
+    }
+    result = true;
+  }
+  return result;
+}
+
+// NOTE(lvl5): index of func's signature in the emitter's table, which
+// has every signature once
+i32 bc_signature(Bc_Emitter *e, Code_Type_Func *func) {
+  Bc_Foreign_Sig sig = bc_foreign_sig(func);
+  i32 result = 0;
+  while (result < (i32)sb_count(e->signatures) &&
+         !compare_memory(e->signatures[result], &sig, sizeof(sig))) {
+    result++;
+  }
+  if (result == (i32)sb_count(e->signatures)) {
+    Bc_Foreign_Sig *copy = arena_push_struct(e->arena, Bc_Foreign_Sig);
+    *copy = sig;
+    sb_push(e->signatures, copy);
+  }
+  return result;
+}
+
+i32 bc_return_size(Code_Type_Func *func) {
+  i32 result = get_size_of_type(func->return_type);
+  return result;
+}
+
+// NOTE(lvl5): the bytecode function a call goes to when that is known
+// while emitting, -1 for foreign functions and function pointers. only a
+// `::` function decl always holds the function bc_declare_function gave
+// it, anything else is read from its slot when the call runs
+i64 bc_direct_callee(Bc_Emitter *e, Code_Node *func_expr) {
+  i64 result = -1;
+  if (func_expr->kind == Code_Kind_EXPR_NAME) {
+    Code_Stmt_Decl *decl = &func_expr->e_name.decl->s_decl;
+    // NOTE(lvl5): a local function that isn't declared yet has no index
+    // to take, that goes through its slot too
+    if (decl->is_const && decl->emitted &&
+        decl->value && decl->value->kind == Code_Kind_FUNC &&
+        !decl->value->func.foreign) {
+      result = decl->function;
+    }
+  }
+  return result;
+}
+
+i32 bc_args_size(Code_Node **args) {
+  i32 result = 0;
+  for (u32 i = 0; i < sb_count(args); i++) {
+    result += get_size_of_type(args[i]->type);
+  }
+  return result;
+}
+
+// NOTE(lvl5): evaluates the arguments straight into their slots in the
+// callee's frame, which starts at frame. returns their total size
+i32 bc_emit_call_args(Bc_Emitter *e, Code_Expr_Call *call, i32 frame) {
+  Code_Type_Func *func = &get_final_type(call->func->type)->t_func;
+  i32 offset = bc_return_size(func);
+
+  for (u32 i = 0; i < sb_count(call->args); i++) {
+    Code_Node *arg = call->args[i];
+    bc_emit_value(e, arg);
+    bc_instruction(e, I_CONST_STACK, PARAM(i64, frame + offset));
+    bc_store_type(e, arg->type);
+
+    offset += get_size_of_type(arg->type);
+  }
+  return offset - bc_return_size(func);
+}
+
+void bc_emit_func_call(Bc_Emitter *e, Code_Expr_Call *call) {
+  Code_Type_Func *func = &get_final_type(call->func->type)->t_func;
+  i32 frame = bc_frame(e);
+  i32 old_call_frame = e->call_frame;
+  e->call_frame += bc_return_size(func) + bc_args_size(call->args);
+
+  bc_emit_call_args(e, call, frame);
+
+  i64 callee = bc_direct_callee(e, call->func);
+  if (callee >= 0) {
+    Bc_Call direct = { (i32)callee, frame };
+    bc_instruction(e, I_CALL_DIRECT, PARAM(call, direct));
+  } else {
+    bc_emit_value(e, call->func);
+    bc_instruction(e, I_CONST, PARAM(i64, bc_signature(e, func)));
+    bc_instruction(e, I_CALL, PARAM(i64, frame));
+  }
+  e->call_frame = old_call_frame;
+
+  if (bc_return_size(func)) {
+    // load the return value into the exec stack
+    bc_instruction(e, I_CONST_STACK, PARAM(i64, frame));
+    bc_instruction(e, bc_load_kind(func->return_type), NULL_PARAM);
+  }
+}
+
+// NOTE(lvl5): `return f(...)` to a known function. the arguments are
+// evaluated into the next frame as usual, so they can still read ours,
+// then moved down over our own and the callee runs in our frame. false
+// if the call can't be done that way
+b32 bc_emit_tail_call(Bc_Emitter *e, Code_Node *expr) {
+  if (expr->kind != Code_Kind_EXPR_CALL) return false;
+  // NOTE(lvl5): deferred statements run after the call returns
+  if (sb_count(e->defers) > e->defer_base) return false;
+  i64 callee = bc_direct_callee(e, expr->e_call.func);
+  if (callee < 0) return false;
+
+  Code_Expr_Call *call = &expr->e_call;
+  Code_Type_Func *func = &get_final_type(call->func->type)->t_func;
+  i32 frame = bc_frame(e);
+  i32 return_size = bc_return_size(func);
+
+  i32 args_size = bc_args_size(call->args);
+  // NOTE(lvl5): the two copies of the arguments can't overlap
+  if (args_size > frame) return false;
+
+  i32 old_call_frame = e->call_frame;
+  e->call_frame += return_size + args_size;
+  bc_emit_call_args(e, call, frame);
+  e->call_frame = old_call_frame;
+
+  i32 offset = return_size;
+  for (u32 i = 0; i < sb_count(call->args); i++) {
+    Code_Node *type = call->args[i]->type;
+    bc_instruction(e, I_CONST_STACK, PARAM(i64, frame + offset));
+    if (!bc_by_address(type)) {
+      bc_instruction(e, bc_load_kind(type), NULL_PARAM);
+    }
+    bc_instruction(e, I_CONST_STACK, PARAM(i64, offset));
+    bc_store_type(e, type);
+    offset += get_size_of_type(type);
+  }
+
+  bc_instruction(e, I_TAIL_CALL, PARAM(i64, callee));
+  return true;
+}
+
+Bc_Compare_Type bc_compare_type(Code_Node *type) {
+  Code_Node *final_type = get_final_type(type);
+  Bc_Compare_Type result = Bc_Compare_Type_INT;
+  if (final_type->kind == Code_Kind_TYPE_FLOAT) {
+    result = final_type->t_float.size == 4 ? Bc_Compare_Type_F32 : Bc_Compare_Type_F64;
+  } else if (final_type->kind == Code_Kind_TYPE_POINTER ||
+             final_type->kind == Code_Kind_TYPE_FUNC ||
+             (final_type->kind == Code_Kind_TYPE_INT && !final_type->t_int.is_signed)) {
+    result = Bc_Compare_Type_U;
+  }
+  return result;
+}
+
+Bc_Compare bc_token_compare(Token_Kind op) {
+  Bc_Compare result;
+  switch (op) {
+    case T_LESS: result = Bc_Compare_LT; break;
+    case T_LESS_EQUALS: result = Bc_Compare_LE; break;
+    case T_GREATER: result = Bc_Compare_GT; break;
+    case T_GREATER_EQUALS: result = Bc_Compare_GE; break;
+    case T_EQUALS: result = Bc_Compare_EQ; break;
+    default: assert(op == T_NOT_EQUALS); result = Bc_Compare_NE; break;
+  }
+  return result;
+}
+
+// NOTE(lvl5): a compare whose 0/1 result is needed as a value. there is
+// only GT and GTE, < and <= swap the operands
+void bc_emit_compare(Bc_Emitter *e, Code_Node *expr) {
+  Code_Expr_Binary *bin = &expr->e_binary;
+  Bc_Compare cmp = bc_token_compare(bin->op);
+  Bc_Compare_Type type = bc_compare_type(bin->left->type);
+  b32 swap = cmp == Bc_Compare_LT || cmp == Bc_Compare_LE;
+
+  bc_emit_value(e, swap ? bin->right : bin->left);
+  bc_emit_value(e, swap ? bin->left : bin->right);
 
-void bc_emit_func_call(Bc_Emitter *e, Code_Expr_Call *call) {
-  Code_Type_Func *func = &get_final_type(call->func->type)->func;
-  
-  i32 total_args_size = 0;
-  b32 is_void = get_final_type(func->return_type) == builtin_void;
-  if (!is_void) {
-    total_args_size += get_size_of_type(func->return_type);
+  Instruction_Kind kind;
+  if (cmp == Bc_Compare_EQ) {
+    kind = I_EQ;
+  } else if (cmp == Bc_Compare_NE) {
+    kind = I_NE;
+  } else {
+    b32 or_equal = cmp == Bc_Compare_LE || cmp == Bc_Compare_GE;
+    switch (type) {
+      case Bc_Compare_Type_U: kind = or_equal ? I_GTE_u : I_GT_u; break;
+      case Bc_Compare_Type_F32: kind = or_equal ? I_GTE_f32 : I_GT_f32; break;
+      case Bc_Compare_Type_F64: kind = or_equal ? I_GTE_f64 : I_GT_f64; break;
+      default: kind = or_equal ? I_GTE_int : I_GT_int; break;
+    }
   }
-  
-  for (u32 i = 0; i < sb_count(call->args); i++) {
-    Code_Expr *arg = call->args[i];
-    i32 size = get_size_of_type(arg->type);
-    
-    bc_emit_expr(e, arg);
-    if (size > 8) {
-      assert(e->instructions[e->instruction_count-1].kind == I_LOAD);
-      e->instruction_count--;
+  bc_instruction(e, kind, NULL_PARAM);
+}
+
+// NOTE(lvl5): jumps that still need a target are chained through their
+// params, each holds the index + 1 of the one before it, 0 ends the chain
+void bc_patch_jumps_to(Bc_Emitter *e, i64 chain, i64 target) {
+  while (chain) {
+    Bc_Instruction *jmp = e->func->instructions + chain - 1;
+    chain = jmp->param._i64;
+    jmp->param._i64 = target - (jmp - e->func->instructions);
+  }
+}
+
+void bc_patch_jumps(Bc_Emitter *e, i64 chain) {
+  bc_patch_jumps_to(e, chain, e->func->instruction_count);
+}
+
+// NOTE(lvl5): emits a jump that is taken when cond is jump_if and falls
+// through otherwise, && and || only evaluate their right side when they
+// need to. returns the chain with the new jumps added
+i64 bc_emit_cond_jump(Bc_Emitter *e, Code_Node *cond, b32 jump_if, i64 chain) {
+  b32 is_and = cond->kind == Code_Kind_EXPR_BINARY && cond->e_binary.op == T_AND;
+  b32 is_or = cond->kind == Code_Kind_EXPR_BINARY && cond->e_binary.op == T_OR;
+
+  if (is_and || is_or) {
+    if (is_or == jump_if) {
+      // a || b jumps if either does, a && b falls through if either does
+      chain = bc_emit_cond_jump(e, cond->e_binary.left, jump_if, chain);
+      chain = bc_emit_cond_jump(e, cond->e_binary.right, jump_if, chain);
+    } else {
+      // the left side alone decides the other way, skip the right side
+      i64 skip = bc_emit_cond_jump(e, cond->e_binary.left, !jump_if, 0);
+      chain = bc_emit_cond_jump(e, cond->e_binary.right, jump_if, chain);
+      bc_patch_jumps(e, skip);
     }
-    bc_instruction(e, I_CONST_STACK, PARAM(i64, e->current_func->stack_size + total_args_size));
-    bc_store_size(e, size);
-    
-    total_args_size += size;
+  } else if (cond->kind == Code_Kind_EXPR_UNARY && cond->e_unary.op == T_NOT) {
+    chain = bc_emit_cond_jump(e, cond->e_unary.val, !jump_if, chain);
+  } else if (cond->kind == Code_Kind_EXPR_BINARY &&
+             cond->e_binary.op >= T_COMP_FIRST && cond->e_binary.op <= T_COMP_LAST) {
+    // NOTE(lvl5): compare and branch, no 0/1 in between
+    Bc_Compare cmp = bc_token_compare(cond->e_binary.op);
+    Bc_Compare_Type type = bc_compare_type(cond->e_binary.left->type);
+    bc_emit_value(e, cond->e_binary.left);
+    bc_emit_value(e, cond->e_binary.right);
+
+    b32 is_float = type == Bc_Compare_Type_F32 || type == Bc_Compare_Type_F64;
+    if (jump_if) {
+      chain = bc_instruction(e, bc_branch_kind(cmp, type), PARAM(i64, chain)) + 1;
+    } else if (is_float && cmp != Bc_Compare_EQ && cmp != Bc_Compare_NE) {
+      // NOTE(lvl5): !(a < b) isn't a >= b when either is a NaN, so branch
+      // over the jump instead
+      i64 skip = bc_instruction(e, bc_branch_kind(cmp, type), NULL_PARAM) + 1;
+      chain = bc_instruction(e, I_JMP, PARAM(i64, chain)) + 1;
+      bc_patch_jumps(e, skip);
+    } else {
+      chain = bc_instruction(e, bc_branch_kind(bc_negate_compare(cmp), type), PARAM(i64, chain)) + 1;
+    }
+  } else {
+    bc_emit_value(e, cond);
+    chain = bc_instruction(e, jump_if ? I_JMP_TRUE : I_JMP_FALSE, PARAM(i64, chain)) + 1;
   }
-  
-  bc_emit_expr(e, call->func);
-  bc_instruction(e, I_STACK_CHANGE, PARAM(i64, e->current_func->stack_size));
-  
-  
-  bc_instruction(e, I_CONST, PARAM(ptr, func));
-  bc_instruction(e, I_CALL, PARAM(i64, e->instruction_count+1));
-  
-  bc_instruction(e, I_STACK_CHANGE, PARAM(i64, -e->current_func->stack_size));
-  
-  if (!is_void) {
-    // load the return value into the exec stack
-    bc_instruction(e, I_CONST_STACK, PARAM(i64, e->current_func->stack_size));
-    bc_instruction(e, I_LOAD, NULL_PARAM);
+  return chain;
+}
+
+// NOTE(lvl5): an int that fits in to keeps its value without narrowing
+b32 bc_int_fits(Code_Node *from, Code_Node *to) {
+  b32 result = from->kind == Code_Kind_TYPE_INT &&
+    ((from->t_int.size == to->t_int.size && from->t_int.is_signed == to->t_int.is_signed) ||
+     (from->t_int.size < to->t_int.size && (to->t_int.is_signed || !from->t_int.is_signed)));
+  return result;
+}
+
+void bc_emit_cast(Bc_Emitter *e, Code_Node *expr) {
+  Code_Expr_Cast *cast = &expr->e_cast;
+  Code_Node *from = get_final_type(cast->expr->type);
+  Code_Node *to = get_final_type(cast->cast_type);
+  Bc_Param constant;
+
+  if (types_are_equal(from, to)) {
+    bc_emit_expr(e, cast->expr);
+  } else if (bc_constant(cast->expr, to, &constant)) {
+    bc_instruction(e, I_CONST, constant);
+  } else {
+    bc_emit_value(e, cast->expr);
+    b32 from_float = from->kind == Code_Kind_TYPE_FLOAT;
+    b32 to_float = to->kind == Code_Kind_TYPE_FLOAT;
+    if (from_float && to_float) {
+      bc_instruction(e, to->t_float.size == 4 ? I_CAST_f64_f32 : I_CAST_f32_f64, NULL_PARAM);
+    } else if (from_float) {
+      bc_instruction(e, from->t_float.size == 4 ? I_CAST_f32_int : I_CAST_f64_int, NULL_PARAM);
+      bc_emit_narrow(e, to);
+    } else if (to_float) {
+      bc_instruction(e, to->t_float.size == 4 ? I_CAST_int_f32 : I_CAST_int_f64, NULL_PARAM);
+    } else if (to->kind == Code_Kind_TYPE_INT && !bc_int_fits(from, to)) {
+      bc_emit_narrow(e, to);
+    }
   }
 }
 
-void bc_emit_expr(Bc_Emitter *e, Code_Expr *expr) {
-  switch (expr->kind) {
-    case Expr_Kind_TYPE: {
+void bc_emit_binary(Bc_Emitter *e, Code_Node *expr) {
+  Code_Expr_Binary *bin = &expr->e_binary;
+  switch (bin->op) {
+    case T_MEMBER: {
+      if (bin->is_enum_member) {
+        Code_Node *enum_type = get_final_type(bin->left);
+        Scope_Entry *entry = scope_get_local(enum_type->t_enum.scope, bin->right->e_name.name);
+        bc_instruction(e, I_CONST, PARAM(i64, entry->decl->s_decl.value->e_int.value));
+        break;
+      }
+
+      Code_Stmt_Decl *member = &bin->right->e_name.decl->s_decl;
+      if (is_type_kind(bin->left->type, Code_Kind_TYPE_POINTER)) {
+        bc_emit_value(e, bin->left);
+        bc_instruction(e, I_CONST, PARAM(i64, member->offset));
+        bc_instruction(e, I_ADD_int, NULL_PARAM);
+      } else {
+        bc_emit_address(e, bin->left);
+        Bc_Instruction *instr = e->func->instructions + e->func->instruction_count-1;
+        if (instr->kind == I_CONST_STACK || instr->kind == I_CONST_BSS) {
+          instr->param._i64 += member->offset;
+        } else {
+          bc_instruction(e, I_CONST, PARAM(i64, member->offset));
+          bc_instruction(e, I_ADD_int, NULL_PARAM);
+        }
+      }
+      bc_instruction(e, bc_load_kind(expr->type), NULL_PARAM);
+    } break;
+    case T_SUBSCRIPT: {
+      // NOTE(lvl5): a pointer's value or an array's address
+      bc_emit_value(e, bin->left);
+      bc_emit_value(e, bin->right);
+      i32 size = get_size_of_type(expr->type);
+      if (size != 1) {
+        bc_instruction(e, I_CONST, PARAM(i64, size));
+        bc_instruction(e, I_MUL_int, NULL_PARAM);
+      }
+      bc_instruction(e, I_ADD_int, NULL_PARAM);
+      bc_instruction(e, bc_load_kind(expr->type), NULL_PARAM);
+    } break;
+
+    case T_ADD:
+    case T_SUB: {
+      Instruction_Kind kind = bin->op == T_ADD ? I_ADD_int : I_SUB_int;
+      bc_emit_value(e, bin->left);
+      bc_emit_value(e, bin->right);
+      if (is_type_kind(bin->left->type, Code_Kind_TYPE_POINTER)) {
+        i32 size = bc_pointer_item_size(bin->left->type);
+        if (is_type_kind(bin->right->type, Code_Kind_TYPE_POINTER)) {
+          // NOTE(lvl5): the distance in items
+          bc_instruction(e, I_SUB_int, NULL_PARAM);
+          if (size > 1) {
+            bc_instruction(e, I_CONST, PARAM(i64, size));
+            bc_instruction(e, I_DIV_int, NULL_PARAM);
+          }
+          break;
+        }
+        if (size != 1) {
+          bc_instruction(e, I_CONST, PARAM(i64, size));
+          bc_instruction(e, I_MUL_int, NULL_PARAM);
+        }
+      } else {
+        kind = bc_arith_kind(kind, expr->type);
+      }
+      bc_instruction(e, kind, NULL_PARAM);
+    } break;
+
+    case T_MUL:
+    case T_DIV: {
+      bc_emit_value(e, bin->left);
+      bc_emit_value(e, bin->right);
+      bc_instruction(e, bc_arith_kind(bin->op == T_MUL ? I_MUL_int : I_DIV_int, expr->type), NULL_PARAM);
+    } break;
+
+    case T_MOD:
+    case T_BIT_AND:
+    case T_BIT_OR:
+    case T_BIT_XOR: {
+      bc_emit_value(e, bin->left);
+      bc_emit_value(e, bin->right);
+      Instruction_Kind kind = bin->op == T_MOD ? I_MOD :
+        bin->op == T_BIT_AND ? I_BIT_AND :
+        bin->op == T_BIT_OR ? I_BIT_OR : I_BIT_XOR;
+      bc_instruction(e, kind, NULL_PARAM);
+    } break;
+
+    case T_LESS:
+    case T_LESS_EQUALS:
+    case T_GREATER:
+    case T_GREATER_EQUALS:
+    case T_EQUALS:
+    case T_NOT_EQUALS: {
+      bc_emit_compare(e, expr);
+    } break;
+
+    case T_AND:
+    case T_OR: {
+      i64 to_false = bc_emit_cond_jump(e, expr, false, 0);
+      bc_instruction(e, I_CONST, PARAM(i64, 1));
+      i64 to_end = bc_instruction(e, I_JMP, NULL_PARAM);
+      bc_patch_jumps(e, to_false);
+      bc_instruction(e, I_CONST, PARAM(i64, 0));
+      bc_patch_jumps(e, to_end + 1);
+    } break;
+
+    default: {
       assert(false);
     } break;
-    case Expr_Kind_NAME: {
-      Code_Stmt_Decl *decl = expr->name.decl;
+  }
+}
+
+void bc_fold_run(Bc_Emitter *, Code_Node *);
+
+void bc_emit_expr(Bc_Emitter *e, Code_Node *expr) {
+  switch (expr->kind) {
+    case Code_Kind_EXPR_NAME: {
+      Code_Stmt_Decl *decl = &expr->e_name.decl->s_decl;
       if (decl->storage_kind == Storage_Kind_BSS) {
-        bc_instruction(e, I_CONST_BSS, PARAM(i32, decl->offset));
+        bc_instruction(e, I_CONST_BSS, PARAM(i64, decl->offset));
       } else {
-        bc_instruction(e, I_CONST_STACK, PARAM(i32, decl->offset));
+        bc_instruction(e, I_CONST_STACK, PARAM(i64, decl->offset));
       }
-      bc_instruction(e, I_LOAD, NULL_PARAM); // TODO(lvl5): types
+      bc_instruction(e, bc_load_kind(expr->type), NULL_PARAM);
     } break;
-    case Expr_Kind_UNARY: {
-      Token_Kind op = expr->unary.op;
-      switch (op) {
+    case Code_Kind_EXPR_UNARY: {
+      Code_Node *val = expr->e_unary.val;
+      switch (expr->e_unary.op) {
         case T_REF: {
-          // TODO(lvl5): should only work on variables
-          bc_emit_expr(e, expr->unary.val);
-          assert(e->instructions[e->instruction_count-1].kind == I_LOAD);
-          e->instruction_count--;
+          bc_emit_address(e, val);
         } break;
-        
+
         case T_DEREF: {
-          // TODO(lvl5): make sure assigning into dereferenced variable works
-          bc_instruction(e, I_LOAD, NULL_PARAM);
-        } break;
-        
-        default: assert(false);
-      }
-    } break;
-    case Expr_Kind_BINARY: {
-      switch (expr->binary.op) {
-        case T_MEMBER: {
-          bc_emit_expr(e, expr->binary.left);
-          assert(expr->binary.right->kind == Expr_Kind_NAME);
-          
-          // TODO(lvl5): name.decl should map to a struct member decl here
-          Code_Stmt_Decl *name_decl = expr->binary.right->name.decl;
-          Bc_Instruction *instr = e->instructions + e->instruction_count-1;
-          if (expr->binary.left->type->kind != Type_Kind_PTR) {
-            assert(instr->kind == I_LOAD);
-            instr = e->instructions + --e->instruction_count - 1;
-          }
-          assert(instr->kind == I_CONST_STACK || 
-                 instr->kind == I_CONST_BSS);
-          instr->param._i64 += name_decl->offset;
-          bc_instruction(e, I_LOAD, NULL_PARAM);
+          bc_emit_value(e, val);
+          bc_instruction(e, bc_load_kind(expr->type), NULL_PARAM);
         } break;
-        case T_SUBSCRIPT: {
-          Code_Type *right_type = get_final_type(expr->binary.right->type);
-          assert(right_type->kind == Type_Kind_INT);
-          bc_emit_expr(e, expr->binary.left);
-          bc_emit_expr(e, expr->binary.right);
-          bc_instruction(e, I_ADD_int, NULL_PARAM);
-          bc_instruction(e, I_LOAD, NULL_PARAM);
-        } break;
-        
-        case T_ADD: {
-          bc_emit_expr(e, expr->binary.left);
-          bc_emit_expr(e, expr->binary.right);
-          bc_instruction(e, I_ADD_int, NULL_PARAM);
-        } break;
-        
+
         case T_SUB: {
-          bc_emit_expr(e, expr->binary.left);
-          bc_emit_expr(e, expr->binary.right);
-          bc_instruction(e, I_SUB_int, NULL_PARAM);
-        } break;
-        
-        case T_MUL: {
-          bc_emit_expr(e, expr->binary.left);
-          bc_emit_expr(e, expr->binary.right);
-          bc_instruction(e, I_MUL_int, NULL_PARAM);
-        } break;
-        
-        case T_GREATER: {
-          bc_emit_expr(e, expr->binary.left);
-          bc_emit_expr(e, expr->binary.right);
-          bc_instruction(e, I_GT_int, NULL_PARAM);
-        } break;
-        
-        case T_EQUALS: {
-          bc_emit_expr(e, expr->binary.left);
-          bc_emit_expr(e, expr->binary.right);
-          bc_instruction(e, I_EQ, NULL_PARAM);
+          Bc_Param constant;
+          if (bc_constant(expr, expr->type, &constant)) {
+            bc_instruction(e, I_CONST, constant);
+          } else {
+            bc_emit_value(e, val);
+            bc_instruction(e, bc_arith_kind(I_NEG_int, expr->type), NULL_PARAM);
+          }
         } break;
-        
-        case T_LESS: {
-          bc_emit_expr(e, expr->binary.right);
-          bc_emit_expr(e, expr->binary.left);
-          bc_instruction(e, I_GT_int, NULL_PARAM);
+
+        case T_NOT: {
+          bc_emit_value(e, val);
+          bc_instruction(e, I_NOT, NULL_PARAM);
         } break;
-        
-        default: {
-          assert(false);
+
+        case T_BIT_NOT: {
+          bc_emit_value(e, val);
+          bc_instruction(e, I_BIT_NOT, NULL_PARAM);
+          bc_emit_narrow(e, expr->type);
         } break;
+
+        default: assert(false);
       }
     } break;
-    case Expr_Kind_CALL: {
-      bc_emit_func_call(e, &expr->call);
+    case Code_Kind_EXPR_BINARY: {
+      bc_emit_binary(e, expr);
     } break;
-    case Expr_Kind_CAST: {
-      if (expr->cast.implicit) {
-        bc_emit_expr(e, expr->cast.expr);
-      } else {
-        // TODO(lvl5): actual casts
-        bc_emit_expr(e, expr->cast.expr);
-      }
+    case Code_Kind_EXPR_CALL: {
+      bc_emit_func_call(e, &expr->e_call);
+    } break;
+    case Code_Kind_EXPR_CAST: {
+      bc_emit_cast(e, expr);
     } break;
-    case Expr_Kind_CHAR: {
-      bc_instruction(e, I_CONST, PARAM(i64, expr->char_e.value));
+    case Code_Kind_EXPR_CHAR: {
+      bc_instruction(e, I_CONST, PARAM(i64, expr->e_char.value));
     } break;
-    case Expr_Kind_INT: {
-      Placeholder *pl = expr->int_e.placeholder;
+    case Code_Kind_EXPR_INT: {
+      Placeholder *pl = expr->e_int.placeholder;
       if (pl) {
         assert(pl->storage_kind == Storage_Kind_BSS);
-        byte *dst = e->bss_segment + pl->offset;
-        copy_memory_slow(dst, pl->data, pl->size);
-        expr->int_e.value = (u64)dst;
+        copy_memory(e->bss_segment + pl->offset, pl->data, pl->size);
+        // NOTE(lvl5): relative to the BSS, so the code doesn't depend on
+        // where the segment is
+        bc_instruction(e, I_CONST_BSS, PARAM(i64, pl->offset));
+      } else {
+        bc_instruction(e, I_CONST, PARAM(i64, expr->e_int.value));
       }
-      bc_instruction(e, I_CONST, PARAM(i64, expr->int_e.value));
-    } break;
-    case Expr_Kind_FLOAT: {
-      bc_instruction(e, I_CONST, PARAM(f64, expr->float_e.value));
     } break;
-    case Expr_Kind_STRING: {
-      assert(false);
+    case Code_Kind_EXPR_FLOAT: {
+      bc_instruction(e, I_CONST, PARAM(f64, expr->e_float.value));
     } break;
-    case Expr_Kind_NULL: {
+    case Code_Kind_EXPR_NULL: {
       bc_instruction(e, I_CONST, PARAM(i64, 0));
     } break;
-    
+    case Code_Kind_EXPR_RUN: {
+      bc_fold_run(e, expr);
+      bc_emit_expr(e, expr);
+    } break;
+
     default: assert(false);
   }
 }
 
 
-void bc_emit_stmt_block(Bc_Emitter *, Code_Stmt_Block *);
+// NOTE(lvl5): 8 byte integer locals can be used directly as operands
+// of the register instructions
+b32 bc_is_reg_type(Code_Node *type) {
+  Code_Node *final_type = get_final_type(type);
+  b32 result = final_type->kind == Code_Kind_TYPE_INT &&
+    get_size_of_type(final_type) == 8;
+  return result;
+}
 
-void bc_emit_stmt(Bc_Emitter *e, Code_Stmt *stmt) {
-  {
-    String *comment = arena_push_struct(scratch_arena, String);
-    Code_Node *node = (Code_Node *)stmt;
-    Token t = e->parser->tokens[node->first_token];
-    *comment = get_line_from_index(e->parser->src, (u32)(t.value.data - e->parser->src.data));
-    
-    bc_instruction(e, I_COMMENT, PARAM(comment, comment));
+b32 bc_get_decl_reg(Code_Stmt_Decl *decl, u16 *reg) {
+  b32 result = false;
+  if (decl->storage_kind == Storage_Kind_STACK &&
+      decl->offset <= U16_MAX &&
+      bc_is_reg_type(decl->type)) {
+    *reg = (u16)decl->offset;
+    result = true;
   }
-  
+  return result;
+}
+
+b32 bc_get_reg(Code_Node *expr, u16 *reg) {
+  b32 result = false;
+  if (expr->kind == Code_Kind_EXPR_NAME) {
+    result = bc_get_decl_reg(&expr->e_name.decl->s_decl, reg);
+  }
+  return result;
+}
+
+b32 bc_get_imm(Code_Node *expr, i32 *imm) {
+  b32 result = false;
+  Bc_Param constant;
+  if (is_int_type(expr->type)) {
+    if (expr->kind == Code_Kind_EXPR_CAST && expr->e_cast.implicit) {
+      expr = expr->e_cast.expr;
+    }
+    if (expr->kind != Code_Kind_EXPR_CHAR && bc_constant(expr, builtin_i64, &constant) &&
+        constant._i64 >= I32_MIN && constant._i64 <= I32_MAX) {
+      *imm = (i32)constant._i64;
+      result = true;
+    }
+  }
+  return result;
+}
+
+// NOTE(lvl5): lowers `dst = a`, `dst = imm`, `dst = a op b`, `dst = a op imm`
+// (and the op= forms) into one register instruction instead of going
+// through the exec stack. returns false if the statement doesn't fit
+b32 bc_emit_assign_regs(Bc_Emitter *e, u16 dst, Token_Kind assign_op, Code_Node *right) {
+  Bc_Regs r = {0};
+  r.dst = dst;
+
+  Token_Kind op = T_NONE;
+  Code_Node *op_left = 0;
+  Code_Node *op_right = 0;
+
+  switch (assign_op) {
+    case T_ASSIGN: {
+      if (right->kind == Code_Kind_EXPR_BINARY && bc_is_reg_type(right->type)) {
+        op = right->e_binary.op;
+        op_left = right->e_binary.left;
+        op_right = right->e_binary.right;
+      }
+    } break;
+    case T_ADD_ASSIGN: op = T_ADD; break;
+    case T_SUB_ASSIGN: op = T_SUB; break;
+    case T_MUL_ASSIGN: op = T_MUL; break;
+    default: return false;
+  }
+
+  if (assign_op != T_ASSIGN) {
+    // NOTE(lvl5): dst op= right is dst = dst op right
+    op_left = 0;
+    op_right = right;
+    r.a = dst;
+  }
+
+  Instruction_Kind kind = I_NONE;
+  u16 a, b;
+  i32 imm;
+
+  if (op == T_NONE) {
+    if (bc_get_reg(right, &a)) {
+      kind = I_MOV_RR;
+      r.a = a;
+    } else if (bc_get_imm(right, &imm)) {
+      kind = I_MOV_RI;
+      r.imm = imm;
+    }
+  } else if (op == T_ADD || op == T_SUB || op == T_MUL) {
+    Instruction_Kind rr_kind = op == T_ADD ? I_ADD_int_RR :
+      op == T_SUB ? I_SUB_int_RR : I_MUL_int_RR;
+    Instruction_Kind ri_kind = op == T_ADD ? I_ADD_int_RI :
+      op == T_SUB ? I_SUB_int_RI : I_MUL_int_RI;
+
+    b32 left_ok = !op_left || bc_get_reg(op_left, &a);
+    if (left_ok) {
+      if (op_left) r.a = a;
+      if (bc_get_reg(op_right, &b)) {
+        kind = rr_kind;
+        r.b = b;
+      } else if (bc_get_imm(op_right, &imm)) {
+        kind = ri_kind;
+        r.imm = imm;
+      }
+    } else if (op != T_SUB && bc_get_imm(op_left, &imm) && bc_get_reg(op_right, &a)) {
+      // NOTE(lvl5): imm + a, imm*a
+      kind = ri_kind;
+      r.a = a;
+      r.imm = imm;
+    }
+  }
+
+  b32 result = false;
+  if (kind != I_NONE) {
+    bc_instruction(e, kind, (Bc_Param){ ._regs = r });
+    result = true;
+  }
+  return result;
+}
+
+Code_Node *bc_strip_casts(Code_Node *expr) {
+  while (expr->kind == Code_Kind_EXPR_CAST) {
+    expr = expr->e_cast.expr;
+  }
+  return expr;
+}
+
+// NOTE(lvl5): base[index] on bytes where base is a plain variable
+b32 bc_is_byte_subscript(Code_Node *expr, Code_Node *index) {
+  b32 result = false;
+  if (expr->kind == Code_Kind_EXPR_BINARY && expr->e_binary.op == T_SUBSCRIPT &&
+      get_size_of_type(expr->type) == 1) {
+    Code_Node *base = bc_strip_casts(expr->e_binary.left);
+    Code_Node *i = bc_strip_casts(expr->e_binary.right);
+    result = base->kind == Code_Kind_EXPR_NAME &&
+      i->kind == Code_Kind_EXPR_NAME && i->e_name.decl == index;
+  }
+  return result;
+}
+
+// NOTE(lvl5): the variable base[index] is indexed off, if nothing can
+// point at it
+b32 bc_is_private_base(Code_Node *expr) {
+  Code_Node *base = bc_strip_casts(expr->e_binary.left);
+  b32 result = !base->e_name.decl->s_decl.address_taken;
+  return result;
+}
+
+// NOTE(lvl5): `while i < n { p[i] = q[i]; i += 1; }` over bytes is one
+// MEMCOPY_N, and with a constant instead of q[i] one MEMSET_N. i and n are
+// register locals and p and q variables, none of them with its address
+// taken, so writing through p can't change them. a for loop is the same
+// with the step in its post statement. false if the loop isn't one of those
+b32 bc_emit_memory_loop(Bc_Emitter *e, Code_Node *cond, Code_Node *move, Code_Node *step) {
+  if (cond->kind != Code_Kind_EXPR_BINARY || cond->e_binary.op != T_LESS) return false;
+  Code_Node *index = cond->e_binary.left;
+  Code_Node *count = cond->e_binary.right;
+  u16 index_reg, count_reg;
+  i32 imm;
+  if (!bc_get_reg(index, &index_reg)) return false;
+  if (!bc_get_reg(count, &count_reg) && !bc_get_imm(count, &imm)) return false;
+  if (index->e_name.decl->s_decl.address_taken ||
+      (count->kind == Code_Kind_EXPR_NAME && count->e_name.decl->s_decl.address_taken)) {
+    return false;
+  }
+
+  Code_Node *index_decl = index->e_name.decl;
+  if (step->kind != Code_Kind_STMT_ASSIGN || step->s_assign.op != T_ADD_ASSIGN ||
+      bc_strip_casts(step->s_assign.left)->kind != Code_Kind_EXPR_NAME ||
+      bc_strip_casts(step->s_assign.left)->e_name.decl != index_decl ||
+      !bc_get_imm(step->s_assign.right, &imm) || imm != 1) {
+    return false;
+  }
+
+  if (move->kind != Code_Kind_STMT_ASSIGN || move->s_assign.op != T_ASSIGN ||
+      !bc_is_byte_subscript(move->s_assign.left, index_decl) ||
+      !bc_is_private_base(move->s_assign.left)) {
+    return false;
+  }
+  Code_Node *from = move->s_assign.right;
+  b32 is_copy = bc_is_byte_subscript(from, index_decl);
+  b32 is_fill = !is_copy &&
+    (bc_get_imm(from, &imm) || bc_strip_casts(from)->kind == Code_Kind_EXPR_CHAR);
+  if (!is_copy && !is_fill) return false;
+  if (is_copy && !bc_is_private_base(from)) return false;
+
+  i64 to_end = bc_emit_cond_jump(e, cond, false, 0);
+
+  // NOTE(lvl5): the addresses of p[i] and q[i], without the loads
+  if (is_copy) {
+    bc_emit_address(e, from);
+  } else {
+    bc_emit_value(e, from);
+  }
+  bc_emit_address(e, move->s_assign.left);
+
+  bc_emit_value(e, count);
+  bc_emit_value(e, index);
+  bc_instruction(e, I_SUB_int, NULL_PARAM);
+
+  // i = n, what the loop leaves behind. it's set before the move, so
+  // nothing is read back after memory was written
+  b32 moved = bc_emit_assign_regs(e, index_reg, T_ASSIGN, count);
+  assert(moved);
+  bc_instruction(e, is_copy ? I_MEMCOPY_N : I_MEMSET_N, NULL_PARAM);
+
+  bc_patch_jumps(e, to_end);
+  return true;
+}
+
+void bc_emit_stmt(Bc_Emitter *, Code_Node *);
+void bc_emit_decl(Bc_Emitter *, Code_Node *);
+
+// NOTE(lvl5): runs the deferred statements above count, the last one first
+void bc_emit_defers(Bc_Emitter *e, u32 count) {
+  for (u32 i = sb_count(e->defers); i > count; i--) {
+    bc_emit_stmt(e, e->defers[i - 1]);
+  }
+}
+
+void bc_emit_stmt_block(Bc_Emitter *e, Code_Node *block) {
+  u32 defer_count = sb_count(e->defers);
+  for (u32 i = 0; i < sb_count(block->s_block.statements); i++) {
+    bc_emit_stmt(e, block->s_block.statements[i]);
+  }
+  bc_emit_defers(e, defer_count);
+  sb_count(e->defers) = defer_count;
+}
+
+// NOTE(lvl5): a while or for loop from its LOOP instruction. body is
+// emitted with the loop as the target of break and continue, continue
+// goes to the post statement when there is one
+void bc_emit_loop(Bc_Emitter *e, Code_Node *cond, Code_Node *body, Code_Node *post) {
+  Bc_Loop loop = {0};
+  loop.function = e->func->index;
+  loop.exits = sb_new(e->arena, i64, 4);
+  i64 begin_pos = bc_instruction(e, I_LOOP, PARAM(i64, sb_count(e->loops)));
+  sb_push(e->loops, loop);
+  i64 to_end = bc_emit_cond_jump(e, cond, false, 0);
+
+  Bc_Jump_Target target = {0};
+  target.defer_count = sb_count(e->defers);
+  sb_push(e->jump_targets, target);
+  bc_emit_stmt(e, body);
+  Bc_Jump_Target *jumps = sb_peek(e->jump_targets);
+  bc_patch_jumps_to(e, jumps->continues, post ? e->func->instruction_count : begin_pos);
+  i64 breaks = jumps->breaks;
+  sb_count(e->jump_targets)--;
+
+  if (post) {
+    bc_emit_stmt(e, post);
+  }
+  bc_instruction(e, I_JMP, PARAM(i64, begin_pos - e->func->instruction_count));
+  bc_patch_jumps(e, to_end);
+  bc_patch_jumps(e, breaks);
+}
+
+void bc_emit_stmt(Bc_Emitter *e, Code_Node *stmt) {
+  bc_source_span(e, stmt->first_token, stmt->last_token);
+
   switch (stmt->kind) {
-    case Stmt_Kind_ASSIGN: {
-      // TODO(lvl5):  if assigning struct, right should also be no deref
-      bc_emit_expr(e, stmt->assign.right);
-      bc_emit_expr(e, stmt->assign.left);
-      assert(e->instructions[e->instruction_count-1].kind == I_LOAD);
-      e->instruction_count--;
-      i32 size = get_size_of_type(stmt->assign.left->type);
-      bc_store_size(e, size);
+    case Code_Kind_STMT_ASSIGN: {
+      Code_Stmt_Assign *assign = &stmt->s_assign;
+      u16 dst;
+      if (bc_get_reg(assign->left, &dst) &&
+          bc_emit_assign_regs(e, dst, assign->op, assign->right)) {
+        break;
+      }
+
+      Code_Node *type = assign->left->type;
+      if (assign->op == T_ASSIGN) {
+        bc_emit_value(e, assign->right);
+      } else {
+        // NOTE(lvl5): a op= b is a = a op b, a is evaluated twice
+        bc_emit_value(e, assign->left);
+        bc_emit_value(e, assign->right);
+        Instruction_Kind kind = I_NONE;
+        switch (assign->op) {
+          case T_ADD_ASSIGN: kind = bc_arith_kind(I_ADD_int, type); break;
+          case T_SUB_ASSIGN: kind = bc_arith_kind(I_SUB_int, type); break;
+          case T_MUL_ASSIGN: kind = bc_arith_kind(I_MUL_int, type); break;
+          case T_DIV_ASSIGN: kind = bc_arith_kind(I_DIV_int, type); break;
+          case T_MOD_ASSIGN: kind = I_MOD; break;
+          case T_BIT_AND_ASSIGN: kind = I_BIT_AND; break;
+          case T_BIT_OR_ASSIGN: kind = I_BIT_OR; break;
+          case T_BIT_XOR_ASSIGN: kind = I_BIT_XOR; break;
+          default: assert(false);
+        }
+        if (is_type_kind(type, Code_Kind_TYPE_POINTER)) {
+          i32 size = bc_pointer_item_size(type);
+          if (size != 1) {
+            bc_instruction(e, I_CONST, PARAM(i64, size));
+            bc_instruction(e, I_MUL_int, NULL_PARAM);
+          }
+        }
+        bc_instruction(e, kind, NULL_PARAM);
+      }
+      bc_emit_address(e, assign->left);
+      bc_store_type(e, type);
     } break;
-    case Stmt_Kind_EXPR: {
-      bc_emit_expr(e, stmt->expr.expr);
+    case Code_Kind_STMT_EXPR: {
+      Code_Node *expr = stmt->s_expr.expr;
+      bc_emit_value(e, expr);
+      if (!is_type_kind(expr->type, Code_Kind_TYPE_VOID)) {
+        // NOTE(lvl5): there's no pop, the value goes where the next call's
+        // frame starts
+        bc_instruction(e, I_CONST_STACK, PARAM(i64, bc_frame(e)));
+        bc_instruction(e, I_STORE_64, NULL_PARAM);
+      }
     } break;
-    case Stmt_Kind_IF: {
-      bc_emit_expr(e, stmt->if_s.cond);
-      Bc_Instruction *then_jmp = bc_instruction(e, I_JMP_FALSE, NULL_PARAM);
-      i64 then_count = e->instruction_count;
-      
-      bc_emit_stmt(e, stmt->if_s.then_branch);
-      if (stmt->if_s.else_branch) {
-        Bc_Instruction *else_jmp = bc_instruction(e, I_JMP, NULL_PARAM);
-        i64 else_count = e->instruction_count;
-        
-        then_jmp->param._i64 = e->instruction_count - then_count+1;
-        bc_emit_stmt(e, stmt->if_s.else_branch);
-        else_jmp->param._i64 = e->instruction_count - else_count+1;
+    case Code_Kind_STMT_IF: {
+      Code_Stmt_If *if_s = &stmt->s_if;
+      i64 to_else = bc_emit_cond_jump(e, if_s->cond, false, 0);
+
+      bc_emit_stmt(e, if_s->then_branch);
+      if (if_s->else_branch) {
+        i64 to_end = bc_instruction(e, I_JMP, NULL_PARAM);
+        bc_patch_jumps(e, to_else);
+        bc_emit_stmt(e, if_s->else_branch);
+        bc_patch_jumps(e, to_end + 1);
       } else {
-        then_jmp->param._i64 = e->instruction_count - then_count+1;
+        bc_patch_jumps(e, to_else);
       }
     } break;
-    case Stmt_Kind_BLOCK: {
-      bc_emit_stmt_block(e, &stmt->block);
+    case Code_Kind_STMT_BLOCK: {
+      bc_emit_stmt_block(e, stmt);
     } break;
-    case Stmt_Kind_WHILE: {
-      i64 begin_pos = e->instruction_count;
-      bc_emit_expr(e, stmt->while_s.cond);
-      
-      i64 jmp_to_end_index = e->instruction_count;
-      Bc_Instruction *jmp_to_end = bc_instruction(e, I_JMP_FALSE, NULL_PARAM);
-      bc_emit_stmt(e, stmt->while_s.body);
-      bc_instruction(e, I_JMP, PARAM(i64, begin_pos - e->instruction_count));
-      jmp_to_end->param._i64 = e->instruction_count - jmp_to_end_index;
+    case Code_Kind_STMT_WHILE: {
+      Code_Stmt_While *while_s = &stmt->s_while;
+      Code_Node *body = while_s->body;
+      if (body->kind == Code_Kind_STMT_BLOCK && sb_count(body->s_block.statements) == 2 &&
+          bc_emit_memory_loop(e, while_s->cond, body->s_block.statements[0],
+                              body->s_block.statements[1])) {
+        break;
+      }
+      bc_emit_loop(e, while_s->cond, body, 0);
     } break;
-    case Stmt_Kind_FOR: {
-      assert(false);
+    case Code_Kind_STMT_FOR: {
+      Code_Stmt_For *for_s = &stmt->s_for;
+      bc_emit_stmt(e, for_s->init);
+
+      Code_Node *move = for_s->body;
+      if (move->kind == Code_Kind_STMT_BLOCK && sb_count(move->s_block.statements) == 1) {
+        move = move->s_block.statements[0];
+      }
+      if (bc_emit_memory_loop(e, for_s->cond, move, for_s->post)) {
+        break;
+      }
+      bc_emit_loop(e, for_s->cond, for_s->body, for_s->post);
     } break;
-    case Stmt_Kind_KEYWORD: {
-      switch (stmt->keyword.keyword) {
+    case Code_Kind_STMT_KEYWORD: {
+      Code_Stmt_Keyword *keyword = &stmt->s_keyword;
+      switch (keyword->keyword) {
         case T_RETURN: {
-          // TODO(lvl5): if is entry, I_HLT instead
-          if (stmt->keyword.stmt) {
-            assert(stmt->keyword.stmt->kind == Stmt_Kind_EXPR);
-            Code_Expr *expr = stmt->keyword.stmt->expr.expr;
-            bc_emit_expr(e, expr);
-            i32 size = get_size_of_type(expr->type);
-            if (size > 8) {
-              //assert(get_final_type(expr->type)-> == Type_Kind_STRUCT);
-              assert(e->instructions[e->instruction_count-1].kind == I_LOAD);
-              e->instruction_count--;
+          if (keyword->stmt) {
+            Code_Node *expr = keyword->stmt->s_expr.expr;
+            if (bc_emit_tail_call(e, expr)) {
+              break;
             }
+            bc_emit_value(e, expr);
             bc_instruction(e, I_CONST_STACK, NULL_PARAM);
-            bc_store_size(e, size);
+            bc_store_type(e, expr->type);
           }
+          bc_emit_defers(e, e->defer_base);
           bc_instruction(e, I_RET, NULL_PARAM);
         } break;
-        
+
+        case T_BREAK:
+        case T_CONTINUE: {
+          Bc_Jump_Target *target = sb_peek(e->jump_targets);
+          bc_emit_defers(e, target->defer_count);
+          i64 *chain = keyword->keyword == T_BREAK ? &target->breaks : &target->continues;
+          *chain = bc_instruction(e, I_JMP, PARAM(i64, *chain)) + 1;
+        } break;
+
         case T_PUSH_CONTEXT: {
-          bc_emit_stmt(e, stmt->keyword.stmt);
+          bc_emit_stmt(e, keyword->stmt);
+        } break;
+
+        case T_DEFER: {
+          sb_push(e->defers, keyword->stmt);
         } break;
-        
-        case T_DEFER: break;
-        
+
         default: assert(false);
       }
     } break;
-    case Stmt_Kind_DECL: {
-      bc_emit_decl(e, &stmt->decl, Resolve_State_FULL);
+    case Code_Kind_STMT_DECL: {
+      bc_emit_decl(e, stmt);
     } break;
     default: assert(false);
   }
 }
 
-void bc_emit_stmt_block(Bc_Emitter *e, Code_Stmt_Block *block) {
-  for (u32 i = 0; i < sb_count(block->statements); i++) {
-    bc_emit_stmt(e, block->statements[i]);
+// NOTE(lvl5): a function declared inside another one gets its own code
+// object, the outer one carries on where it left off
+void bc_emit_function(Bc_Emitter *e, Bc_Function *func) {
+  if (func->emitted) return;
+  func->emitted = true;
+
+  Bc_Function *old_code = e->func;
+  Code_Func *old_func = e->current_func;
+  u32 old_defer_base = e->defer_base;
+  i32 old_call_frame = e->call_frame;
+  e->func = func;
+  e->current_func = &func->decl->value->func;
+  e->defer_base = sb_count(e->defers);
+  e->call_frame = 0;
+
+  // NOTE(lvl5): a frame this big could step over the stack guard
+  i32 stack_size = e->current_func->stack_size;
+  if (stack_size >= BC_STACK_GUARD) {
+    bc_instruction(e, I_STACK_PROBE, PARAM(i64, stack_size));
+  }
+  bc_emit_stmt_block(e, e->current_func->body);
+
+  Instruction_Kind last = func->instruction_count ?
+    func->instructions[func->instruction_count-1].kind : I_NONE;
+  if (last != I_RET && last != I_TAIL_CALL) {
+    b32 is_entry = func->index == e->entry_function;
+    bc_instruction(e, is_entry ? I_HLT : I_RET, NULL_PARAM);
   }
+  bc_peephole(e, func);
+
+  e->func = old_code;
+  e->current_func = old_func;
+  e->defer_base = old_defer_base;
+  e->call_frame = old_call_frame;
 }
 
-extern void *LoadLibraryA(char *file_name);
-extern void *GetProcAddress(void *library, char *proc_name);
+// NOTE(lvl5): gives a function its Bc_Function, or a #foreign one its
+// address, and puts that in its BSS slot. the body is emitted later
+void bc_declare_function(Bc_Emitter *e, Code_Node *node) {
+  Code_Stmt_Decl *decl = &node->s_decl;
+  decl->emitted = true;
+
+  Code_Func *code_func = &decl->value->func;
+  if (code_func->foreign) {
+    u64 proc = bc_foreign_address(tcstring(code_func->module), tcstring(code_func->foreign_name));
+    assert(proc);
+    *(u64 *)(e->bss_segment + decl->offset) = proc;
+
+    Bc_Import import = { code_func->module, code_func->foreign_name, decl->offset };
+    sb_push(e->imports, import);
+  } else {
+    Bc_Function *func = bc_function(e, decl->name);
+    func->decl = decl;
+    func->signature = bc_signature(e, &get_final_type(decl->type)->t_func);
+    func->emitted = false;
+    decl->function = func->index;
+    *(u64 *)(e->bss_segment + decl->offset) = func->index;
+
+    // NOTE(lvl5): handle main() entry point
+    if (string_compare(decl->name, const_string("__entry"))) {
+      e->entry_function = func->index;
+    }
+    if (code_func->init) {
+      e->context = bc_context_layout(decl);
+      sb_push(e->init_functions, func->index);
+    }
+  }
+}
 
-void bc_emit_decl(Bc_Emitter *e, Code_Stmt_Decl *decl, Resolve_State state) {
-  if (decl->emit_state == Resolve_State_FULL) {
+void bc_emit_decl(Bc_Emitter *e, Code_Node *node) {
+  Code_Stmt_Decl *decl = &node->s_decl;
+  if (decl->type == builtin_Type) {
     return;
   }
-  decl->emit_state = Resolve_State_FULL;
-  
   if (!decl->value) {
+    // NOTE(lvl5): the BSS starts out 0, the stack doesn't
+    if (decl->storage_kind == Storage_Kind_STACK) {
+      bc_instruction(e, I_CONST, PARAM(i64, 0));
+      bc_instruction(e, I_CONST_STACK, PARAM(i64, decl->offset));
+      bc_instruction(e, I_CONST, PARAM(i64, get_size_of_type(decl->type)));
+      bc_instruction(e, I_MEMSET_N, NULL_PARAM);
+    }
     return;
   }
-  switch (decl->value->kind) {
-    case Code_Kind_FUNC: {
-      String *comment = arena_push_struct(scratch_arena, String);
-      *comment = concat(scratch_arena, const_string("func "), decl->name);
-      
-      bc_instruction(e, I_COMMENT, PARAM(comment, comment));
-      
-      
-      // NOTE(lvl5): handle main() entry point
-      b32 is_entry = string_compare(decl->name, const_string("__entry"));
-      if (is_entry) {
-        e->entry_instruction_index = e->instruction_count;
-      }
-      
-      Code_Func *old_func = e->current_func;
-      e->current_func = &decl->value->func;
-      
-      if (e->current_func->foreign) {
-        char *library_name = tcstring(e->current_func->module);
-        void *library = LoadLibraryA(library_name);
-        assert(library);
-        char *proc_name = tcstring(e->current_func->foreign_name);
-        u64 proc = (u64)GetProcAddress(library, proc_name);
-        assert(proc);
-        proc |= FOREIGN_FUNCTION_PTR_BIT;
-        *(u64 *)(e->bss_segment + decl->offset) = proc;
-      } else {
-        *(u64 *)(e->bss_segment + decl->offset) = (u64)(e->instructions + e->instruction_count);
-        bc_emit_stmt_block(e, decl->value->func.body);
-      }
-      
-      e->current_func = &decl->value->func;
-      
-      if (e->instructions[e->instruction_count-1].kind != I_RET) {
-        bc_instruction(e, is_entry ? I_HLT : I_RET, NULL_PARAM);
-      }
-    } break;
-    
-    case Code_Kind_EXPR: {
-      if (decl->value->expr.kind != Expr_Kind_TYPE) {
-        i32 size = get_size_of_type(decl->type);
-        bc_emit_expr(e, &decl->value->expr);
-        if (size > 8) {
-          assert(e->instructions[e->instruction_count-1].kind == I_LOAD);
-          e->instruction_count--;
-        }
-        
-        if (decl->storage_kind == Storage_Kind_BSS) {
-          bc_instruction(e, I_CONST_BSS, PARAM(i64, decl->offset));
-        } else if (decl->storage_kind == Storage_Kind_STACK) {
-          bc_instruction(e, I_CONST_STACK, PARAM(i64, decl->offset));
-        }
-        
-        bc_store_size(e, size);
-      }
-    } break;
-    
-    default: assert(false);
+
+  if (decl->value->kind == Code_Kind_FUNC) {
+    if (!decl->emitted) {
+      bc_declare_function(e, node);
+    }
+#if !BC_LAZY
+    if (!decl->value->func.foreign) {
+      bc_emit_function(e, e->functions[decl->function]);
+    }
+#endif
+  } else {
+    // NOTE(lvl5): a local's span is its statement's
+    if (!e->current_func) {
+      bc_source_span(e, node->first_token, node->last_token);
+    }
+    u16 dst;
+    if (bc_get_decl_reg(decl, &dst) &&
+        bc_emit_assign_regs(e, dst, T_ASSIGN, decl->value)) {
+      return;
+    }
+
+    bc_emit_value(e, decl->value);
+    if (decl->storage_kind == Storage_Kind_BSS) {
+      bc_instruction(e, I_CONST_BSS, PARAM(i64, decl->offset));
+    } else {
+      bc_instruction(e, I_CONST_STACK, PARAM(i64, decl->offset));
+    }
+    bc_store_type(e, decl->type);
+  }
+}
+
+// NOTE(lvl5): the #runs in functions that weren't emitted yet, they all
+// run before the program does. false if one of them failed
+b32 bc_fold_runs(Bc_Emitter *e, Code_Node **runs) {
+  for (u32 i = 0; i < sb_count(runs); i++) {
+    if (runs[i]->kind == Code_Kind_EXPR_RUN) {
+      bc_fold_run(e, runs[i]);
+    }
+  }
+  b32 result = string_is_empty(e->parser->error);
+  return result;
+}
+
+// NOTE(lvl5): the top level decls. global initializers go into __global,
+// which runs before anything else. false if there's no __entry
+b32 bc_emit_program(Bc_Emitter *e, Code_Node **decls) {
+  assert(e->func->index == 0);
+  // NOTE(lvl5): every function has its slot before anything is emitted,
+  // a #run can call one that is declared after it
+  for (u32 i = 0; i < sb_count(decls); i++) {
+    Code_Node *value = decls[i]->s_decl.value;
+    if (value && value->kind == Code_Kind_FUNC) {
+      bc_declare_function(e, decls[i]);
+    }
+  }
+  for (u32 i = 0; i < sb_count(decls); i++) {
+    bc_emit_decl(e, decls[i]);
+  }
+  bc_instruction(e, I_RET, NULL_PARAM);
+  bc_peephole(e, e->func);
+
+  b32 result = e->entry_function != 0;
+  return result;
+}
+
+// NOTE(lvl5): #run. the expression goes in __run, which stores its value
+// right after ctx at the start of the frame. everything is emitted first,
+// constants go on the BSS when their code is emitted and the VM gets a
+// copy of it before it starts. every #run uses the same VM, e->run_vm,
+// with a fresh copy of the BSS and an empty heap, so what one does to
+// globals is gone for the next. false if it stopped, the VM has the error
+b32 bc_run_expr(Bc_Emitter *e, Code_Node *node, byte *value) {
+  Code_Expr_Run *run = &node->e_run;
+  Code_Node *expr = run->expr;
+  i32 offset = get_size_of_type(run->ctx->s_decl.type);
+  i32 size = get_size_of_type(expr->type);
+
+  // NOTE(lvl5): a #run inside this one, or in a function it needs, is
+  // folded while this one is emitted and takes the next __run
+  if (sb_count(e->run_functions) == e->run_depth) {
+    sb_push(e->run_functions, bc_function(e, const_string("__run")));
+  }
+  Bc_Function *func = e->run_functions[e->run_depth++];
+  func->instruction_count = 0;
+  sb_count(func->source_spans) = 0;
+
+  Code_Func code_func = {0};
+  code_func.stack_size = offset + size;
+
+  Bc_Function *old_code = e->func;
+  Code_Func *old_func = e->current_func;
+  u32 old_defer_base = e->defer_base;
+  i32 old_call_frame = e->call_frame;
+  e->func = func;
+  e->current_func = &code_func;
+  e->defer_base = sb_count(e->defers);
+  e->call_frame = 0;
+
+  bc_source_span(e, expr->first_token, expr->last_token);
+  bc_emit_value(e, expr);
+  bc_instruction(e, I_CONST_STACK, PARAM(i64, offset));
+  bc_store_type(e, expr->type);
+  bc_instruction(e, I_RET, NULL_PARAM);
+  bc_peephole(e, func);
+
+  e->func = old_code;
+  e->current_func = old_func;
+  e->defer_base = old_defer_base;
+  e->call_frame = old_call_frame;
+
+  for (u32 i = 0; i < sb_count(e->functions); i++) {
+    bc_emit_function(e, e->functions[i]);
+  }
+
+  Bc_Vm *vm = e->run_vm;
+  if (!vm) {
+    Arena *arena = arena_push_struct(e->arena, Arena);
+    arena_init(arena, malloc(BC_RUN_ARENA_SIZE), BC_RUN_ARENA_SIZE);
+    vm = arena_push_struct(e->arena, Bc_Vm);
+    bc_vm_init(vm, arena, e, 0);
+    vm->compile_time = true;
+    e->run_vm = vm;
+  } else {
+    copy_memory(vm->bss, e->bss_segment, BC_BSS_SIZE);
+    vm->heap.size = 0;
+    // NOTE(lvl5): the code is loaded on the first run, __run is new
+    // every time
+    if (vm->func_code) {
+      bc_load_new_functions(vm);
+      vm->func_code[func->index] = bc_load_code(vm, func);
+    }
+  }
+  zero_memory(vm->stack, code_func.stack_size);
+  b32 result = bc_vm_run(vm, func->index);
+  if (result) {
+    copy_memory(value, vm->stack + offset, size);
+  }
+  e->run_depth--;
+  return result;
+}
+
+// NOTE(lvl5): runs a #run and turns it into the literal its value would be
+// written as. a struct or an array is read from its slot on the BSS
+void bc_fold_run(Bc_Emitter *e, Code_Node *node) {
+  Parser *p = e->parser;
+  Code_Node *type = node->type;
+  i32 size = get_size_of_type(type);
+  byte *value = arena_push_array(e->arena, byte, size);
+  zero_memory(value, size);
+  if (!bc_run_expr(e, node, value) && string_is_empty(p->error)) {
+    compiler_error(p, p->tokens[node->first_token], "%s", e->run_vm->error);
+  }
+
+  Code_Node *final_type = get_final_type(type);
+  if (final_type->kind == Code_Kind_TYPE_ENUM) {
+    final_type = get_final_type(final_type->t_enum.item_type);
+  }
+  if (bc_by_address(final_type)) {
+    Placeholder *placeholder = node->e_run.placeholder;
+    placeholder->data = value;
+    Code_Node *address = code_expr_int(p, 0);
+    address->e_int.placeholder = placeholder;
+    address->type = code_type_pointer(p, type);
+    node->kind = Code_Kind_EXPR_UNARY;
+    node->e_unary.op = T_DEREF;
+    node->e_unary.val = address;
+  } else if (final_type->kind == Code_Kind_TYPE_FLOAT) {
+    f64 float_value;
+    if (size == 4) {
+      f32 small_value;
+      copy_memory_small((byte *)&small_value, value, 4);
+      float_value = small_value;
+    } else {
+      copy_memory_small((byte *)&float_value, value, 8);
+    }
+    Code_Node *literal = code_expr_float(p, float_value);
+    literal->type = builtin_f64;
+    node->kind = Code_Kind_EXPR_CAST;
+    node->e_cast.cast_type = type;
+    node->e_cast.expr = literal;
+    node->e_cast.implicit = true;
+  } else {
+    u64 bits = 0;
+    copy_memory_small((byte *)&bits, value, size);
+    node->kind = Code_Kind_EXPR_INT;
+    node->e_int.value = (u64)bc_narrow_value((i64)bits, final_type);
+    node->e_int.placeholder = 0;
   }
 }
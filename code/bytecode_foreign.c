@@ -0,0 +1,501 @@
+// NOTE(lvl5): foreign calls on linux x86-64. every foreign signature gets a
+// small native thunk that moves the arguments from the VM stack into the
+// registers and stack slots the System V ABI wants, calls the function
+// and writes the result back to stack + 0. a thunk is made the first time
+// its signature is called and shared by every function with the same
+// argument classes, so a call doesn't allocate or look at types again.
+//
+// callbacks go the other way: a VM function passed to native code becomes
+// a small stub that jumps into a trampoline made per signature, which
+// stores the native arguments into a VM frame and runs the function.
+//
+// the signatures themselves are made while emitting on every platform,
+// the windows path only looks at their sizes
+
+// NOTE(lvl5): marks the eightbytes [offset, offset + size) of a value,
+// integer wins when it shares one with a float
+void bc_foreign_classify(Code_Node *type, i32 offset, Bc_Arg_Class *classes) {
+  Code_Node *final_type = get_final_type(type);
+  if (final_type->kind == Code_Kind_TYPE_ENUM) {
+    final_type = get_final_type(final_type->t_enum.item_type);
+  }
+
+  if (final_type->kind == Code_Kind_TYPE_STRUCT) {
+    for (u32 i = 0; i < sb_count(final_type->t_struct.members); i++) {
+      Code_Stmt_Decl *member = &final_type->t_struct.members[i]->s_decl;
+      bc_foreign_classify(member->type, offset + member->offset, classes);
+    }
+  } else if (final_type->kind == Code_Kind_TYPE_ARRAY) {
+    i32 item_size = get_size_of_type(final_type->t_array.item_type);
+    for (u64 i = 0; i < final_type->t_array.count; i++) {
+      bc_foreign_classify(final_type->t_array.item_type, offset + (i32)i*item_size, classes);
+    }
+  } else {
+    i32 size = get_size_of_type(final_type);
+    Bc_Arg_Class class = final_type->kind == Code_Kind_TYPE_FLOAT ? Bc_Arg_Class_SSE : Bc_Arg_Class_INT;
+    for (i32 i = offset/8; i <= (offset + size - 1)/8; i++) {
+      if (class == Bc_Arg_Class_INT || classes[i] == Bc_Arg_Class_NONE) {
+        classes[i] = class;
+      }
+    }
+  }
+}
+
+Bc_Foreign_Value bc_foreign_value(Code_Node *type) {
+  Bc_Foreign_Value result = {0};
+  Code_Node *final_type = get_final_type(type);
+  if (final_type->kind != Code_Kind_TYPE_VOID) {
+    result.size = get_size_of_type(type);
+    if (result.size > 16) {
+      result.classes[0] = Bc_Arg_Class_MEMORY;
+    } else {
+      bc_foreign_classify(type, 0, result.classes);
+    }
+
+    if (final_type->kind == Code_Kind_TYPE_ENUM) {
+      final_type = get_final_type(final_type->t_enum.item_type);
+    }
+    result.is_signed = final_type->kind == Code_Kind_TYPE_INT && final_type->t_int.is_signed;
+    result.is_func = final_type->kind == Code_Kind_TYPE_FUNC;
+  }
+  return result;
+}
+
+Bc_Foreign_Sig bc_foreign_sig(Code_Type_Func *func) {
+  Bc_Foreign_Sig result;
+  zero_memory(&result, sizeof(result));
+  result.ret = bc_foreign_value(func->return_type);
+  result.arg_count = sb_count(func->params);
+  assert(result.arg_count <= BC_FOREIGN_MAX_ARGS);
+  for (i32 i = 0; i < result.arg_count; i++) {
+    result.args[i] = bc_foreign_value(func->params[i]->s_decl.type);
+  }
+  return result;
+}
+
+#if BC_SYSV
+#include <dlfcn.h>
+
+#define BC_FOREIGN_MAX_THUNKS 256
+#define BC_FOREIGN_CACHE_SIZE 64
+
+// NOTE(lvl5): signature -> thunk, every VM has a table of these so a
+// call that hits doesn't touch anything shared. a miss only costs a
+// signature lookup
+struct Bc_Foreign_Cache_Entry {
+  Bc_Foreign_Sig *sig;
+  Bc_Foreign_Thunk thunk;
+};
+
+typedef struct {
+  Bc_Jit code;
+  Bc_Foreign_Sig sigs[BC_FOREIGN_MAX_THUNKS];
+  Bc_Foreign_Thunk thunks[BC_FOREIGN_MAX_THUNKS];
+  i32 thunk_count;
+
+  Bc_Foreign_Sig callback_sigs[BC_FOREIGN_MAX_THUNKS];
+  void *callback_trampolines[BC_FOREIGN_MAX_THUNKS];
+  i32 callback_count;
+} Bc_Foreign;
+
+Bc_Foreign bc_foreign;
+
+// NOTE(lvl5): a callback's frame goes in the caller's frame, just past
+// the return slot of the foreign call it's made from. every thunk stores
+// that in the slot in front of its VM's BSS, the arguments are in
+// registers by then
+typedef struct {
+  Bc_Vm *vm;
+  i64 function;
+  byte **callback_stack; // the VM's slot
+} Bc_Callback;
+
+// NOTE(lvl5): #foreign modules are named the windows way (msvcrt,
+// kernel32...), so when there's no such library the symbol is looked
+// up in what's already loaded, which has libc, and then in libm
+void *bc_foreign_proc(char *library_name, char *proc_name) {
+  void *result = 0;
+  void *library = dlopen(library_name, RTLD_LAZY);
+  if (library) {
+    result = dlsym(library, proc_name);
+  }
+  if (!result) {
+    result = dlsym(dlopen(0, RTLD_LAZY), proc_name);
+  }
+  if (!result) {
+    void *libm = dlopen("libm.so.6", RTLD_LAZY);
+    if (libm) result = dlsym(libm, proc_name);
+  }
+  return result;
+}
+
+i32 bc_foreign_eightbytes(Bc_Foreign_Value *value) {
+  i32 result = value->size > 8 ? 2 : 1;
+  return result;
+}
+
+Jit_Reg bc_foreign_gprs[] = {JIT_RDI, JIT_RSI, JIT_RDX, JIT_RCX, JIT_R8, JIT_R9};
+
+// NOTE(lvl5): which arguments are passed on the native stack, returns
+// how many bytes they take there. a struct that doesn't fit in the
+// registers that are left goes there whole, like the ABI says
+i32 bc_foreign_layout(Bc_Foreign_Sig *sig, b32 *in_memory) {
+  i32 result = 0;
+  i32 gpr_count = sig->ret.classes[0] == Bc_Arg_Class_MEMORY ? 1 : 0;
+  i32 sse_count = 0;
+  for (i32 i = 0; i < sig->arg_count; i++) {
+    Bc_Foreign_Value *arg = sig->args + i;
+    i32 gpr_need = 0;
+    i32 sse_need = 0;
+    for (i32 k = 0; k < bc_foreign_eightbytes(arg); k++) {
+      if (arg->classes[k] == Bc_Arg_Class_INT) gpr_need++;
+      if (arg->classes[k] == Bc_Arg_Class_SSE) sse_need++;
+    }
+    in_memory[i] = arg->classes[0] == Bc_Arg_Class_MEMORY ||
+      gpr_count + gpr_need > array_count(bc_foreign_gprs) || sse_count + sse_need > 8;
+    if (in_memory[i]) {
+      result += (arg->size + 7) & ~7;
+    } else {
+      gpr_count += gpr_need;
+      sse_count += sse_need;
+    }
+  }
+  return result;
+}
+
+void *bc_callback_pointer(u64 value);
+
+// NOTE(lvl5): reg = [rbx + offset], the thunk keeps the VM stack in rbx
+void bc_foreign_load(Bc_Jit *jit, Jit_Reg reg, i32 offset, i32 size, b32 is_signed) {
+  switch (size) {
+    case 1:
+    jit_op_mem(jit, is_signed ? 0x0FBE : 0x0FB6, reg, JIT_RBX, offset);
+    break;
+    case 2:
+    jit_op_mem(jit, is_signed ? 0x0FBF : 0x0FB7, reg, JIT_RBX, offset);
+    break;
+    case 4:
+    jit_op_mem_sized(jit, 0, is_signed, is_signed ? 0x63 : 0x8B, reg, JIT_RBX, offset);
+    break;
+    default:
+    jit_op_mem(jit, 0x8B, reg, JIT_RBX, offset);
+    break;
+  }
+}
+
+void bc_foreign_store(Bc_Jit *jit, Jit_Reg reg, i32 offset, i32 size) {
+  switch (size) {
+    case 1:
+    jit_op_mem_sized(jit, 0, false, 0x88, reg, JIT_RBX, offset);
+    break;
+    case 2:
+    jit_op_mem_sized(jit, 0x66, false, 0x89, reg, JIT_RBX, offset);
+    break;
+    case 4:
+    jit_op_mem_sized(jit, 0, false, 0x89, reg, JIT_RBX, offset);
+    break;
+    default:
+    jit_op_mem(jit, 0x89, reg, JIT_RBX, offset);
+    break;
+  }
+}
+
+// NOTE(lvl5): movss/movsd, load is 0x0F10 and store 0x0F11
+void bc_foreign_sse(Bc_Jit *jit, u32 opcode, i32 xmm, i32 offset, i32 size) {
+  jit_op_mem_sized(jit, size == 4 ? 0xF3 : 0xF2, false, opcode, (Jit_Reg)xmm, JIT_RBX, offset);
+}
+
+// NOTE(lvl5): thunk(proc, stack, callback_stack). arguments are packed on
+// the VM stack after the return value slot
+Bc_Foreign_Thunk bc_foreign_compile(Bc_Foreign_Sig *sig) {
+  Jit_Reg *gprs = bc_foreign_gprs;
+
+  // NOTE(lvl5): a thunk has no interpreter to fall back to. every thunk,
+  // trampoline and callback stub takes a page, the buffer has room for
+  // the BC_FOREIGN_MAX_THUNKS of each and a few thousand stubs
+  Bc_Jit *jit = &bc_foreign.code;
+  bc_jit_init(jit, megabytes(16));
+  b32 fits = bc_jit_begin(jit);
+  Bc_Foreign_Thunk result = (Bc_Foreign_Thunk)(jit->code + jit->size);
+
+  b32 in_memory[BC_FOREIGN_MAX_ARGS];
+  i32 memory_size = bc_foreign_layout(sig, in_memory);
+  
+  JIT_BYTES(jit, "\x55"); // push rbp
+  JIT_BYTES(jit, "\x48\x89\xE5"); // mov rbp, rsp
+  JIT_BYTES(jit, "\x53\x41\x54"); // push rbx, r12
+  JIT_BYTES(jit, "\x48\x89\xF3"); // mov rbx, rsi
+  JIT_BYTES(jit, "\x49\x89\xFC"); // mov r12, rdi
+  jit_op_mem(jit, 0x8D, JIT_RCX, JIT_RSI, sig->ret.size); // lea rcx, [rsi + ret]
+  JIT_BYTES(jit, "\x48\x89\x0A"); // mov [rdx], rcx
+  JIT_BYTES(jit, "\x48\x81\xEC"); // sub rsp, imm32
+  jit_u32(jit, (u32)((memory_size + 15) & ~15));
+  
+  i32 stack_offset = sig->ret.size;
+  for (i32 i = 0; i < sig->arg_count; i++) {
+    if (sig->args[i].is_func) {
+      jit_op_mem(jit, 0x8B, JIT_RDI, JIT_RBX, stack_offset);
+      jit_mov_imm(jit, JIT_RAX, (u64)bc_callback_pointer);
+      JIT_BYTES(jit, "\xFF\xD0"); // call rax
+      jit_op_mem(jit, 0x89, JIT_RAX, JIT_RBX, stack_offset);
+    }
+    stack_offset += sig->args[i].size;
+  }
+  
+  i32 gpr = sig->ret.classes[0] == Bc_Arg_Class_MEMORY ? 1 : 0;
+  i32 sse = 0;
+  i32 memory_offset = 0;
+  stack_offset = sig->ret.size;
+  for (i32 i = 0; i < sig->arg_count; i++) {
+    Bc_Foreign_Value *arg = sig->args + i;
+    if (in_memory[i]) {
+      if (arg->size <= 8) {
+        bc_foreign_load(jit, JIT_RAX, stack_offset, arg->size, arg->is_signed);
+        jit_op_mem(jit, 0x89, JIT_RAX, JIT_RSP, memory_offset);
+      } else {
+        for (i32 at = 0; at < arg->size; at += 8) {
+          jit_op_mem(jit, 0x8B, JIT_RAX, JIT_RBX, stack_offset + at);
+          jit_op_mem(jit, 0x89, JIT_RAX, JIT_RSP, memory_offset + at);
+        }
+      }
+      memory_offset += (arg->size + 7) & ~7;
+    } else {
+      for (i32 k = 0; k < bc_foreign_eightbytes(arg); k++) {
+        i32 size = arg->size - 8*k < 8 ? arg->size - 8*k : 8;
+        if (arg->classes[k] == Bc_Arg_Class_SSE) {
+          bc_foreign_sse(jit, 0x0F10, sse++, stack_offset + 8*k, size);
+        } else {
+          bc_foreign_load(jit, gprs[gpr++], stack_offset + 8*k, size, arg->is_signed);
+        }
+      }
+    }
+    stack_offset += arg->size;
+  }
+
+  if (sig->ret.classes[0] == Bc_Arg_Class_MEMORY) {
+    JIT_BYTES(jit, "\x48\x89\xDF"); // mov rdi, rbx
+  }
+  // NOTE(lvl5): al is how many xmm registers a vararg function gets
+  JIT_BYTES(jit, "\xB8"); // mov eax, imm32
+  jit_u32(jit, (u32)sse);
+  JIT_BYTES(jit, "\x41\xFF\xD4"); // call r12
+
+  if (sig->ret.classes[0] != Bc_Arg_Class_MEMORY) {
+    Jit_Reg ret_gprs[] = {JIT_RAX, JIT_RDX};
+    i32 ret_gpr = 0;
+    i32 ret_sse = 0;
+    for (i32 k = 0; k < bc_foreign_eightbytes(&sig->ret) && sig->ret.size; k++) {
+      i32 size = sig->ret.size - 8*k < 8 ? sig->ret.size - 8*k : 8;
+      if (sig->ret.classes[k] == Bc_Arg_Class_SSE) {
+        bc_foreign_sse(jit, 0x0F11, ret_sse++, 8*k, size);
+      } else {
+        bc_foreign_store(jit, ret_gprs[ret_gpr++], 8*k, size);
+      }
+    }
+  }
+
+  JIT_BYTES(jit, "\x48\x8D\x65\xF0"); // lea rsp, [rbp - 16]
+  JIT_BYTES(jit, "\x41\x5C\x5B\x5D"); // pop r12, rbx, rbp
+  JIT_BYTES(jit, "\xC3");
+  fits = bc_jit_end(jit) && fits;
+  assert(fits);
+  return result;
+}
+
+// NOTE(lvl5): cache is the calling VM's, the JIT picks thunks while
+// compiling and has none
+Bc_Foreign_Thunk bc_foreign_thunk(Bc_Foreign_Cache_Entry *cache, Bc_Foreign_Sig *sig) {
+  Bc_Foreign *foreign = &bc_foreign;
+  Bc_Foreign_Cache_Entry none = {0};
+  Bc_Foreign_Cache_Entry *entry = cache ? cache + ((u64)sig >> 4) % BC_FOREIGN_CACHE_SIZE : &none;
+
+  if (entry->sig != sig) {
+    bc_code_lock();
+    Bc_Foreign_Thunk thunk = 0;
+    for (i32 i = 0; i < foreign->thunk_count && !thunk; i++) {
+      if (compare_memory(foreign->sigs + i, sig, sizeof(Bc_Foreign_Sig))) {
+        thunk = foreign->thunks[i];
+      }
+    }
+    if (!thunk) {
+      assert(foreign->thunk_count < BC_FOREIGN_MAX_THUNKS);
+      thunk = bc_foreign_compile(sig);
+      foreign->sigs[foreign->thunk_count] = *sig;
+      foreign->thunks[foreign->thunk_count] = thunk;
+      foreign->thunk_count++;
+    }
+    bc_code_unlock();
+    entry->sig = sig;
+    entry->thunk = thunk;
+  }
+  return entry->thunk;
+}
+
+// NOTE(lvl5): called by the trampolines with the arguments in the frame,
+// the result is left at stack + 0
+void bc_callback_run(Bc_Callback *callback, byte *stack) {
+  byte *callback_stack = *callback->callback_stack;
+  Bc_Vm *vm = callback->vm;
+#if BC_JIT
+  Bc_Function *func = vm->emitter->functions[callback->function];
+  if (bc_jit_tier_up(vm, func)) {
+    Bc_Vm *outer_vm = bc_vm_active;
+    bc_vm_active = vm;
+    ((Bc_Jit_Func)bc_atomic_load_ptr(&func->native))(stack, vm->bss);
+    bc_vm_active = outer_vm;
+  } else {
+    bc_vm_execute(vm, callback->function, stack);
+  }
+#else
+  bc_vm_execute(vm, callback->function, stack);
+#endif
+  *callback->callback_stack = callback_stack;
+}
+
+// NOTE(lvl5): entered with the Bc_Callback in r10, the frame goes where
+// its callback_stack points
+void *bc_callback_compile_trampoline(Bc_Foreign_Sig *sig) {
+  Jit_Reg *gprs = bc_foreign_gprs;
+  
+  Bc_Jit *jit = &bc_foreign.code;
+  bc_jit_init(jit, megabytes(16));
+  b32 fits = bc_jit_begin(jit);
+  void *result = jit->code + jit->size;
+  
+  b32 in_memory[BC_FOREIGN_MAX_ARGS];
+  i32 memory_size = bc_foreign_layout(sig, in_memory);
+  
+  JIT_BYTES(jit, "\x55"); // push rbp
+  JIT_BYTES(jit, "\x48\x89\xE5"); // mov rbp, rsp
+  JIT_BYTES(jit, "\x53\x41\x54\x41\x55\x41\x55"); // push rbx, r12, r13, r13
+  JIT_BYTES(jit, "\x4D\x89\xD4"); // mov r12, r10
+  JIT_BYTES(jit, "\x49\x89\xFD"); // mov r13, rdi
+  jit_op_mem(jit, 0x8B, JIT_RAX, JIT_R12, offsetof(Bc_Callback, callback_stack));
+  jit_op_mem(jit, 0x8B, JIT_RBX, JIT_RAX, 0);
+  
+  i32 gpr = sig->ret.classes[0] == Bc_Arg_Class_MEMORY ? 1 : 0;
+  i32 sse = 0;
+  i32 memory_offset = 16; // past the saved rbp and return address
+  i32 stack_offset = sig->ret.size;
+  for (i32 i = 0; i < sig->arg_count; i++) {
+    Bc_Foreign_Value *arg = sig->args + i;
+    if (in_memory[i]) {
+      for (i32 at = 0; at < arg->size; at += 8) {
+        jit_op_mem(jit, 0x8B, JIT_RAX, JIT_RBP, memory_offset + at);
+        jit_op_mem(jit, 0x89, JIT_RAX, JIT_RBX, stack_offset + at);
+      }
+      memory_offset += (arg->size + 7) & ~7;
+    } else {
+      for (i32 k = 0; k < bc_foreign_eightbytes(arg); k++) {
+        i32 size = arg->size - 8*k < 8 ? arg->size - 8*k : 8;
+        if (arg->classes[k] == Bc_Arg_Class_SSE) {
+          bc_foreign_sse(jit, 0x0F11, sse++, stack_offset + 8*k, size);
+        } else {
+          bc_foreign_store(jit, gprs[gpr++], stack_offset + 8*k, size);
+        }
+      }
+    }
+    stack_offset += arg->size;
+  }
+  
+  JIT_BYTES(jit, "\x4C\x89\xE7"); // mov rdi, r12
+  JIT_BYTES(jit, "\x48\x89\xDE"); // mov rsi, rbx
+  jit_mov_imm(jit, JIT_RAX, (u64)bc_callback_run);
+  JIT_BYTES(jit, "\xFF\xD0"); // call rax
+  
+  if (sig->ret.classes[0] == Bc_Arg_Class_MEMORY) {
+    JIT_BYTES(jit, "\x4C\x89\xEF"); // mov rdi, r13
+    JIT_BYTES(jit, "\x48\x89\xDE"); // mov rsi, rbx
+    JIT_BYTES(jit, "\xBA"); // mov edx, imm32
+    jit_u32(jit, (u32)sig->ret.size);
+    jit_mov_imm(jit, JIT_RAX, (u64)copy_memory);
+    JIT_BYTES(jit, "\xFF\xD0"); // call rax
+    JIT_BYTES(jit, "\x4C\x89\xE8"); // mov rax, r13
+  } else {
+    Jit_Reg ret_gprs[] = {JIT_RAX, JIT_RDX};
+    i32 ret_gpr = 0;
+    i32 ret_sse = 0;
+    for (i32 k = 0; k < bc_foreign_eightbytes(&sig->ret) && sig->ret.size; k++) {
+      i32 size = sig->ret.size - 8*k < 8 ? sig->ret.size - 8*k : 8;
+      if (sig->ret.classes[k] == Bc_Arg_Class_SSE) {
+        bc_foreign_sse(jit, 0x0F10, ret_sse++, 8*k, size);
+      } else {
+        bc_foreign_load(jit, ret_gprs[ret_gpr++], 8*k, size, sig->ret.is_signed);
+      }
+    }
+  }
+  
+  JIT_BYTES(jit, "\x48\x8D\x65\xE8"); // lea rsp, [rbp - 24]
+  JIT_BYTES(jit, "\x41\x5D\x41\x5C\x5B\x5D"); // pop r13, r12, rbx, rbp
+  JIT_BYTES(jit, "\xC3");
+  fits = bc_jit_end(jit) && fits;
+  assert(fits);
+  return result;
+}
+
+// NOTE(lvl5): a function value going to native code. foreign ones just
+// lose their tag, VM functions get a stub that enters the running VM
+void *bc_callback_pointer(u64 value) {
+  void *result = 0;
+  if (value & FOREIGN_FUNCTION_PTR_BIT) {
+    result = (void *)(value & ~FOREIGN_FUNCTION_PTR_BIT);
+  } else {
+    Bc_Vm *vm = bc_vm_active;
+    assert(vm && value < sb_count(vm->callbacks));
+    if (!vm->callbacks[value]) {
+      bc_code_lock();
+      Bc_Foreign *foreign = &bc_foreign;
+      Bc_Function *func = vm->emitter->functions[value];
+      Bc_Foreign_Sig *sig = vm->emitter->signatures[func->signature];
+      
+      void *trampoline = 0;
+      for (i32 i = 0; i < foreign->callback_count && !trampoline; i++) {
+        if (compare_memory(foreign->callback_sigs + i, sig, sizeof(Bc_Foreign_Sig))) {
+          trampoline = foreign->callback_trampolines[i];
+        }
+      }
+      if (!trampoline) {
+        assert(foreign->callback_count < BC_FOREIGN_MAX_THUNKS);
+        trampoline = bc_callback_compile_trampoline(sig);
+        foreign->callback_sigs[foreign->callback_count] = *sig;
+        foreign->callback_trampolines[foreign->callback_count] = trampoline;
+        foreign->callback_count++;
+      }
+      
+      Bc_Callback *callback = arena_push_struct(vm->arena, Bc_Callback);
+      callback->vm = vm;
+      callback->function = (i64)value;
+      callback->callback_stack = bc_callback_slot(vm->bss);
+      
+      Bc_Jit *jit = &foreign->code;
+      b32 fits = bc_jit_begin(jit);
+      void *stub = jit->code + jit->size;
+      jit_mov_imm(jit, JIT_R10, (u64)callback);
+      jit_mov_imm(jit, JIT_R11, (u64)trampoline);
+      JIT_BYTES(jit, "\x41\xFF\xE3"); // jmp r11
+      fits = bc_jit_end(jit) && fits;
+      assert(fits);
+      vm->callbacks[value] = stub;
+      bc_code_unlock();
+    }
+    result = vm->callbacks[value];
+  }
+  return result;
+}
+#endif
+
+// NOTE(lvl5): a #foreign function's address tagged the way the BSS keeps
+// it, 0 if it can't be found
+u64 bc_foreign_address(char *library_name, char *proc_name) {
+  u64 result = 0;
+#if BC_SYSV
+  u64 proc = (u64)bc_foreign_proc(library_name, proc_name);
+#else
+  void *library = LoadLibraryA(library_name);
+  u64 proc = library ? (u64)GetProcAddress(library, proc_name) : 0;
+#endif
+  if (proc) {
+    result = proc | FOREIGN_FUNCTION_PTR_BIT;
+  }
+  return result;
+}
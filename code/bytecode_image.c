@@ -0,0 +1,551 @@
+// NOTE(lvl5): .lbc bytecode images. bc_image_write saves everything the VM
+// needs after compiling: the code of every function, the signature table,
+// the BSS as it is before anything runs, the #foreign functions with the
+// BSS slots their addresses go in, the loops and the source spans. with
+// a snapshot the BSS is the one the #init functions left and their heap
+// comes along, see bytecode_snapshot.c
+// bc_image_load maps the file and fills an emitter from it without a
+// parser, so a program can be run with no front end at all.
+//
+// the code doesn't need relocating: calls go through function indices,
+// the BSS and the stack are addressed relative to their segment and CALL
+// takes a signature index. the only absolute addresses are the #foreign
+// ones, which are looked up again on load, and the snapshot's pointers,
+// which are saved as offsets and added to wherever the BSS and the heap
+// end up. instructions and signatures are
+// used right where they are mapped, 64 bit constants sit inline in the
+// instructions
+//
+// sections are raw structs, an image only loads into a build of the VM
+// with the same layout, which the header checks. the code is checked too,
+// see bc_image_check_code, a damaged image is refused instead of run
+
+#define BC_IMAGE_MAGIC 0x3143424C // "LBC1"
+#define BC_IMAGE_VERSION 5
+#define BC_IMAGE_ALIGN 16
+
+typedef struct {
+  u64 offset; // from the start of the file
+  u64 count;
+} Bc_Image_Section;
+
+typedef struct {
+  u32 magic;
+  u32 version;
+  u32 instruction_size;
+  u32 signature_size;
+  i64 entry_function;
+  Bc_Context_Layout context;
+  b32 snapshot; // the globals are set already, only the inits are left to run
+  
+  Bc_Image_Section functions; // Bc_Image_Function
+  Bc_Image_Section code; // Bc_Instruction
+  Bc_Image_Section spans; // Bc_Source_Span
+  Bc_Image_Section loops; // i64, the function each loop is in
+  Bc_Image_Section signatures; // Bc_Foreign_Sig
+  Bc_Image_Section imports; // Bc_Image_Import
+  Bc_Image_Section strings; // zero terminated
+  Bc_Image_Section bss; // the start of the BSS, the rest of it is 0
+  Bc_Image_Section inits; // i64, the #init functions that are left to run
+  Bc_Image_Section relocations; // Bc_Relocation
+  Bc_Image_Section heap;
+} Bc_Image_Header;
+
+typedef struct {
+  u64 name; // into strings
+  u32 name_length;
+  i32 signature;
+  u64 code; // into code
+  u64 instruction_count;
+  u64 spans; // into spans
+  u64 span_count;
+} Bc_Image_Function;
+
+typedef struct {
+  u64 module; // into strings
+  u64 name;
+  u32 module_length;
+  u32 name_length;
+  i32 offset; // of the BSS slot
+} Bc_Image_Import;
+
+Bc_Image_Section bc_image_section(u64 *position, u64 count, u64 item_size) {
+  Bc_Image_Section result;
+  result.offset = (*position + BC_IMAGE_ALIGN - 1) & ~(u64)(BC_IMAGE_ALIGN - 1);
+  result.count = count;
+  *position = result.offset + count*item_size;
+  return result;
+}
+
+// NOTE(lvl5): pads the file up to the section and writes it
+void bc_image_write_section(FILE *file, u64 *position, Bc_Image_Section section,
+                            void *data, u64 size) {
+  byte padding[BC_IMAGE_ALIGN] = {0};
+  assert(section.offset >= *position && section.offset - *position < BC_IMAGE_ALIGN);
+  fwrite(padding, 1, section.offset - *position, file);
+  fwrite(data, 1, size, file);
+  *position = section.offset + size;
+}
+
+u64 bc_image_add_string(byte *strings, u64 *size, String str) {
+  u64 result = *size;
+  copy_memory(strings + result, str.data, str.count);
+  strings[result + str.count] = 0;
+  *size += str.count + 1;
+  return result;
+}
+
+// NOTE(lvl5): call it before running anything on the emitter's BSS. with
+// BC_LAZY the functions that weren't emitted yet are emitted now
+b32 bc_image_write(Bc_Emitter *e, char *path) {
+  for (u32 i = 0; i < sb_count(e->functions); i++) {
+    bc_emit_function(e, e->functions[i]);
+  }
+  
+  u32 function_count = sb_count(e->functions);
+  u32 import_count = sb_count(e->imports);
+  u64 instruction_count = 0;
+  u64 span_count = 0;
+  u64 string_size = 0;
+  for (u32 i = 0; i < function_count; i++) {
+    Bc_Function *func = e->functions[i];
+    instruction_count += func->instruction_count;
+    span_count += sb_count(func->source_spans);
+    string_size += func->name.count + 1;
+  }
+  for (u32 i = 0; i < import_count; i++) {
+    string_size += e->imports[i].module.count + e->imports[i].name.count + 2;
+  }
+  
+  u64 mark = arena_get_mark(e->arena);
+  
+  // NOTE(lvl5): foreign addresses are only good in this process
+  byte *bss = arena_push_array(e->arena, byte, BC_BSS_SIZE);
+  copy_memory(bss, e->bss_segment, BC_BSS_SIZE);
+  Bc_Snapshot *snapshot = e->snapshot;
+  u64 heap_size = 0;
+  u32 relocation_count = 0;
+  if (snapshot) {
+    copy_memory(bss, snapshot->bss, snapshot->bss_size);
+    heap_size = snapshot->heap_size;
+    relocation_count = sb_count(snapshot->relocations);
+  }
+  for (u32 i = 0; i < import_count; i++) {
+    *(u64 *)(bss + e->imports[i].offset) = 0;
+  }
+  u64 bss_size = BC_BSS_SIZE;
+  while (bss_size && !bss[bss_size - 1]) bss_size--;
+  
+  Bc_Image_Header header;
+  zero_memory(&header, sizeof(header));
+  header.magic = BC_IMAGE_MAGIC;
+  header.version = BC_IMAGE_VERSION;
+  header.instruction_size = sizeof(Bc_Instruction);
+  header.signature_size = sizeof(Bc_Foreign_Sig);
+  header.entry_function = e->entry_function;
+  header.context = e->context;
+  header.snapshot = snapshot != 0;
+  
+  u64 position = sizeof(header);
+  header.functions = bc_image_section(&position, function_count, sizeof(Bc_Image_Function));
+  header.code = bc_image_section(&position, instruction_count, sizeof(Bc_Instruction));
+  header.spans = bc_image_section(&position, span_count, sizeof(Bc_Source_Span));
+  header.loops = bc_image_section(&position, sb_count(e->loops), sizeof(i64));
+  header.signatures = bc_image_section(&position, sb_count(e->signatures), sizeof(Bc_Foreign_Sig));
+  header.imports = bc_image_section(&position, import_count, sizeof(Bc_Image_Import));
+  header.strings = bc_image_section(&position, string_size, 1);
+  header.bss = bc_image_section(&position, bss_size, 1);
+  header.inits = bc_image_section(&position, sb_count(e->init_functions), sizeof(i64));
+  header.relocations = bc_image_section(&position, relocation_count, sizeof(Bc_Relocation));
+  header.heap = bc_image_section(&position, heap_size, 1);
+  
+  Bc_Image_Function *functions = arena_push_array(e->arena, Bc_Image_Function, function_count);
+  Bc_Image_Import *imports = arena_push_array(e->arena, Bc_Image_Import, import_count);
+  byte *strings = arena_push_array(e->arena, byte, string_size);
+  i64 *loops = arena_push_array(e->arena, i64, sb_count(e->loops));
+  
+  string_size = 0;
+  instruction_count = 0;
+  span_count = 0;
+  for (u32 i = 0; i < function_count; i++) {
+    Bc_Function *func = e->functions[i];
+    Bc_Image_Function *dst = functions + i;
+    zero_memory(dst, sizeof(Bc_Image_Function));
+    dst->name = bc_image_add_string(strings, &string_size, func->name);
+    dst->name_length = func->name.count;
+    dst->signature = func->signature;
+    dst->code = instruction_count;
+    dst->instruction_count = func->instruction_count;
+    dst->spans = span_count;
+    dst->span_count = sb_count(func->source_spans);
+    instruction_count += func->instruction_count;
+    span_count += sb_count(func->source_spans);
+  }
+  for (u32 i = 0; i < import_count; i++) {
+    Bc_Import *import = e->imports + i;
+    Bc_Image_Import *dst = imports + i;
+    zero_memory(dst, sizeof(Bc_Image_Import));
+    dst->module = bc_image_add_string(strings, &string_size, import->module);
+    dst->module_length = import->module.count;
+    dst->name = bc_image_add_string(strings, &string_size, import->name);
+    dst->name_length = import->name.count;
+    dst->offset = import->offset;
+  }
+  for (u32 i = 0; i < sb_count(e->loops); i++) {
+    loops[i] = e->loops[i].function;
+  }
+  
+  FILE *file = bc_open_file(path);
+  b32 result = file != 0;
+  if (file) {
+    fwrite(&header, sizeof(header), 1, file);
+    position = sizeof(header);
+    bc_image_write_section(file, &position, header.functions, functions,
+                           function_count*sizeof(Bc_Image_Function));
+    for (u32 i = 0; i < function_count; i++) {
+      Bc_Function *func = e->functions[i];
+      Bc_Image_Section section = header.code;
+      section.offset += functions[i].code*sizeof(Bc_Instruction);
+      bc_image_write_section(file, &position, section, func->instructions,
+                             func->instruction_count*sizeof(Bc_Instruction));
+    }
+    for (u32 i = 0; i < function_count; i++) {
+      Bc_Function *func = e->functions[i];
+      Bc_Image_Section section = header.spans;
+      section.offset += functions[i].spans*sizeof(Bc_Source_Span);
+      bc_image_write_section(file, &position, section, func->source_spans,
+                             sb_count(func->source_spans)*sizeof(Bc_Source_Span));
+    }
+    bc_image_write_section(file, &position, header.loops, loops, sb_count(e->loops)*sizeof(i64));
+    for (u32 i = 0; i < sb_count(e->signatures); i++) {
+      Bc_Image_Section section = header.signatures;
+      section.offset += i*sizeof(Bc_Foreign_Sig);
+      bc_image_write_section(file, &position, section, e->signatures[i], sizeof(Bc_Foreign_Sig));
+    }
+    bc_image_write_section(file, &position, header.imports, imports,
+                           import_count*sizeof(Bc_Image_Import));
+    bc_image_write_section(file, &position, header.strings, strings, string_size);
+    bc_image_write_section(file, &position, header.bss, bss, bss_size);
+    bc_image_write_section(file, &position, header.inits, e->init_functions,
+                           sb_count(e->init_functions)*sizeof(i64));
+    if (snapshot) {
+      bc_image_write_section(file, &position, header.relocations, snapshot->relocations,
+                             relocation_count*sizeof(Bc_Relocation));
+      bc_image_write_section(file, &position, header.heap, snapshot->heap, heap_size);
+    }
+    result = !ferror(file);
+    fclose(file);
+  }
+  
+  arena_set_mark(e->arena, mark);
+  return result;
+}
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// NOTE(lvl5): read only, the mapping stays for the rest of the process
+byte *bc_map_file(char *path, u64 *size) {
+  byte *result = 0;
+  *size = 0;
+#ifdef _WIN32
+  HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL, 0);
+  if (file != INVALID_HANDLE_VALUE) {
+    LARGE_INTEGER file_size;
+    HANDLE mapping = 0;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart) {
+      mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+    }
+    if (mapping) {
+      result = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+      *size = file_size.QuadPart;
+      CloseHandle(mapping);
+    }
+    CloseHandle(file);
+  }
+#else
+  int file = open(path, O_RDONLY);
+  if (file >= 0) {
+    struct stat info;
+    if (fstat(file, &info) == 0 && info.st_size) {
+      void *memory = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+      if (memory != MAP_FAILED) {
+        result = memory;
+        *size = info.st_size;
+      }
+    }
+    close(file);
+  }
+#endif
+  return result;
+}
+
+b32 bc_image_section_fits(Bc_Image_Section section, u64 item_size, u64 file_size) {
+  b32 result = section.offset <= file_size &&
+    section.count <= (file_size - section.offset)/item_size;
+  return result;
+}
+
+// NOTE(lvl5): what the VM takes the emitter's word for. jumps land in
+// their function, calls name a function or a signature that's there and
+// the last instruction doesn't fall through. frame offsets stay in the
+// guard past a frame, or past what the STACK_PROBE the function starts
+// with checked, and BSS offsets in the BSS. an address computed from them
+// at runtime isn't checked, same as for code from the emitter
+b32 bc_image_check_code(Bc_Image_Header *header, Bc_Function *func) {
+  i64 count = func->instruction_count;
+  b32 result = count > 0;
+  i64 frame = BC_STACK_GUARD;
+  if (count > 0 && func->instructions[0].kind == I_STACK_PROBE) {
+    frame += func->instructions[0].param._i64;
+  }
+  for (i64 i = 0; i < count && result; i++) {
+    Bc_Instruction *instr = func->instructions + i;
+    Instruction_Kind kind = instr->kind;
+    i64 value = instr->param._i64;
+    Bc_Call call = instr->param._call;
+    if ((u32)kind >= I_COUNT) {
+      result = false;
+    } else if (bc_is_jump(kind)) {
+      i64 target = i + bc_jump_offset(instr);
+      result = target >= 0 && target < count;
+    } else if (kind == I_CALL) {
+      // NOTE(lvl5): the signature comes from the CONST before it
+      result = value >= 0 && value < frame && i > 0 &&
+        func->instructions[i - 1].kind == I_CONST &&
+        func->instructions[i - 1].param._u64 < header->signatures.count;
+    } else if (kind == I_CALL_DIRECT) {
+      result = call.function >= 0 && (u64)call.function < header->functions.count &&
+        call.frame >= 0 && call.frame < frame;
+    } else if (kind == I_TAIL_CALL || kind == I_EMIT_FUNC) {
+      result = value >= 0 && (u64)value < header->functions.count;
+    } else if (kind == I_LOOP) {
+      result = value >= 0 && (u64)value < header->loops.count;
+    } else if (kind == I_CONST_STACK || kind == I_LOAD_LOCAL || kind == I_STORE_LOCAL_64) {
+      result = value >= 0 && value < frame;
+    } else if (kind == I_STACK_PROBE) {
+      result = i == 0 && value >= BC_STACK_GUARD && value < BC_STACK_SIZE;
+    } else if (kind == I_STACK_CHANGE) {
+      result = value > -BC_STACK_GUARD && value < BC_STACK_GUARD;
+    } else if (kind == I_CONST_BSS) {
+      result = value >= 0 && value < BC_BSS_SIZE;
+    }
+  }
+  
+  Instruction_Kind last = count > 0 ? func->instructions[count - 1].kind : I_NONE;
+  result = result && (last == I_RET || last == I_TAIL_CALL || last == I_JMP || last == I_HLT);
+  return result;
+}
+
+b32 bc_image_sig_is_valid(Bc_Foreign_Sig *sig) {
+  b32 result = sig->arg_count >= 0 && sig->arg_count <= BC_FOREIGN_MAX_ARGS &&
+    sig->ret.size >= 0 && sig->ret.size < BC_STACK_GUARD;
+  for (i32 i = 0; i < sig->arg_count && result; i++) {
+    result = sig->args[i].size >= 0 && sig->args[i].size < BC_STACK_GUARD;
+  }
+  return result;
+}
+
+b32 bc_image_string_fits(Bc_Image_Section section, char *strings, u64 offset, u64 length) {
+  b32 result = offset < section.count && length < section.count - offset &&
+    strings[offset + length] == 0;
+  return result;
+}
+
+// NOTE(lvl5): fills e from the image at path for bytecode_run, there is
+// no parser behind it. false after printing why if the image can't be used
+b32 bc_image_load(Bc_Emitter *e, Arena *arena, char *path) {
+  b32 missing = false;
+  zero_memory(e, sizeof(Bc_Emitter));
+  e->arena = arena;
+  
+  u64 size;
+  byte *image = bc_map_file(path, &size);
+  Bc_Image_Header *header = (Bc_Image_Header *)image;
+  char *error = 0;
+  if (!image) {
+    error = "can't open the file";
+  } else if (size < sizeof(Bc_Image_Header) || header->magic != BC_IMAGE_MAGIC) {
+    error = "not a bytecode image";
+  } else if (header->version != BC_IMAGE_VERSION ||
+             header->instruction_size != sizeof(Bc_Instruction) ||
+             header->signature_size != sizeof(Bc_Foreign_Sig)) {
+    error = "made by a different version of the VM";
+  } else if (!bc_image_section_fits(header->functions, sizeof(Bc_Image_Function), size) ||
+             !bc_image_section_fits(header->code, sizeof(Bc_Instruction), size) ||
+             !bc_image_section_fits(header->spans, sizeof(Bc_Source_Span), size) ||
+             !bc_image_section_fits(header->loops, sizeof(i64), size) ||
+             !bc_image_section_fits(header->signatures, sizeof(Bc_Foreign_Sig), size) ||
+             !bc_image_section_fits(header->imports, sizeof(Bc_Image_Import), size) ||
+             !bc_image_section_fits(header->strings, 1, size) ||
+             !bc_image_section_fits(header->bss, 1, size) ||
+             !bc_image_section_fits(header->inits, sizeof(i64), size) ||
+             !bc_image_section_fits(header->relocations, sizeof(Bc_Relocation), size) ||
+             !bc_image_section_fits(header->heap, 1, size) ||
+             header->bss.count > BC_BSS_SIZE || header->heap.count > BC_HEAP_SIZE ||
+             header->entry_function < 0 || (u64)header->entry_function >= header->functions.count) {
+    error = "the file is damaged";
+  }
+  
+  char *strings = (char *)image + (error ? 0 : header->strings.offset);
+  Bc_Instruction *code = (Bc_Instruction *)(image + (error ? 0 : header->code.offset));
+  Bc_Source_Span *spans = (Bc_Source_Span *)(image + (error ? 0 : header->spans.offset));
+  
+  if (!error) {
+    e->functions = sb_new(arena, Bc_Function *, (u32)header->functions.count + 1);
+    Bc_Image_Function *functions = (Bc_Image_Function *)(image + header->functions.offset);
+    for (u64 i = 0; i < header->functions.count && !error; i++) {
+      Bc_Image_Function *src = functions + i;
+      if (!bc_image_string_fits(header->strings, strings, src->name, src->name_length) ||
+          src->code > header->code.count ||
+          src->instruction_count > header->code.count - src->code ||
+          src->spans > header->spans.count ||
+          src->span_count > header->spans.count - src->spans ||
+          src->signature < 0 || (u64)src->signature >= header->signatures.count) {
+        error = "the file is damaged";
+        break;
+      }
+      
+      Bc_Function *func = arena_push_struct(arena, Bc_Function);
+      zero_memory(func, sizeof(Bc_Function));
+      func->name = make_string(strings + src->name, src->name_length);
+      func->index = i;
+      func->signature = src->signature;
+      func->emitted = true;
+      func->instructions = code + src->code;
+      func->instruction_count = src->instruction_count;
+      func->instruction_capacity = src->instruction_count;
+      func->source_spans = sb_new(arena, Bc_Source_Span, (u32)src->span_count + 1);
+      copy_memory(func->source_spans, spans + src->spans, src->span_count*sizeof(Bc_Source_Span));
+      sb_count(func->source_spans) = (u32)src->span_count;
+      sb_push(e->functions, func);
+      
+      if (!bc_image_check_code(header, func)) {
+        error = "the file is damaged";
+      }
+    }
+  }
+  
+  if (!error) {
+    e->loops = sb_new(arena, Bc_Loop, (u32)header->loops.count + 1);
+    i64 *loops = (i64 *)(image + header->loops.offset);
+    for (u64 i = 0; i < header->loops.count; i++) {
+      if (loops[i] < 0 || (u64)loops[i] >= header->functions.count) {
+        error = "the file is damaged";
+      }
+      Bc_Loop loop = {0};
+      loop.function = loops[i];
+      loop.exits = sb_new(arena, i64, 4);
+      sb_push(e->loops, loop);
+    }
+    
+    e->signatures = sb_new(arena, Bc_Foreign_Sig *, (u32)header->signatures.count + 1);
+    Bc_Foreign_Sig *signatures = (Bc_Foreign_Sig *)(image + header->signatures.offset);
+    for (u64 i = 0; i < header->signatures.count; i++) {
+      if (!bc_image_sig_is_valid(signatures + i)) {
+        error = "the file is damaged";
+      }
+      sb_push(e->signatures, signatures + i);
+    }
+    
+    e->bss_segment = bc_alloc_bss(arena);
+    copy_memory(e->bss_segment, image + header->bss.offset, header->bss.count);
+    zero_memory(e->bss_segment + header->bss.count, BC_BSS_SIZE - header->bss.count);
+    
+    e->init_functions = sb_new(arena, i64, (u32)header->inits.count + 1);
+    i64 *inits = (i64 *)(image + header->inits.offset);
+    for (u64 i = 0; i < header->inits.count; i++) {
+      if (inits[i] < 0 || (u64)inits[i] >= header->functions.count) {
+        error = "the file is damaged";
+      }
+      sb_push(e->init_functions, inits[i]);
+    }
+    e->context = header->context;
+    
+    e->imports = sb_new(arena, Bc_Import, (u32)header->imports.count + 1);
+    Bc_Image_Import *imports = (Bc_Image_Import *)(image + header->imports.offset);
+    for (u64 i = 0; i < header->imports.count && !error; i++) {
+      Bc_Image_Import *src = imports + i;
+      if (!bc_image_string_fits(header->strings, strings, src->module, src->module_length) ||
+          !bc_image_string_fits(header->strings, strings, src->name, src->name_length) ||
+          src->offset < 0 || src->offset > BC_BSS_SIZE - 8) {
+        error = "the file is damaged";
+        break;
+      }
+      Bc_Import import;
+      import.module = make_string(strings + src->module, src->module_length);
+      import.name = make_string(strings + src->name, src->name_length);
+      import.offset = src->offset;
+      sb_push(e->imports, import);
+      
+      u64 proc = bc_foreign_address(import.module.data, import.name.data);
+      if (!proc) {
+        printf("%s: can't find foreign function %s in %s\n", path, import.name.data, import.module.data);
+        missing = true;
+      }
+      *(u64 *)(e->bss_segment + import.offset) = proc;
+    }
+    
+    // NOTE(lvl5): e->snapshot is only there to say the globals are set,
+    // the image can't be written again from it. the #foreign slots are
+    // filled in by now
+    Bc_Snapshot snapshot = {0};
+    snapshot.bss = e->bss_segment;
+    snapshot.bss_size = header->bss.count;
+    snapshot.heap = image + header->heap.offset;
+    snapshot.heap_size = header->heap.count;
+    snapshot.relocations = sb_new(arena, Bc_Relocation, (u32)header->relocations.count + 1);
+    copy_memory(snapshot.relocations, image + header->relocations.offset,
+                header->relocations.count*sizeof(Bc_Relocation));
+    sb_count(snapshot.relocations) = (u32)header->relocations.count;
+    for (u64 i = 0; i < header->relocations.count && !error; i++) {
+      Bc_Relocation *relocation = snapshot.relocations + i;
+      u64 segment_size = relocation->segment == Bc_Segment_HEAP ? snapshot.heap_size : BC_BSS_SIZE;
+      if ((relocation->segment != Bc_Segment_BSS && relocation->segment != Bc_Segment_HEAP) ||
+          segment_size < 8 || relocation->offset > segment_size - 8) {
+        error = "the file is damaged";
+        break;
+      }
+      
+      // NOTE(lvl5): what the word holds has to be in the segment it's
+      // relocated to, a #foreign function value is the offset of its slot
+      u64 word;
+      byte *data = relocation->segment == Bc_Segment_HEAP ? snapshot.heap : snapshot.bss;
+      copy_memory_small((byte *)&word, data + relocation->offset, 8);
+      b32 valid = false;
+      switch (relocation->to) {
+        case Bc_Segment_BSS: valid = word < BC_BSS_SIZE; break;
+        case Bc_Segment_HEAP: valid = word <= snapshot.heap_size; break;
+        case Bc_Segment_FOREIGN: {
+          for (u32 k = 0; k < sb_count(e->imports); k++) {
+            valid |= (u64)e->imports[k].offset == word;
+          }
+        } break;
+        case Bc_Segment_ALLOCATOR: valid = true; break;
+      }
+      if (!valid) {
+        error = "the file is damaged";
+        break;
+      }
+    }
+    if (!error) {
+      bc_snapshot_apply(e, &snapshot);
+    }
+    if (!error && header->snapshot) {
+      e->snapshot = arena_push_struct(arena, Bc_Snapshot);
+      *e->snapshot = snapshot;
+    }
+    
+    e->entry_function = header->entry_function;
+  }
+  
+  if (error) {
+    printf("%s: %s\n", path, error);
+  }
+  b32 result = !error && !missing;
+  return result;
+}
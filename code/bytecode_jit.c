@@ -0,0 +1,1134 @@
+// NOTE(lvl5): baseline template JIT. every bytecode instruction becomes a
+// fixed snippet of x86-64. the top of the exec stack lives in rax and the
+// rest of it on the native stack, r12 is the VM stack and r13 the BSS.
+// a compiled function is called as native(stack, bss) and behaves exactly
+// like the bytecode it came from.
+//
+// calls are resolved when compiling: CALL_DIRECT and TAIL_CALL name their
+// callee, a CALL only compiles when it's the usual `CONST_BSS slot, LOAD,
+// CONST signature, CALL` on a #foreign function's slot. a function is only
+// compiled when everything it can reach compiles too, so native code never
+// has to fall back to the interpreter. functions with instructions the JIT
+// doesn't know (floats, HLT, ...) just stay interpreted
+//
+// the code buffer and the emit helpers are also used for the foreign call
+// thunks, so they're there with BC_JIT off too.
+//
+// the buffer is never writable and executable at once. code is written in
+// batches, see bc_jit_begin, and a batch is mapped RX when it's done. the
+// emit helpers don't write past the end, they set overflow and the batch
+// is dropped, so a function that doesn't fit stays interpreted
+#if BC_SYSV
+#include <sys/mman.h>
+#include <unistd.h>
+
+typedef struct {
+  byte *code;
+  u64 size;
+  u64 capacity;
+  u64 start; // of the batch being written
+  b32 overflow;
+  u32 epoch;
+} Bc_Jit;
+
+Bc_Jit bc_jit;
+
+typedef enum {
+  JIT_RAX = 0,
+  JIT_RCX = 1,
+  JIT_RDX = 2,
+  JIT_RBX = 3,
+  JIT_RSP = 4,
+  JIT_RBP = 5,
+  JIT_RSI = 6,
+  JIT_RDI = 7,
+  JIT_R8 = 8,
+  JIT_R9 = 9,
+  JIT_R10 = 10,
+  JIT_R11 = 11,
+  JIT_R12 = 12,
+  JIT_R13 = 13,
+  JIT_R14 = 14,
+} Jit_Reg;
+
+#define JIT_VM_STACK JIT_R12
+#define JIT_VM_BSS JIT_R13
+
+void jit_u8(Bc_Jit *jit, u8 value) {
+  if (jit->size < jit->capacity) {
+    jit->code[jit->size++] = value;
+  } else {
+    jit->overflow = true;
+  }
+}
+
+void jit_bytes(Bc_Jit *jit, char *bytes, u32 count) {
+  for (u32 i = 0; i < count; i++) {
+    jit_u8(jit, (u8)bytes[i]);
+  }
+}
+#define JIT_BYTES(jit, str) jit_bytes(jit, str, sizeof(str) - 1)
+
+void jit_u32(Bc_Jit *jit, u32 value) {
+  if (jit->size + 4 <= jit->capacity) {
+    copy_memory_small(jit->code + jit->size, (byte *)&value, 4);
+    jit->size += 4;
+  } else {
+    jit->overflow = true;
+  }
+}
+
+void jit_u64(Bc_Jit *jit, u64 value) {
+  if (jit->size + 8 <= jit->capacity) {
+    copy_memory_small(jit->code + jit->size, (byte *)&value, 8);
+    jit->size += 8;
+  } else {
+    jit->overflow = true;
+  }
+}
+
+// NOTE(lvl5): [prefix] op reg, [base + disp32] with any operand size.
+// prefix is 0x66 for 16 bit or F3/F2 for the SSE ones, reg is an xmm
+// register number there
+void jit_op_mem_sized(Bc_Jit *jit, u8 prefix, b32 wide, u32 opcode, Jit_Reg reg, Jit_Reg base, i32 disp) {
+  if (prefix) jit_u8(jit, prefix);
+  u8 rex = (u8)(0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((base & 8) ? 1 : 0));
+  // NOTE(lvl5): without a REX byte stores from 4-7 mean ah..bh, not spl..dil
+  b32 byte_reg = opcode == 0x88 && reg >= JIT_RSP;
+  if (rex != 0x40 || byte_reg) jit_u8(jit, rex);
+  if (opcode > 0xFF) jit_u8(jit, (u8)(opcode >> 8));
+  jit_u8(jit, (u8)opcode);
+  jit_u8(jit, (u8)(0x80 | ((reg & 7) << 3) | (base & 7)));
+  if ((base & 7) == JIT_RSP) jit_u8(jit, 0x24);
+  jit_u32(jit, (u32)disp);
+}
+
+// NOTE(lvl5): op reg, [base + disp32], opcode can be two bytes (0x0FAF)
+void jit_op_mem(Bc_Jit *jit, u32 opcode, Jit_Reg reg, Jit_Reg base, i32 disp) {
+  jit_op_mem_sized(jit, 0, true, opcode, reg, base, disp);
+}
+
+// NOTE(lvl5): op rm, reg
+void jit_op_rr(Bc_Jit *jit, u32 opcode, Jit_Reg reg, Jit_Reg rm) {
+  jit_u8(jit, (u8)(0x48 | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0)));
+  if (opcode > 0xFF) jit_u8(jit, (u8)(opcode >> 8));
+  jit_u8(jit, (u8)opcode);
+  jit_u8(jit, (u8)(0xC0 | ((reg & 7) << 3) | (rm & 7)));
+}
+
+void jit_mov_imm(Bc_Jit *jit, Jit_Reg reg, u64 value) {
+  jit_u8(jit, (u8)(0x48 | ((reg & 8) ? 1 : 0)));
+  jit_u8(jit, (u8)(0xB8 + (reg & 7)));
+  jit_u64(jit, value);
+}
+
+// NOTE(lvl5): setcc al; movzx eax, al
+void jit_set_flag(Bc_Jit *jit, u8 cc) {
+  jit_u8(jit, 0x0F);
+  jit_u8(jit, (u8)(0x90 | cc));
+  jit_u8(jit, 0xC0);
+  JIT_BYTES(jit, "\x0F\xB6\xC0");
+}
+
+// NOTE(lvl5): condition codes, for jcc it's 0x0F 0x80|cc
+#define JIT_CC_B 0x2
+#define JIT_CC_AE 0x3
+#define JIT_CC_E 0x4
+#define JIT_CC_NE 0x5
+#define JIT_CC_BE 0x6
+#define JIT_CC_A 0x7
+#define JIT_CC_L 0xC
+#define JIT_CC_GE 0xD
+#define JIT_CC_LE 0xE
+#define JIT_CC_G 0xF
+
+u8 bc_jit_condition(Instruction_Kind kind) {
+  u8 result = 0;
+  switch (kind) {
+    case I_GT_int: case I_JGT_int: case I_JGT_int_IMM: result = JIT_CC_G; break;
+    case I_GTE_int: case I_JGE_int: case I_JGE_int_IMM: result = JIT_CC_GE; break;
+    case I_JLE_int: case I_JLE_int_IMM: result = JIT_CC_LE; break;
+    case I_JLT_int: case I_JLT_int_IMM: result = JIT_CC_L; break;
+    case I_GT_u: case I_JGT_u: result = JIT_CC_A; break;
+    case I_GTE_u: case I_JGE_u: result = JIT_CC_AE; break;
+    case I_JLE_u: result = JIT_CC_BE; break;
+    case I_JLT_u: result = JIT_CC_B; break;
+    case I_EQ: case I_JEQ: case I_JEQ_IMM: result = JIT_CC_E; break;
+    case I_NE: case I_JNE: case I_JNE_IMM: result = JIT_CC_NE; break;
+    default: assert(false);
+  }
+  return result;
+}
+
+// NOTE(lvl5): keeps the native stack aligned across a call, rbx is ours
+void jit_call(Bc_Jit *jit) {
+  JIT_BYTES(jit, "\x50"); // push rax
+  JIT_BYTES(jit, "\x48\x89\xE3"); // mov rbx, rsp
+  JIT_BYTES(jit, "\x48\x83\xE4\xF0"); // and rsp, -16
+  JIT_BYTES(jit, "\xFF\xD0"); // call rax
+  JIT_BYTES(jit, "\x48\x89\xDC"); // mov rsp, rbx
+  JIT_BYTES(jit, "\x58"); // pop rax
+}
+
+void bc_jit_init(Bc_Jit *jit, u64 capacity) {
+  if (!jit->code) {
+    jit->capacity = capacity;
+    jit->code = mmap(0, jit->capacity, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(jit->code != MAP_FAILED);
+  }
+}
+
+// NOTE(lvl5): a batch starts on a page of its own. the pages before it
+// are RX and another VM may be running them, the ones after it are still
+// RW. false if the buffer is full. call it with the code lock held
+b32 bc_jit_begin(Bc_Jit *jit) {
+  u64 page = (u64)sysconf(_SC_PAGESIZE);
+  jit->size = (jit->size + page - 1) & ~(page - 1);
+  if (jit->size > jit->capacity) jit->size = jit->capacity;
+  jit->start = jit->size;
+  jit->overflow = false;
+  b32 result = jit->size < jit->capacity;
+  return result;
+}
+
+// NOTE(lvl5): maps the batch RX, or drops it if it didn't fit. nothing
+// may point into a dropped batch
+b32 bc_jit_end(Bc_Jit *jit) {
+  b32 result = !jit->overflow;
+  if (!result) {
+    jit->size = jit->start;
+  } else if (jit->size > jit->start) {
+    i32 error = mprotect(jit->code + jit->start, jit->size - jit->start, PROT_READ | PROT_EXEC);
+    assert(!error);
+  }
+  return result;
+}
+#endif
+
+#if BC_JIT
+#define BC_JIT_CALL_THRESHOLD 8
+
+typedef void (*Bc_Jit_Func)(byte *stack, byte *bss);
+
+Bc_Foreign_Thunk bc_foreign_thunk(Bc_Foreign_Cache_Entry *cache, Bc_Foreign_Sig *sig);
+
+b32 bc_jit_is_supported(Instruction_Kind kind) {
+  b32 result = false;
+  switch (kind) {
+    case I_CONST:
+    case I_CONST_STACK:
+    case I_CONST_BSS:
+    case I_STACK_CHANGE:
+    case I_ADD_int:
+    case I_SUB_int:
+    case I_MUL_int:
+    case I_DIV_int:
+    case I_MOD:
+    case I_NEG_int:
+    case I_BIT_AND:
+    case I_BIT_OR:
+    case I_BIT_XOR:
+    case I_BIT_NOT:
+    case I_AND:
+    case I_OR:
+    case I_NOT:
+    case I_LOAD_64:
+    case I_LOAD_i8:
+    case I_LOAD_u8:
+    case I_LOAD_i16:
+    case I_LOAD_u16:
+    case I_LOAD_i32:
+    case I_LOAD_u32:
+    case I_LOAD_f32:
+    case I_STORE_8:
+    case I_STORE_16:
+    case I_STORE_32:
+    case I_STORE_64:
+    case I_GT_int:
+    case I_GTE_int:
+    case I_EQ:
+    case I_NE:
+    case I_JMP_TRUE:
+    case I_JMP_FALSE:
+    case I_JMP:
+    case I_MEMCOPY:
+    case I_MEMCOPY_N:
+    case I_MEMSET_N:
+    case I_CALL:
+    case I_CALL_DIRECT:
+    case I_TAIL_CALL:
+    case I_RET:
+    case I_MOV_RR:
+    case I_MOV_RI:
+    case I_ADD_int_RR:
+    case I_ADD_int_RI:
+    case I_SUB_int_RR:
+    case I_SUB_int_RI:
+    case I_MUL_int_RR:
+    case I_MUL_int_RI:
+    case I_LOAD_LOCAL:
+    case I_STORE_LOCAL_64:
+    case I_ADD_IMM:
+    case I_JLT_int:
+    case I_JLT_u:
+    case I_JLE_int:
+    case I_JLE_u:
+    case I_JGT_int:
+    case I_JGT_u:
+    case I_JGE_int:
+    case I_JGE_u:
+    case I_JLT_int_IMM:
+    case I_JLE_int_IMM:
+    case I_JGT_int_IMM:
+    case I_JGE_int_IMM:
+    case I_JEQ_IMM:
+    case I_JNE_IMM:
+    case I_JEQ:
+    case I_JNE:
+    case I_GT_u:
+    case I_GTE_u:
+    case I_LOOP:
+    result = true;
+    break;
+  }
+  return result;
+}
+
+// NOTE(lvl5): how an instruction changes the depth of the exec stack,
+// the same whether a conditional jump is taken or not
+i32 bc_stack_delta(Instruction_Kind kind) {
+  i32 result = 0;
+  switch (kind) {
+    case I_CONST:
+    case I_CONST_STACK:
+    case I_CONST_BSS:
+    case I_LOAD_LOCAL:
+    result = 1;
+    break;
+    
+    case I_ADD_int: case I_ADD_f32: case I_ADD_f64:
+    case I_SUB_int: case I_SUB_f32: case I_SUB_f64:
+    case I_MUL_int: case I_MUL_f32: case I_MUL_f64:
+    case I_DIV_int: case I_DIV_f32: case I_DIV_f64:
+    case I_MOD:
+    case I_BIT_AND:
+    case I_BIT_OR:
+    case I_BIT_XOR:
+    case I_AND:
+    case I_OR:
+    case I_GT_int: case I_GT_f32: case I_GT_f64:
+    case I_GTE_int: case I_GTE_f32: case I_GTE_f64:
+    case I_EQ:
+    case I_NE:
+    case I_GT_u:
+    case I_GTE_u:
+    case I_JMP_TRUE:
+    case I_JMP_FALSE:
+    case I_STORE_LOCAL_64:
+    case I_JLT_int_IMM:
+    case I_JLE_int_IMM:
+    case I_JGT_int_IMM:
+    case I_JGE_int_IMM:
+    case I_JEQ_IMM:
+    case I_JNE_IMM:
+    result = -1;
+    break;
+    
+    case I_STORE_8:
+    case I_STORE_16:
+    case I_STORE_32:
+    case I_STORE_64:
+    case I_MEMCOPY:
+    case I_CALL:
+    case I_JLT_int:
+    case I_JLT_u:
+    case I_JLE_int:
+    case I_JLE_u:
+    case I_JGT_int:
+    case I_JGT_u:
+    case I_JGE_int:
+    case I_JGE_u:
+    case I_JLT_f32:
+    case I_JLT_f64:
+    case I_JLE_f32:
+    case I_JLE_f64:
+    case I_JGT_f32:
+    case I_JGT_f64:
+    case I_JGE_f32:
+    case I_JGE_f64:
+    case I_JEQ:
+    case I_JNE:
+    result = -2;
+    break;
+    
+    case I_MEMCOPY_N:
+    case I_MEMSET_N:
+    result = -3;
+    break;
+  }
+  return result;
+}
+
+// NOTE(lvl5): the BSS slot the callee of the CALL at index i comes from,
+// -1 if it isn't the usual sequence
+i64 bc_jit_call_slot(Bc_Function *func, i64 i) {
+  i64 result = -1;
+  Bc_Instruction *code = func->instructions;
+  if (i >= 3 &&
+      code[i - 1].kind == I_CONST &&
+      code[i - 2].kind == I_LOAD_64 &&
+      code[i - 3].kind == I_CONST_BSS) {
+    result = code[i - 3].param._i64;
+  }
+  return result;
+}
+
+// NOTE(lvl5): the bytecode function the call at index i goes to, -1 for
+// a foreign call and -2 if it can't be told before running. only a
+// #foreign function's slot keeps what it holds now, any other slot can be
+// assigned while the code runs, so a CALL through it isn't compiled
+i64 bc_jit_callee(Bc_Emitter *e, Bc_Function *func, i64 i) {
+  i64 result = -2;
+  Bc_Instruction *instr = func->instructions + i;
+  if (instr->kind == I_CALL_DIRECT) {
+    result = instr->param._call.function;
+  } else if (instr->kind == I_TAIL_CALL) {
+    result = instr->param._i64;
+  } else {
+    i64 slot = bc_jit_call_slot(func, i);
+    for (u32 j = 0; j < sb_count(e->imports) && slot >= 0; j++) {
+      if (e->imports[j].offset == slot) {
+        result = -1;
+        break;
+      }
+    }
+  }
+  return result;
+}
+
+// NOTE(lvl5): collects func and every function it can call into
+// functions, false if any of them can't be compiled
+b32 bc_jit_collect(Bc_Emitter *e, Bc_Function *func, Bc_Function ***functions) {
+  if (func->jit_epoch == bc_jit.epoch) return true;
+  func->jit_epoch = bc_jit.epoch;
+  if (func->jit_failed) return false;
+  
+  bc_emit_function(e, func);
+  if (!func->native) {
+    sb_push(*functions, func);
+  }
+  
+  b32 result = true;
+  for (i64 i = 0; i < func->instruction_count && result; i++) {
+    Bc_Instruction *instr = func->instructions + i;
+    if (!bc_jit_is_supported(instr->kind)) {
+      result = false;
+    } else if (instr->kind == I_CALL || instr->kind == I_CALL_DIRECT ||
+               instr->kind == I_TAIL_CALL) {
+      i64 callee = bc_jit_callee(e, func, i);
+      if (callee == -2) {
+        result = false;
+      } else if (callee >= 0) {
+        assert(callee < sb_count(e->functions));
+        result = bc_jit_collect(e, e->functions[callee], functions);
+      }
+    }
+  }
+  return result;
+}
+
+// NOTE(lvl5): rel32 fields to patch once every offset is known
+typedef struct {
+  i64 *at;
+  i64 *target;
+  i64 count;
+} Bc_Jit_Fixups;
+
+#define JIT_JUMP_TO(dst) { \
+  fixups->at[fixups->count] = jit->size; \
+  fixups->target[fixups->count++] = (dst); \
+  jit_u32(jit, 0); \
+}
+
+// NOTE(lvl5): a CONST the next instruction can take as an immediate, and a
+// store to a local slot that is loaded right back, are done as one.
+// next is 0 when it's a jump target
+b32 bc_jit_fused(Bc_Jit *jit, Bc_Instruction instr, Bc_Instruction *next,
+                 i64 i, Bc_Jit_Fixups *fixups) {
+  b32 result = false;
+  i64 value = instr.param._i64;
+  if (!next) {
+    
+  } else if (instr.kind == I_CONST && value >= I32_MIN && value <= I32_MAX) {
+    result = true;
+    switch (next->kind) {
+      case I_ADD_int:
+      case I_SUB_int:
+      case I_BIT_AND:
+      case I_BIT_OR:
+      case I_BIT_XOR: {
+        u8 opcode = next->kind == I_ADD_int ? 0x05 : next->kind == I_SUB_int ? 0x2D :
+          next->kind == I_BIT_AND ? 0x25 : next->kind == I_BIT_OR ? 0x0D : 0x35;
+        jit_u8(jit, 0x48);
+        jit_u8(jit, opcode); // op rax, imm32
+        jit_u32(jit, (u32)value);
+      } break;
+      case I_MUL_int: {
+        JIT_BYTES(jit, "\x48\x69\xC0"); // imul rax, rax, imm32
+        jit_u32(jit, (u32)value);
+      } break;
+      case I_GT_int:
+      case I_GTE_int:
+      case I_EQ:
+      case I_NE: {
+        JIT_BYTES(jit, "\x48\x3D"); // cmp rax, imm32
+        jit_u32(jit, (u32)value);
+        jit_set_flag(jit, bc_jit_condition(next->kind));
+      } break;
+      case I_JLT_int:
+      case I_JLT_u:
+      case I_JLE_int:
+      case I_JLE_u:
+      case I_JGT_int:
+      case I_JGT_u:
+      case I_JGE_int:
+      case I_JGE_u:
+      case I_JEQ:
+      case I_JNE: {
+        JIT_BYTES(jit, "\x48\x3D");
+        jit_u32(jit, (u32)value);
+        JIT_BYTES(jit, "\x58"); // pop rax, leaves the flags alone
+        jit_u8(jit, 0x0F);
+        jit_u8(jit, (u8)(0x80 | bc_jit_condition(next->kind)));
+        JIT_JUMP_TO(i + 1 + next->param._i64);
+      } break;
+      default: result = false;
+    }
+  } else if (instr.kind == I_STORE_LOCAL_64 && next->kind == I_LOAD_LOCAL &&
+             next->param._i64 == value) {
+    jit_op_mem(jit, 0x89, JIT_RAX, JIT_VM_STACK, (i32)value);
+    result = true;
+  } else if (instr.kind == I_LOAD_LOCAL && next->kind == I_STORE_LOCAL_64 &&
+             next->param._i64 == value) {
+    result = true;
+  }
+  return result;
+}
+
+// NOTE(lvl5): calls callee's native code with its frame at frame bytes
+// into ours. it goes through the callee's native slot, the callee may
+// not be compiled yet when it's part of the same batch
+void bc_jit_call_native(Bc_Jit *jit, Bc_Function *callee, i32 frame) {
+  jit_op_mem(jit, 0x8D, JIT_RDI, JIT_VM_STACK, frame); // lea rdi, [r12 + frame]
+  JIT_BYTES(jit, "\x4C\x89\xEE"); // mov rsi, r13
+  JIT_BYTES(jit, "\x50");
+  jit_mov_imm(jit, JIT_RAX, (u64)&callee->native);
+  JIT_BYTES(jit, "\x48\x8B\x00"); // mov rax, [rax]
+  jit_call(jit);
+  JIT_BYTES(jit, "\x58");
+}
+
+// NOTE(lvl5): emits instruction i of func, returns how many instructions
+// that used up
+i64 bc_jit_instruction(Bc_Jit *jit, Bc_Emitter *e, Bc_Function *func, i64 i,
+                       b32 *is_target, Bc_Jit_Fixups *fixups) {
+  Bc_Instruction instr = func->instructions[i];
+  i64 value = instr.param._i64;
+  Bc_Regs r = instr.param._regs;
+  
+  Bc_Instruction *next = 0;
+  if (i + 1 < func->instruction_count && !is_target[i + 1]) {
+    next = func->instructions + i + 1;
+  }
+  if (bc_jit_fused(jit, instr, next, i, fixups)) {
+    return 2;
+  }
+  
+  
+  switch (instr.kind) {
+    case I_CONST: {
+      JIT_BYTES(jit, "\x50"); // push rax
+      jit_mov_imm(jit, JIT_RAX, instr.param._u64);
+    } break;
+    case I_CONST_STACK: {
+      JIT_BYTES(jit, "\x50");
+      jit_op_mem(jit, 0x8D, JIT_RAX, JIT_VM_STACK, (i32)value); // lea
+    } break;
+    case I_CONST_BSS: {
+      JIT_BYTES(jit, "\x50");
+      jit_op_mem(jit, 0x8D, JIT_RAX, JIT_VM_BSS, (i32)value);
+    } break;
+    case I_STACK_CHANGE: {
+      JIT_BYTES(jit, "\x49\x81\xC4"); // add r12, imm32
+      jit_u32(jit, (u32)value);
+    } break;
+    
+    case I_ADD_int:
+    case I_BIT_AND:
+    case I_BIT_OR:
+    case I_BIT_XOR: {
+      u32 opcode = instr.kind == I_ADD_int ? 0x01 :
+        instr.kind == I_BIT_AND ? 0x21 : instr.kind == I_BIT_OR ? 0x09 : 0x31;
+      JIT_BYTES(jit, "\x59"); // pop rcx
+      jit_op_rr(jit, opcode, JIT_RCX, JIT_RAX);
+    } break;
+    case I_SUB_int: {
+      JIT_BYTES(jit, "\x59");
+      jit_op_rr(jit, 0x29, JIT_RAX, JIT_RCX); // sub rcx, rax
+      jit_op_rr(jit, 0x89, JIT_RCX, JIT_RAX); // mov rax, rcx
+    } break;
+    case I_MUL_int: {
+      JIT_BYTES(jit, "\x59");
+      jit_op_rr(jit, 0x0FAF, JIT_RAX, JIT_RCX); // imul rax, rcx
+    } break;
+    case I_DIV_int:
+    case I_MOD: {
+      JIT_BYTES(jit, "\x49\x89\xC0"); // mov r8, rax
+      JIT_BYTES(jit, "\x58"); // pop rax
+      JIT_BYTES(jit, "\x48\x99"); // cqo
+      JIT_BYTES(jit, "\x49\xF7\xF8"); // idiv r8
+      if (instr.kind == I_MOD) {
+        jit_op_rr(jit, 0x89, JIT_RDX, JIT_RAX);
+      }
+    } break;
+    case I_NEG_int: {
+      JIT_BYTES(jit, "\x48\xF7\xD8");
+    } break;
+    case I_BIT_NOT: {
+      JIT_BYTES(jit, "\x48\xF7\xD0");
+    } break;
+    case I_AND:
+    case I_OR: {
+      JIT_BYTES(jit, "\x59");
+      jit_op_rr(jit, instr.kind == I_AND ? 0x21 : 0x09, JIT_RCX, JIT_RAX);
+      if (instr.kind == I_AND) {
+        // NOTE(lvl5): and of the two values isn't logical and, so
+        // normalize both to 0/1 first
+        jit_op_rr(jit, 0x85, JIT_RCX, JIT_RCX);
+        JIT_BYTES(jit, "\x0F\x95\xC1"); // setne cl
+        jit_op_rr(jit, 0x85, JIT_RAX, JIT_RAX);
+        JIT_BYTES(jit, "\x0F\x95\xC0"); // setne al
+        JIT_BYTES(jit, "\x20\xC8"); // and al, cl
+        JIT_BYTES(jit, "\x0F\xB6\xC0");
+      } else {
+        jit_op_rr(jit, 0x85, JIT_RAX, JIT_RAX);
+        jit_set_flag(jit, JIT_CC_NE);
+      }
+    } break;
+    case I_NOT: {
+      jit_op_rr(jit, 0x85, JIT_RAX, JIT_RAX);
+      jit_set_flag(jit, JIT_CC_E);
+    } break;
+    
+    case I_LOAD_64: {
+      JIT_BYTES(jit, "\x48\x8B\x00"); // mov rax, [rax]
+    } break;
+    case I_LOAD_i8: {
+      JIT_BYTES(jit, "\x48\x0F\xBE\x00"); // movsx rax, byte [rax]
+    } break;
+    case I_LOAD_u8: {
+      JIT_BYTES(jit, "\x0F\xB6\x00"); // movzx eax, byte [rax]
+    } break;
+    case I_LOAD_i16: {
+      JIT_BYTES(jit, "\x48\x0F\xBF\x00"); // movsx rax, word [rax]
+    } break;
+    case I_LOAD_u16: {
+      JIT_BYTES(jit, "\x0F\xB7\x00"); // movzx eax, word [rax]
+    } break;
+    case I_LOAD_i32: {
+      JIT_BYTES(jit, "\x48\x63\x00"); // movsxd rax, dword [rax]
+    } break;
+    case I_LOAD_u32:
+    case I_LOAD_f32: {
+      JIT_BYTES(jit, "\x8B\x00"); // mov eax, [rax]
+    } break;
+    case I_STORE_8:
+    case I_STORE_16:
+    case I_STORE_32:
+    case I_STORE_64: {
+      JIT_BYTES(jit, "\x59"); // pop rcx (value)
+      if (instr.kind == I_STORE_8) JIT_BYTES(jit, "\x88\x08");
+      if (instr.kind == I_STORE_16) JIT_BYTES(jit, "\x66\x89\x08");
+      if (instr.kind == I_STORE_32) JIT_BYTES(jit, "\x89\x08");
+      if (instr.kind == I_STORE_64) JIT_BYTES(jit, "\x48\x89\x08");
+      JIT_BYTES(jit, "\x58");
+    } break;
+    
+    case I_GT_int:
+    case I_GTE_int:
+    case I_GT_u:
+    case I_GTE_u:
+    case I_EQ:
+    case I_NE: {
+      u8 cc = bc_jit_condition(instr.kind);
+      JIT_BYTES(jit, "\x59");
+      jit_op_rr(jit, 0x39, JIT_RAX, JIT_RCX); // cmp rcx, rax
+      jit_set_flag(jit, cc);
+    } break;
+    
+    case I_JMP_TRUE:
+    case I_JMP_FALSE: {
+      jit_op_rr(jit, 0x89, JIT_RAX, JIT_RCX); // mov rcx, rax
+      JIT_BYTES(jit, "\x58");
+      jit_op_rr(jit, 0x85, JIT_RCX, JIT_RCX);
+      jit_u8(jit, 0x0F);
+      jit_u8(jit, (u8)(0x80 | (instr.kind == I_JMP_TRUE ? JIT_CC_NE : JIT_CC_E)));
+      JIT_JUMP_TO(i + value);
+    } break;
+    case I_JMP: {
+      jit_u8(jit, 0xE9);
+      JIT_JUMP_TO(i + value);
+    } break;
+    case I_JLT_int:
+    case I_JLT_u:
+    case I_JLE_int:
+    case I_JLE_u:
+    case I_JGT_int:
+    case I_JGT_u:
+    case I_JGE_int:
+    case I_JGE_u:
+    case I_JEQ:
+    case I_JNE: {
+      u8 cc = bc_jit_condition(instr.kind);
+      jit_op_rr(jit, 0x89, JIT_RAX, JIT_RDX); // mov rdx, rax
+      JIT_BYTES(jit, "\x59\x58"); // pop rcx, pop rax
+      jit_op_rr(jit, 0x39, JIT_RDX, JIT_RCX); // cmp rcx, rdx
+      jit_u8(jit, 0x0F);
+      jit_u8(jit, (u8)(0x80 | cc));
+      JIT_JUMP_TO(i + value);
+    } break;
+    
+    case I_MEMCOPY: {
+      if (value <= 64 && value % 8 == 0) {
+        // NOTE(lvl5): struct sized copies are done inline, 16 bytes at a
+        // time through xmm0 and an 8 byte tail through rdx
+        JIT_BYTES(jit, "\x59"); // pop rcx (from)
+        i32 offset = 0;
+        for (; offset + 16 <= value; offset += 16) {
+          jit_op_mem_sized(jit, 0, false, 0x0F10, JIT_RAX, JIT_RCX, offset); // movups xmm0, [rcx + offset]
+          jit_op_mem_sized(jit, 0, false, 0x0F11, JIT_RAX, JIT_RAX, offset); // movups [rax + offset], xmm0
+        }
+        if (offset < value) {
+          jit_op_mem(jit, 0x8B, JIT_RDX, JIT_RCX, offset);
+          jit_op_mem(jit, 0x89, JIT_RDX, JIT_RAX, offset);
+        }
+        JIT_BYTES(jit, "\x58");
+      } else {
+        // rdi = to, rsi = from, rdx = size
+        jit_op_rr(jit, 0x89, JIT_RAX, JIT_RDI);
+        JIT_BYTES(jit, "\x5E\x58"); // pop rsi, pop rax
+        jit_mov_imm(jit, JIT_RDX, instr.param._u64);
+        JIT_BYTES(jit, "\x50");
+        jit_mov_imm(jit, JIT_RAX, (u64)copy_memory);
+        jit_call(jit);
+        JIT_BYTES(jit, "\x58");
+      }
+    } break;
+    case I_MEMCOPY_N:
+    case I_MEMSET_N: {
+      // rdi = to, rsi = from or the value, rdx = size
+      jit_op_rr(jit, 0x89, JIT_RAX, JIT_RDX);
+      JIT_BYTES(jit, "\x5F\x5E\x58"); // pop rdi, pop rsi, pop rax
+      JIT_BYTES(jit, "\x50");
+      jit_mov_imm(jit, JIT_RAX, instr.kind == I_MEMCOPY_N ? (u64)bc_copy_bytes : (u64)set_memory);
+      jit_call(jit);
+      JIT_BYTES(jit, "\x58");
+    } break;
+    
+    case I_CALL: {
+      i64 callee = bc_jit_callee(e, func, i);
+      JIT_BYTES(jit, "\x5F\x58"); // drop the signature, pop rdi (address), pop rax
+      if (callee < 0) {
+        // NOTE(lvl5): the signature is a constant, so the thunk is picked now
+        Bc_Foreign_Sig *sig = e->signatures[func->instructions[i - 1].param._i64];
+        Bc_Foreign_Thunk thunk = bc_foreign_thunk(0, sig);
+        JIT_BYTES(jit, "\x48\x0F\xBA\xF7\x3F"); // btr rdi, 63
+        jit_op_mem(jit, 0x8D, JIT_RSI, JIT_VM_STACK, (i32)value); // lea rsi, callee frame
+        jit_op_mem(jit, 0x8D, JIT_RDX, JIT_VM_BSS, -8); // lea rdx, callback slot
+        JIT_BYTES(jit, "\x50");
+        jit_mov_imm(jit, JIT_RAX, (u64)thunk);
+        jit_call(jit);
+        JIT_BYTES(jit, "\x58");
+      } else {
+        bc_jit_call_native(jit, e->functions[callee], (i32)value);
+      }
+    } break;
+    case I_CALL_DIRECT: {
+      bc_jit_call_native(jit, e->functions[instr.param._call.function], instr.param._call.frame);
+    } break;
+    case I_TAIL_CALL: {
+      // NOTE(lvl5): our frame and BSS are the callee's arguments, then
+      // it is entered with our return address still on top
+      Bc_Function *callee = e->functions[value];
+      JIT_BYTES(jit, "\x4C\x89\xE7"); // mov rdi, r12
+      JIT_BYTES(jit, "\x4C\x89\xEE"); // mov rsi, r13
+      JIT_BYTES(jit, "\x48\x8D\x65\xE0"); // lea rsp, [rbp - 32]
+      JIT_BYTES(jit, "\x41\x5E\x41\x5D\x41\x5C\x5B\x5D"); // pop r14, r13, r12, rbx, rbp
+      jit_mov_imm(jit, JIT_RAX, (u64)&callee->native);
+      JIT_BYTES(jit, "\x48\x8B\x00"); // mov rax, [rax]
+      JIT_BYTES(jit, "\xFF\xE0"); // jmp rax
+    } break;
+    case I_RET: {
+      JIT_BYTES(jit, "\x48\x8D\x65\xE0"); // lea rsp, [rbp - 32]
+      JIT_BYTES(jit, "\x41\x5E\x41\x5D\x41\x5C\x5B\x5D"); // pop r14, r13, r12, rbx, rbp
+      JIT_BYTES(jit, "\xC3");
+    } break;
+    
+    case I_MOV_RR: {
+      jit_op_mem(jit, 0x8B, JIT_RCX, JIT_VM_STACK, r.a);
+      jit_op_mem(jit, 0x89, JIT_RCX, JIT_VM_STACK, r.dst);
+    } break;
+    case I_MOV_RI: {
+      jit_op_mem(jit, 0xC7, JIT_RAX, JIT_VM_STACK, r.dst); // mov qword [r12 + dst], imm32
+      jit_u32(jit, (u32)r.imm);
+    } break;
+    case I_ADD_int_RR:
+    case I_SUB_int_RR:
+    case I_MUL_int_RR: {
+      u32 opcode = instr.kind == I_ADD_int_RR ? 0x03 :
+        instr.kind == I_SUB_int_RR ? 0x2B : 0x0FAF;
+      jit_op_mem(jit, 0x8B, JIT_RCX, JIT_VM_STACK, r.a);
+      jit_op_mem(jit, opcode, JIT_RCX, JIT_VM_STACK, (i32)r.b);
+      jit_op_mem(jit, 0x89, JIT_RCX, JIT_VM_STACK, r.dst);
+    } break;
+    case I_ADD_int_RI:
+    case I_SUB_int_RI:
+    case I_MUL_int_RI: {
+      jit_op_mem(jit, 0x8B, JIT_RCX, JIT_VM_STACK, r.a);
+      if (instr.kind == I_MUL_int_RI) {
+        JIT_BYTES(jit, "\x48\x69\xC9"); // imul rcx, rcx, imm32
+      } else {
+        JIT_BYTES(jit, "\x48\x81");
+        jit_u8(jit, instr.kind == I_ADD_int_RI ? 0xC1 : 0xE9); // add/sub rcx, imm32
+      }
+      jit_u32(jit, (u32)r.imm);
+      jit_op_mem(jit, 0x89, JIT_RCX, JIT_VM_STACK, r.dst);
+    } break;
+    
+    case I_LOAD_LOCAL: {
+      JIT_BYTES(jit, "\x50");
+      jit_op_mem(jit, 0x8B, JIT_RAX, JIT_VM_STACK, (i32)value);
+    } break;
+    case I_STORE_LOCAL_64: {
+      jit_op_mem(jit, 0x89, JIT_RAX, JIT_VM_STACK, (i32)value);
+      JIT_BYTES(jit, "\x58");
+    } break;
+    
+    case I_JLT_int_IMM:
+    case I_JLE_int_IMM:
+    case I_JGT_int_IMM:
+    case I_JGE_int_IMM:
+    case I_JEQ_IMM:
+    case I_JNE_IMM: {
+      JIT_BYTES(jit, "\x48\x3D"); // cmp rax, imm32
+      jit_u32(jit, (u32)instr.param._branch.imm);
+      JIT_BYTES(jit, "\x58");
+      jit_u8(jit, 0x0F);
+      jit_u8(jit, (u8)(0x80 | bc_jit_condition(instr.kind)));
+      JIT_JUMP_TO(i + instr.param._branch.offset);
+    } break;
+    
+    case I_LOOP: break;
+    case I_ADD_IMM: {
+      JIT_BYTES(jit, "\x48\x05"); // add rax, imm32
+      jit_u32(jit, (u32)value);
+    } break;
+    
+    default: assert(false);
+  }
+  return 1;
+}
+
+b32 *bc_jit_jump_targets(Arena *scratch, Bc_Function *func) {
+  b32 *result = arena_push_array(scratch, b32, func->instruction_count + 1);
+  zero_memory(result, sizeof(b32)*(func->instruction_count + 1));
+  for (i64 i = 0; i < func->instruction_count; i++) {
+    Bc_Instruction *instr = func->instructions + i;
+    if (bc_is_jump(instr->kind)) {
+      result[i + bc_jump_offset(instr)] = true;
+    }
+  }
+  return result;
+}
+
+void bc_jit_prologue(Bc_Jit *jit) {
+  JIT_BYTES(jit, "\x55"); // push rbp
+  JIT_BYTES(jit, "\x48\x89\xE5"); // mov rbp, rsp
+  JIT_BYTES(jit, "\x53\x41\x54\x41\x55\x41\x56"); // push rbx, r12, r13, r14
+  JIT_BYTES(jit, "\x49\x89\xFC"); // mov r12, rdi
+  JIT_BYTES(jit, "\x49\x89\xF5"); // mov r13, rsi
+  JIT_BYTES(jit, "\x49\x89\xD6"); // mov r14, rdx
+}
+
+void bc_jit_epilogue(Bc_Jit *jit) {
+  JIT_BYTES(jit, "\x48\x8D\x65\xE0"); // lea rsp, [rbp - 32]
+  JIT_BYTES(jit, "\x41\x5E\x41\x5D\x41\x5C\x5B\x5D"); // pop r14, r13, r12, rbx, rbp
+  JIT_BYTES(jit, "\xC3");
+}
+
+// NOTE(lvl5): the entry point, it isn't published. the code can be cut
+// short when the batch overflows, see bc_jit_compile_batch
+byte *bc_jit_compile(Arena *scratch, Bc_Emitter *e, Bc_Function *func) {
+  Bc_Jit *jit = &bc_jit;
+  i64 count = func->instruction_count;
+  
+  u64 mark = arena_get_mark(scratch);
+  i64 *offsets = arena_push_array(scratch, i64, count + 1);
+  b32 *is_target = bc_jit_jump_targets(scratch, func);
+  Bc_Jit_Fixups fixups = {0};
+  fixups.at = arena_push_array(scratch, i64, count);
+  fixups.target = arena_push_array(scratch, i64, count);
+  
+  byte *entry = jit->code + jit->size;
+  bc_jit_prologue(jit);
+  
+  for (i64 i = 0; i < count;) {
+    offsets[i] = jit->size;
+    i += bc_jit_instruction(jit, e, func, i, is_target, &fixups);
+  }
+  offsets[count] = jit->size;
+  
+  for (i64 i = 0; i < fixups.count && !jit->overflow; i++) {
+    i32 rel = (i32)(offsets[fixups.target[i]] - (fixups.at[i] + 4));
+    copy_memory_small(jit->code + fixups.at[i], (byte *)&rel, 4);
+  }
+  
+  arena_set_mark(scratch, mark);
+  return entry;
+}
+
+// NOTE(lvl5): compiles what bc_jit_collect found as one batch, false if
+// it didn't fit. the functions are published last to first once all of
+// them are RX, so the interpreter only sees one once everything it calls
+// is there
+b32 bc_jit_compile_batch(Arena *scratch, Bc_Emitter *e, Bc_Function **functions) {
+  Bc_Jit *jit = &bc_jit;
+  u32 count = sb_count(functions);
+  byte **entries = arena_push_array(scratch, byte *, count + 1);
+  b32 result = bc_jit_begin(jit);
+  for (u32 i = 0; i < count && result; i++) {
+    entries[i] = bc_jit_compile(scratch, e, functions[i]);
+  }
+  result = result && bc_jit_end(jit);
+  for (i32 i = (i32)count - 1; i >= 0 && result; i--) {
+    bc_atomic_store_ptr(&functions[i]->native, entries[i]);
+  }
+  return result;
+}
+
+// NOTE(lvl5): called by the interpreter on every call, true if the callee
+// has native code to run instead. compiling uses the calling VM's scratch.
+// #run stays in the interpreter, that's where foreign calls are refused
+b32 bc_jit_tier_up(Bc_Vm *vm, Bc_Function *func) {
+  if (vm->compile_time) return false;
+  if (bc_atomic_load_ptr(&func->native)) return true;
+  if (bc_atomic_load_i32(&func->jit_failed) ||
+      bc_atomic_increment(&func->call_count) < BC_JIT_CALL_THRESHOLD) return false;
+  
+  // NOTE(lvl5): another VM may have got here first
+  bc_code_lock();
+  if (!func->native && !func->jit_failed) {
+    Bc_Emitter *e = vm->emitter;
+    Bc_Jit *jit = &bc_jit;
+    bc_jit_init(jit, megabytes(16));
+    
+    u64 mark = arena_get_mark(&vm->scratch);
+    Bc_Function **functions = sb_new(&vm->scratch, Bc_Function *, 16);
+    jit->epoch++;
+    if (!bc_jit_collect(e, func, &functions) ||
+        !bc_jit_compile_batch(&vm->scratch, e, functions)) {
+      bc_atomic_store_i32(&func->jit_failed, true);
+    }
+    arena_set_mark(&vm->scratch, mark);
+  }
+  bc_code_unlock();
+  return bc_atomic_load_ptr(&func->native) != 0;
+}
+
+// NOTE(lvl5): loops. a hot while loop is compiled from its LOOP instruction
+// to the jump back to it. the bytecode is typed, so the only guards are the
+// branches: any jump out of the loop, a RET or TAIL_CALL, a call that can't
+// be compiled or an instruction the JIT doesn't know is a side exit. it
+// stores the exec stack back into the interpreter's and returns which exit
+// it took
+#define BC_JIT_LOOP_THRESHOLD 64
+
+typedef struct {
+  byte *stack;
+  Bc_Param *exec; // where the values live on the exec stack go
+  i64 exec_count;
+} Bc_Jit_Exit;
+
+typedef i64 (*Bc_Jit_Trace)(byte *stack, byte *bss, Bc_Jit_Exit *exit);
+
+void bc_jit_exit(Bc_Jit *jit, Bc_Loop *loop, i64 index, i32 depth) {
+  i64 exit_index = sb_count(loop->exits);
+  sb_push(loop->exits, index);
+  
+  // NOTE(lvl5): the bottom slot of the native stack is whatever rax held
+  // on entry, the values are above it with the top in rax
+  if (depth > 0) {
+    jit_op_mem(jit, 0x8B, JIT_RCX, JIT_R14, 8); // mov rcx, exit->exec
+    for (i32 i = 0; i < depth - 1; i++) {
+      jit_op_mem(jit, 0x8B, JIT_RDX, JIT_RSP, 8*i);
+      jit_op_mem(jit, 0x89, JIT_RDX, JIT_RCX, 8*(depth - 2 - i));
+    }
+    jit_op_mem(jit, 0x89, JIT_RAX, JIT_RCX, 8*(depth - 1));
+  }
+  jit_op_mem(jit, 0xC7, JIT_RAX, JIT_R14, 16); // mov exit->exec_count, imm32
+  jit_u32(jit, (u32)depth);
+  jit_op_mem(jit, 0x89, JIT_R12, JIT_R14, 0); // mov exit->stack, r12
+  jit_u8(jit, 0xB8); // mov eax, imm32
+  jit_u32(jit, (u32)exit_index);
+  bc_jit_epilogue(jit);
+}
+
+// NOTE(lvl5): compiles whatever a call in the loop can reach, false if
+// the call has to be left to the interpreter
+b32 bc_jit_loop_call(Arena *scratch, Bc_Emitter *e, Bc_Function *func, i64 i) {
+  i64 index = bc_jit_callee(e, func, i);
+  if (index == -2) return false;
+  if (index == -1) return true;
+  
+  Bc_Function *callee = e->functions[index];
+  if (callee->native) return true;
+  
+  Bc_Jit *jit = &bc_jit;
+  Bc_Function **functions = sb_new(scratch, Bc_Function *, 16);
+  jit->epoch++;
+  b32 result = bc_jit_collect(e, callee, &functions) &&
+    bc_jit_compile_batch(scratch, e, functions);
+  if (!result) {
+    bc_atomic_store_i32(&callee->jit_failed, true);
+  }
+  return result;
+}
+
+b32 bc_jit_compile_loop(Arena *scratch, Bc_Emitter *e, i64 loop_index) {
+  Bc_Jit *jit = &bc_jit;
+  Bc_Function *func = e->functions[e->loops[loop_index].function];
+  
+  i64 head = -1;
+  i64 tail = -1;
+  for (i64 i = 0; i < func->instruction_count; i++) {
+    Bc_Instruction *instr = func->instructions + i;
+    if (instr->kind == I_LOOP && instr->param._i64 == loop_index) {
+      head = i;
+    } else if (head >= 0 && instr->kind == I_JMP && i + instr->param._i64 == head) {
+      tail = i;
+    }
+  }
+  if (tail < 0) return false;
+  
+  i64 count = tail - head + 1;
+  
+  u64 mark = arena_get_mark(scratch);
+  b32 *native_call = arena_push_array(scratch, b32, count);
+  for (i64 i = head; i <= tail; i++) {
+    Instruction_Kind kind = func->instructions[i].kind;
+    native_call[i - head] = (kind == I_CALL || kind == I_CALL_DIRECT) &&
+      bc_jit_loop_call(scratch, e, func, i);
+  }
+  // NOTE(lvl5): compiling callees can emit functions that add loops
+  Bc_Loop *loop = e->loops + loop_index;
+  
+  i64 *offsets = arena_push_array(scratch, i64, count);
+  i32 *depths = arena_push_array(scratch, i32, count);
+  for (i64 i = 0; i < count; i++) depths[i] = -1;
+  b32 *is_target = bc_jit_jump_targets(scratch, func);
+  Bc_Jit_Fixups fixups = {0};
+  fixups.at = arena_push_array(scratch, i64, count);
+  fixups.target = arena_push_array(scratch, i64, count);
+  i32 *fixup_depth = arena_push_array(scratch, i32, count);
+  
+  // NOTE(lvl5): the callees are batches of their own, they're done
+  if (!bc_jit_begin(jit)) {
+    arena_set_mark(scratch, mark);
+    return false;
+  }
+  byte *entry = jit->code + jit->size;
+  bc_jit_prologue(jit);
+  
+  i32 depth = 0;
+  for (i64 i = head; i <= tail;) {
+    i64 at = i - head;
+    offsets[at] = jit->size;
+    if (depths[at] >= 0) depth = depths[at];
+    
+    Instruction_Kind kind = func->instructions[i].kind;
+    if (kind == I_RET || kind == I_TAIL_CALL || !bc_jit_is_supported(kind) ||
+        ((kind == I_CALL || kind == I_CALL_DIRECT) && !native_call[at])) {
+      bc_jit_exit(jit, loop, i, depth);
+      depth += bc_stack_delta(kind);
+      i++;
+      continue;
+    }
+    
+    i64 first_fixup = fixups.count;
+    i64 used = bc_jit_instruction(jit, e, func, i, is_target, &fixups);
+    for (i64 k = 0; k < used; k++) {
+      depth += bc_stack_delta(func->instructions[i + k].kind);
+    }
+    for (i64 k = first_fixup; k < fixups.count; k++) {
+      i64 target = fixups.target[k];
+      fixup_depth[k] = depth;
+      if (target >= head && target <= tail && depths[target - head] < 0) {
+        depths[target - head] = depth;
+      }
+    }
+    i += used;
+  }
+  
+  for (i64 k = 0; k < fixups.count; k++) {
+    i64 target = fixups.target[k];
+    i64 dst;
+    if (target >= head && target <= tail) {
+      dst = offsets[target - head];
+    } else {
+      dst = jit->size;
+      bc_jit_exit(jit, loop, target, fixup_depth[k]);
+    }
+    if (jit->overflow) break;
+    i32 rel = (i32)(dst - (fixups.at[k] + 4));
+    copy_memory_small(jit->code + fixups.at[k], (byte *)&rel, 4);
+  }
+  
+  // NOTE(lvl5): the side exit stubs are in the batch too, a loop that
+  // doesn't fit with them stays interpreted
+  b32 result = bc_jit_end(jit);
+  if (result) {
+    bc_atomic_store_ptr(&loop->native, entry);
+  }
+  arena_set_mark(scratch, mark);
+  return result;
+}
+
+// NOTE(lvl5): called by the interpreter on every LOOP, true if the loop
+// has native code to run instead
+b32 bc_jit_trace_up(Bc_Vm *vm, i64 loop_index) {
+  if (vm->compile_time) return false;
+  Bc_Emitter *e = vm->emitter;
+  Bc_Loop *loop = e->loops + loop_index;
+  if (bc_atomic_load_ptr(&loop->native)) return true;
+  if (bc_atomic_load_i32(&loop->jit_failed) ||
+      bc_atomic_increment(&loop->count) < BC_JIT_LOOP_THRESHOLD) return false;
+  
+  bc_code_lock();
+  // NOTE(lvl5): another thread can have emitted a function and moved
+  // e->loops while this one waited, what loop points at is a stale copy
+  loop = e->loops + loop_index;
+  if (!loop->native && !loop->jit_failed) {
+    bc_jit_init(&bc_jit, megabytes(16));
+    b32 compiled = bc_jit_compile_loop(&vm->scratch, e, loop_index);
+    loop = e->loops + loop_index;
+    if (!compiled) {
+      bc_atomic_store_i32(&loop->jit_failed, true);
+    }
+  }
+  b32 result = loop->native != 0;
+  bc_code_unlock();
+  return result;
+}
+#endif
+
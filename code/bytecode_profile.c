@@ -0,0 +1,253 @@
+// NOTE(lvl5): sampling profiler for the VM, built in with BC_PROFILE.
+// every BC_PROFILE_PERIOD dispatches the instruction about to run is
+// recorded together with the VM functions it was reached through, so a
+// sample is roughly BC_PROFILE_PERIOD instructions of work. the call stack
+// is a shadow of the exec stack kept by CALL, TAIL_CALL and RET, the exec
+// stack itself can't be walked since the return addresses sit between
+// operands. the line of a sample comes from the function's source spans.
+//
+// bytecode_run writes every distinct stack to BC_PROFILE_FILE in the folded
+// format flamegraph.pl reads, one `outer;inner;leaf:line count` per line,
+// and prints the hottest functions and lines. time spent in foreign calls
+// and jitted code doesn't dispatch and isn't seen
+#if BC_PROFILE
+
+// NOTE(lvl5): prime, so the samples don't fall in step with a loop
+#ifndef BC_PROFILE_PERIOD
+#define BC_PROFILE_PERIOD 1009
+#endif
+#ifndef BC_PROFILE_FILE
+#define BC_PROFILE_FILE "profile.folded"
+#endif
+#define BC_PROFILE_HOT_COUNT 20
+// NOTE(lvl5): deeper stacks keep their innermost frames under a `...` root,
+// a deep recursion would otherwise make every sample a new stack
+#define BC_PROFILE_MAX_DEPTH 128
+#define BC_PROFILE_TRUNCATED -1
+
+typedef struct {
+  u64 hash;
+  i32 *frames; // function indices, outermost first, or BC_PROFILE_TRUNCATED
+  i32 depth;
+  i32 line;
+  i32 token; // of the first sample, for printing the line
+  i64 count;
+} Bc_Profile_Entry;
+
+// NOTE(lvl5): open addressing, capacity is a power of two and the table
+// doubles at half full
+typedef struct {
+  Bc_Profile_Entry *entries;
+  u32 capacity;
+  u32 count;
+} Bc_Profile_Table;
+
+typedef struct {
+  Arena *arena;
+  i32 *stack; // the functions the VM is in, innermost last
+  i32 depth;
+  i32 countdown; // dispatches until the next sample
+  Bc_Profile_Table samples;
+  i64 sample_count;
+} Bc_Profile;
+
+void bc_profile_init(Bc_Profile *profile, Arena *arena, u64 max_depth) {
+  zero_memory(profile, sizeof(Bc_Profile));
+  profile->arena = arena;
+  profile->stack = arena_push_array(arena, i32, max_depth);
+  profile->countdown = BC_PROFILE_PERIOD;
+}
+
+void bc_profile_table_init(Bc_Profile_Table *table, Arena *arena, u32 capacity) {
+  table->capacity = capacity;
+  table->count = 0;
+  table->entries = arena_push_array(arena, Bc_Profile_Entry, capacity);
+  zero_memory(table->entries, capacity*sizeof(Bc_Profile_Entry));
+}
+
+u64 bc_profile_hash(i32 *frames, i32 depth, i32 line) {
+  // NOTE(lvl5): FNV-1a
+  u64 result = 14695981039346656037ull;
+  for (i32 i = 0; i < depth; i++) {
+    result = (result ^ (u32)frames[i])*1099511628211ull;
+  }
+  result = (result ^ (u32)line)*1099511628211ull;
+  return result;
+}
+
+Bc_Profile_Entry *bc_profile_find(Bc_Profile_Table *table, u64 hash, i32 *frames, i32 depth, i32 line) {
+  u32 mask = table->capacity - 1;
+  u32 slot = (u32)hash & mask;
+  Bc_Profile_Entry *result = table->entries + slot;
+  while (result->frames) {
+    if (result->hash == hash && result->depth == depth && result->line == line &&
+        compare_memory(result->frames, frames, depth*sizeof(i32))) {
+      break;
+    }
+    slot = (slot + 1) & mask;
+    result = table->entries + slot;
+  }
+  return result;
+}
+
+// NOTE(lvl5): adds count to the entry of a stack, frames is copied the
+// first time that stack is seen
+void bc_profile_add(Bc_Profile_Table *table, Arena *arena, i32 *frames, i32 depth,
+                    i32 line, i32 token, i64 count) {
+  if (2*(table->count + 1) > table->capacity) {
+    Bc_Profile_Table old = *table;
+    bc_profile_table_init(table, arena, old.capacity ? 2*old.capacity : 256);
+    for (u32 i = 0; i < old.capacity; i++) {
+      Bc_Profile_Entry *entry = old.entries + i;
+      if (entry->frames) {
+        *bc_profile_find(table, entry->hash, entry->frames, entry->depth, entry->line) = *entry;
+        table->count++;
+      }
+    }
+  }
+  
+  u64 hash = bc_profile_hash(frames, depth, line);
+  Bc_Profile_Entry *entry = bc_profile_find(table, hash, frames, depth, line);
+  if (!entry->frames) {
+    entry->hash = hash;
+    entry->frames = arena_push_array(arena, i32, depth);
+    copy_memory(entry->frames, frames, depth*sizeof(i32));
+    entry->depth = depth;
+    entry->line = line;
+    entry->token = token;
+    table->count++;
+  }
+  entry->count += count;
+}
+
+void bc_profile_sample(Bc_Profile *profile, Bc_Emitter *e, Bc_Code **func_code, Bc_Code *instr) {
+  // NOTE(lvl5): the dispatch to HLT after the last RET
+  if (profile->depth == 0) return;
+  
+  i32 line = 0;
+  i32 token = -1;
+  
+  i32 leaf = profile->stack[profile->depth - 1];
+  Bc_Function *func = e->functions[leaf];
+  if (func->emitted) {
+    i64 index = bc_code_index(func_code[leaf], func->instruction_count, instr);
+    Bc_Source_Span *span = index >= 0 ? bc_find_source_span(func, index) : 0;
+    if (span) {
+      line = span->line;
+      token = e->parser ? span->first_token : -1;
+    }
+  }
+  
+  i32 *frames = profile->stack;
+  i32 depth = profile->depth;
+  i32 truncated[BC_PROFILE_MAX_DEPTH];
+  if (depth > BC_PROFILE_MAX_DEPTH) {
+    truncated[0] = BC_PROFILE_TRUNCATED;
+    copy_memory(truncated + 1, frames + depth - (BC_PROFILE_MAX_DEPTH - 1),
+                (BC_PROFILE_MAX_DEPTH - 1)*sizeof(i32));
+    frames = truncated;
+    depth = BC_PROFILE_MAX_DEPTH;
+  }
+  bc_profile_add(&profile->samples, profile->arena, frames, depth, line, token, 1);
+  profile->sample_count++;
+}
+
+// NOTE(lvl5): index of the biggest count, which is then cleared so the
+// next call finds the one after it. -1 once they're all 0
+i32 bc_profile_take_max(i64 *counts, u32 count) {
+  i32 result = -1;
+  for (u32 i = 0; i < count; i++) {
+    if (counts[i] > 0 && (result < 0 || counts[i] > counts[result])) {
+      result = i;
+    }
+  }
+  if (result >= 0) {
+    counts[result] = 0;
+  }
+  return result;
+}
+
+void bc_profile_report(Bc_Profile *profile, Bc_Emitter *e, Arena *scratch) {
+  u64 mark = arena_get_mark(scratch);
+  Bc_Profile_Table *samples = &profile->samples;
+  
+  FILE *file = bc_open_file(BC_PROFILE_FILE);
+  if (file) {
+    for (u32 i = 0; i < samples->capacity; i++) {
+      Bc_Profile_Entry *entry = samples->entries + i;
+      if (entry->frames) {
+        for (i32 j = 0; j < entry->depth; j++) {
+          i32 f = entry->frames[j];
+          fprintf(file, j ? ";%s" : "%s",
+                  f == BC_PROFILE_TRUNCATED ? "..." : to_c_string(scratch, e->functions[f]->name));
+        }
+        fprintf(file, ":%d %lld\n", entry->line, entry->count);
+      }
+    }
+    fclose(file);
+  }
+  
+  // NOTE(lvl5): total counts a sample once for every function on its
+  // stack, recursion doesn't count it again
+  u32 function_count = sb_count(e->functions);
+  i64 *self = arena_push_array(scratch, i64, function_count);
+  i64 *total = arena_push_array(scratch, i64, function_count);
+  i64 *sorted = arena_push_array(scratch, i64, function_count);
+  u32 *seen = arena_push_array(scratch, u32, function_count);
+  zero_memory(self, function_count*sizeof(i64));
+  zero_memory(total, function_count*sizeof(i64));
+  zero_memory(seen, function_count*sizeof(u32));
+  
+  Bc_Profile_Table lines = {0};
+  for (u32 i = 0; i < samples->capacity; i++) {
+    Bc_Profile_Entry *entry = samples->entries + i;
+    if (entry->frames) {
+      i32 *leaf = entry->frames + entry->depth - 1;
+      self[*leaf] += entry->count;
+      for (i32 j = 0; j < entry->depth; j++) {
+        i32 f = entry->frames[j];
+        if (f != BC_PROFILE_TRUNCATED && seen[f] != i + 1) {
+          seen[f] = i + 1;
+          total[f] += entry->count;
+        }
+      }
+      bc_profile_add(&lines, scratch, leaf, 1, entry->line, entry->token, entry->count);
+    }
+  }
+  
+  printf("profile: %lld samples, one every %d instructions, stacks in %s\n",
+         profile->sample_count, BC_PROFILE_PERIOD, BC_PROFILE_FILE);
+  f64 percent = profile->sample_count ? 100.0/(f64)profile->sample_count : 0;
+  
+  printf("   self%%  total%%  instructions  function\n");
+  copy_memory(sorted, self, function_count*sizeof(i64));
+  for (i32 n = 0; n < BC_PROFILE_HOT_COUNT; n++) {
+    i32 f = bc_profile_take_max(sorted, function_count);
+    if (f < 0) break;
+    printf("  %6.2f %6.2f  %12lld  %s\n", self[f]*percent, total[f]*percent,
+           self[f]*BC_PROFILE_PERIOD, to_c_string(scratch, e->functions[f]->name));
+  }
+  
+  printf("   self%%  line\n");
+  i64 *line_counts = arena_push_array(scratch, i64, lines.capacity);
+  for (u32 i = 0; i < lines.capacity; i++) {
+    line_counts[i] = lines.entries[i].frames ? lines.entries[i].count : 0;
+  }
+  for (i32 n = 0; n < BC_PROFILE_HOT_COUNT; n++) {
+    i32 i = bc_profile_take_max(line_counts, lines.capacity);
+    if (i < 0) break;
+    Bc_Profile_Entry *entry = lines.entries + i;
+    printf("  %6.2f  %s:%d", entry->count*percent,
+           to_c_string(scratch, e->functions[entry->frames[0]]->name), entry->line);
+    if (entry->token >= 0) {
+      Token t = e->parser->tokens[entry->token];
+      String text = get_line_from_index(e->parser->src, (u32)(t.value.data - e->parser->src.data));
+      printf("  %s", to_c_string(scratch, text));
+    }
+    printf("\n");
+  }
+  
+  arena_set_mark(scratch, mark);
+}
+
+#endif
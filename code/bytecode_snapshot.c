@@ -0,0 +1,273 @@
+// NOTE(lvl5): #init functions and snapshot builds. functions marked #init
+// run in declaration order before __entry, with a ctx whose allocator
+// hands out the VM heap. a snapshot build runs them while compiling
+// instead: what they leave in the BSS and on the heap is kept, saved in
+// the bytecode image, and the program starts with it and runs none of
+// them.
+//
+// the globals have types, so bc_snapshot knows which of their words are
+// pointers and function values. a pointer into the heap types what it
+// points to, those are followed as well. the pointers become offsets that
+// are pointed at wherever the segments end up. a pointer to anything else,
+// memory from a #foreign malloc or the ctx itself, is only good in the
+// compiler, and heap memory no typed pointer reaches could have pointers
+// in it nothing knows about, so the snapshot is refused for either
+
+// NOTE(lvl5): the Allocator an #init function's ctx has, allocator_data is
+// the heap arena. op is Alloc_Op from preload.lang. nothing is freed, the
+// BSS can still point at it
+byte *bc_heap_allocator(u64 size, i64 op, void *allocator_data, void *old_ptr, u64 old_size, u64 align) {
+  Arena *heap = (Arena *)allocator_data;
+  byte *result = 0;
+  if (!align) align = 8;
+  if ((op == 0 || op == 1) && heap->size + size + align <= heap->capacity) {
+    result = arena_push_memory(heap, size, align);
+    if (op == 1 && old_ptr) {
+      copy_memory(result, old_ptr, old_size < size ? old_size : size);
+    }
+  }
+  return result;
+}
+
+Bc_Context_Layout bc_context_layout(Code_Stmt_Decl *decl) {
+  Code_Type_Func *func = &get_final_type(decl->type)->t_func;
+  // NOTE(lvl5): #init functions take nothing but ctx
+  assert(sb_count(func->params) == 1 && is_type_kind(func->return_type, Code_Kind_TYPE_VOID));
+  Code_Node *type = get_final_type(func->params[0]->s_decl.type);
+  
+  Bc_Context_Layout result = {0};
+  result.size = get_size_of_type(type);
+  result.allocator = -1;
+  result.allocator_data = -1;
+  for (u32 i = 0; i < sb_count(type->t_struct.members); i++) {
+    Code_Stmt_Decl *member = &type->t_struct.members[i]->s_decl;
+    if (string_compare(member->name, const_string("allocator"))) {
+      result.allocator = member->offset;
+    } else if (string_compare(member->name, const_string("allocator_data"))) {
+      result.allocator_data = member->offset;
+    }
+  }
+  assert(result.allocator >= 0 && result.allocator_data >= 0);
+  return result;
+}
+
+b32 bc_has_snapshot(Bc_Emitter *e) {
+  b32 result = e && e->snapshot;
+  return result;
+}
+
+// NOTE(lvl5): false if one of them overflowed
+b32 bc_vm_run_init(Bc_Vm *vm) {
+  Bc_Emitter *e = vm->emitter;
+  Bc_Context_Layout context = e->context;
+  // NOTE(lvl5): the global initializers, they're in the snapshot too
+  b32 result = bc_has_snapshot(e) || bc_vm_run(vm, 0);
+  for (u32 i = 0; i < sb_count(e->init_functions) && result; i++) {
+    zero_memory(vm->stack, context.size);
+    *(u64 *)(vm->stack + context.allocator) = FOREIGN_FUNCTION_PTR_BIT | (u64)bc_heap_allocator;
+    *(Arena **)(vm->stack + context.allocator_data) = &vm->heap;
+    result = bc_vm_run(vm, e->init_functions[i]);
+  }
+  return result;
+}
+
+typedef struct {
+  Bc_Emitter *e;
+  Bc_Snapshot *snapshot;
+  byte *bss; // where the segments were while the #init functions ran
+  byte *heap;
+  byte *typed; // heap bytes a typed pointer reaches
+  char *error;
+} Bc_Snapshot_Walk;
+
+b32 bc_snapshot_is_global(Code_Stmt_Decl *decl) {
+  b32 result = decl->storage_kind == Storage_Kind_BSS && decl->type != builtin_Type &&
+    !(decl->value && decl->value->kind == Code_Kind_FUNC);
+  return result;
+}
+
+// NOTE(lvl5): the value of type at offset in segment. struct members
+// aren't aligned, so neither are the pointers
+void bc_snapshot_relocate(Bc_Snapshot_Walk *walk, Bc_Segment segment, u64 offset, Code_Node *type) {
+  Bc_Snapshot *snapshot = walk->snapshot;
+  Code_Node *final_type = get_final_type(type);
+  byte *data = segment == Bc_Segment_HEAP ? snapshot->heap : snapshot->bss;
+  
+  switch (final_type->kind) {
+    case Code_Kind_TYPE_STRUCT: {
+      for (u32 i = 0; i < sb_count(final_type->t_struct.members) && !walk->error; i++) {
+        Code_Stmt_Decl *member = &final_type->t_struct.members[i]->s_decl;
+        bc_snapshot_relocate(walk, segment, offset + member->offset, member->type);
+      }
+    } break;
+    case Code_Kind_TYPE_ARRAY: {
+      i32 item_size = get_size_of_type(final_type->t_array.item_type);
+      for (u64 i = 0; i < final_type->t_array.count && !walk->error; i++) {
+        bc_snapshot_relocate(walk, segment, offset + i*item_size, final_type->t_array.item_type);
+      }
+    } break;
+    case Code_Kind_TYPE_FUNC: {
+      u64 word;
+      copy_memory_small((byte *)&word, data + offset, 8);
+      Bc_Relocation relocation = { offset, segment, Bc_Segment_FOREIGN };
+      if (!(word & FOREIGN_FUNCTION_PTR_BIT)) {
+        // NOTE(lvl5): a function index, good anywhere
+        break;
+      } else if (word == (FOREIGN_FUNCTION_PTR_BIT | (u64)bc_heap_allocator)) {
+        relocation.to = Bc_Segment_ALLOCATOR;
+        word = 0;
+      } else {
+        Bc_Emitter *e = walk->e;
+        u32 i = 0;
+        while (i < sb_count(e->imports) &&
+               *(u64 *)(walk->bss + e->imports[i].offset) != word) i++;
+        if (i == sb_count(e->imports)) {
+          walk->error = "a function value that isn't a #foreign function of the program";
+          break;
+        }
+        word = e->imports[i].offset;
+      }
+      copy_memory_small(data + offset, (byte *)&word, 8);
+      sb_push(snapshot->relocations, relocation);
+    } break;
+    case Code_Kind_TYPE_POINTER: {
+      u64 word;
+      copy_memory_small((byte *)&word, data + offset, 8);
+      Bc_Relocation relocation = { offset, segment, Bc_Segment_BSS };
+      if (!word) {
+        break;
+      } else if (word >= (u64)walk->bss && word < (u64)walk->bss + BC_BSS_SIZE) {
+        word -= (u64)walk->bss;
+      } else if (word >= (u64)walk->heap && word <= (u64)walk->heap + snapshot->heap_size) {
+        relocation.to = Bc_Segment_HEAP;
+        word -= (u64)walk->heap;
+        
+        // NOTE(lvl5): what it points to has a type now, unless something
+        // else got there first
+        Code_Node *base = final_type->t_pointer.base;
+        i32 size = get_size_of_type(base);
+        if (size && word + size <= snapshot->heap_size && !walk->typed[word]) {
+          for (i32 i = 0; i < size; i++) {
+            walk->typed[word + i] = true;
+          }
+          bc_snapshot_relocate(walk, Bc_Segment_HEAP, word, base);
+        }
+      } else {
+        walk->error = "a pointer to memory that isn't the BSS or the heap";
+        break;
+      }
+      copy_memory_small(data + offset, (byte *)&word, 8);
+      sb_push(snapshot->relocations, relocation);
+    } break;
+    default: break;
+  }
+}
+
+// NOTE(lvl5): copies the snapshot's heap into e's arena and points its
+// pointers there and at e's BSS, which has the snapshot's BSS in it. the
+// #foreign slots have to be filled in first
+void bc_snapshot_apply(Bc_Emitter *e, Bc_Snapshot *snapshot) {
+  e->heap = arena_push_array(e->arena, byte, snapshot->heap_size);
+  copy_memory(e->heap, snapshot->heap, snapshot->heap_size);
+  for (u32 i = 0; i < sb_count(snapshot->relocations); i++) {
+    Bc_Relocation *relocation = snapshot->relocations + i;
+    byte *at = (relocation->segment == Bc_Segment_HEAP ? e->heap : e->bss_segment) + relocation->offset;
+    u64 word;
+    copy_memory_small((byte *)&word, at, 8);
+    switch (relocation->to) {
+      case Bc_Segment_BSS: word += (u64)e->bss_segment; break;
+      case Bc_Segment_HEAP: word += (u64)e->heap; break;
+      case Bc_Segment_FOREIGN: word = *(u64 *)(e->bss_segment + word); break;
+      case Bc_Segment_ALLOCATOR: word = FOREIGN_FUNCTION_PTR_BIT | (u64)bc_heap_allocator; break;
+    }
+    copy_memory_small(at, (byte *)&word, 8);
+  }
+}
+
+// NOTE(lvl5): runs the #init functions on the emitter's BSS, keeps what
+// they left in e->snapshot and takes them off the list bytecode_run runs.
+// decls are the top level ones, the globals are among them. call it after
+// the program is emitted, before running it or writing an image.
+// everything is emitted first, so no constant lands in the BSS after it
+b32 bc_snapshot(Bc_Emitter *e, Code_Node **decls) {
+  for (u32 i = 0; i < sb_count(e->functions); i++) {
+    bc_emit_function(e, e->functions[i]);
+  }
+  
+  Arena arena;
+  arena_init(&arena, malloc(BC_RUN_ARENA_SIZE), BC_RUN_ARENA_SIZE);
+  Bc_Vm vm;
+  bc_vm_init(&vm, &arena, e, e->bss_segment);
+  char *error = bc_vm_run_init(&vm) ? 0 : vm.error;
+  if (!error) {
+    Bc_Snapshot *snapshot = arena_push_struct(e->arena, Bc_Snapshot);
+    // NOTE(lvl5): the 0s at the end are left out, but not the end of a
+    // global that starts before them, the walk reads all of it
+    u64 bss_size = BC_BSS_SIZE;
+    while (bss_size && !e->bss_segment[bss_size - 1]) bss_size--;
+    for (u32 i = 0; i < sb_count(decls); i++) {
+      Code_Stmt_Decl *decl = &decls[i]->s_decl;
+      if (bc_snapshot_is_global(decl) && (u64)decl->offset < bss_size) {
+        u64 end = decl->offset + get_size_of_type(decl->type);
+        if (end > bss_size) bss_size = end;
+      }
+    }
+    snapshot->bss_size = bss_size;
+    snapshot->bss = arena_push_array(e->arena, byte, snapshot->bss_size);
+    copy_memory(snapshot->bss, e->bss_segment, snapshot->bss_size);
+    snapshot->heap_size = vm.heap.size;
+    snapshot->heap = arena_push_array(e->arena, byte, snapshot->heap_size);
+    copy_memory(snapshot->heap, vm.heap.data, snapshot->heap_size);
+    snapshot->relocations = sb_new(e->arena, Bc_Relocation, 64);
+    
+    Bc_Snapshot_Walk walk = {0};
+    walk.e = e;
+    walk.snapshot = snapshot;
+    walk.bss = e->bss_segment;
+    walk.heap = vm.heap.data;
+    walk.typed = arena_push_array(&arena, byte, snapshot->heap_size + 1);
+    zero_memory(walk.typed, snapshot->heap_size + 1);
+    Code_Stmt_Decl *global = 0;
+    for (u32 i = 0; i < sb_count(decls) && !walk.error; i++) {
+      Code_Stmt_Decl *decl = &decls[i]->s_decl;
+      if (bc_snapshot_is_global(decl) && (u64)decl->offset < snapshot->bss_size) {
+        global = decl;
+        bc_snapshot_relocate(&walk, Bc_Segment_BSS, decl->offset, decl->type);
+      }
+    }
+    
+    // NOTE(lvl5): the heap words nothing typed, one of them could be a
+    // pointer
+    for (u64 i = 0; i + 8 <= snapshot->heap_size && !walk.error; i++) {
+      u64 word;
+      copy_memory_small((byte *)&word, snapshot->heap + i, 8);
+      b32 typed = false;
+      for (u64 k = 0; k < 8; k++) typed |= walk.typed[i + k];
+      if (!typed && ((word >= (u64)walk.bss && word < (u64)walk.bss + BC_BSS_SIZE) ||
+                     (word >= (u64)walk.heap && word <= (u64)walk.heap + snapshot->heap_size))) {
+        global = 0;
+        walk.error = "heap memory no typed pointer reaches has a pointer in it";
+      }
+    }
+    
+    if (walk.error) {
+      if (global) {
+        printf("Error: can't snapshot \"%s\", %s\n", tcstring(global->name), walk.error);
+      } else {
+        printf("Error: can't snapshot the heap, %s\n", walk.error);
+      }
+      error = walk.error;
+    } else {
+      copy_memory(e->bss_segment, snapshot->bss, snapshot->bss_size);
+      bc_snapshot_apply(e, snapshot);
+      e->snapshot = snapshot;
+      sb_count(e->init_functions) = 0;
+    }
+  } else {
+    printf("Runtime error in #init: %s\n", error);
+  }
+  bc_vm_free(&vm);
+  free(arena.data);
+  b32 result = !error;
+  return result;
+}
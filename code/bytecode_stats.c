@@ -0,0 +1,228 @@
+// NOTE(lvl5): instruction statistics, built in with BC_STATS. every
+// handler counts its opcode and the one or two opcodes that ran right
+// before it, MEMCOPY sizes and call targets are counted too. bytecode_run
+// writes it all to BC_STATS_FILE as JSON and prints which pairs and
+// triples would save the most dispatches as one superinstruction.
+//
+// the sequences are dynamic, a taken jump or a call pairs its own opcode
+// with the target's. those can't be fused, so the ranking only takes
+// sequences where nothing but the last instruction can transfer control
+#if BC_STATS
+
+#ifndef BC_STATS_FILE
+#define BC_STATS_FILE "vm_stats.json"
+#endif
+#define BC_STATS_TOP 256 // sequences written to the file
+#define BC_STATS_FUSION_COUNT 20 // candidates printed
+#define BC_STATS_EXACT_SIZES 256 // bigger sizes only go into a power of two bucket
+
+typedef struct {
+  u64 exact[BC_STATS_EXACT_SIZES + 1];
+  u64 log2[65]; // [k] counts sizes in [2^(k-1), 2^k), [0] counts 0
+} Bc_Stats_Sizes;
+
+typedef struct {
+  Arena *arena;
+  u64 *ops; // [kind]
+  u64 *pairs; // [first*I_COUNT + second]
+  u64 *triples; // [(first*I_COUNT + second)*I_COUNT + third]
+  Bc_Stats_Sizes memcopy;
+  Bc_Stats_Sizes memcopy_n;
+  u64 *calls; // by function index, grown as functions are called
+  u64 foreign_calls;
+} Bc_Stats;
+
+u64 *bc_stats_counts(Arena *arena, u64 count) {
+  u64 *result = arena_push_array(arena, u64, count);
+  zero_memory(result, count*sizeof(u64));
+  return result;
+}
+
+void bc_stats_init(Bc_Stats *stats, Arena *arena) {
+  zero_memory(stats, sizeof(Bc_Stats));
+  stats->arena = arena;
+  stats->ops = bc_stats_counts(arena, I_COUNT);
+  stats->pairs = bc_stats_counts(arena, I_COUNT*I_COUNT);
+  stats->triples = bc_stats_counts(arena, I_COUNT*I_COUNT*I_COUNT);
+  stats->calls = sb_new(arena, u64, 64);
+}
+
+void bc_stats_size(Bc_Stats_Sizes *sizes, u64 size) {
+  if (size <= BC_STATS_EXACT_SIZES) {
+    sizes->exact[size]++;
+  }
+  u32 bucket = 0;
+  while (bucket < 64 && size >> bucket) {
+    bucket++;
+  }
+  sizes->log2[bucket]++;
+}
+
+void bc_stats_call(Bc_Stats *stats, i64 function) {
+  while (sb_count(stats->calls) <= function) {
+    sb_push(stats->calls, 0);
+  }
+  stats->calls[function]++;
+}
+
+// NOTE(lvl5): instructions a superinstruction can have anywhere but last.
+// I_NONE is the start of a VM entry
+b32 bc_stats_straight(u32 kind) {
+  b32 result = kind != I_NONE && !bc_is_jump(kind) && kind != I_CALL && kind != I_CALL_DIRECT &&
+    kind != I_TAIL_CALL && kind != I_RET && kind != I_HLT &&
+    kind != I_EMIT_FUNC && kind != I_LOOP;
+  return result;
+}
+
+typedef struct {
+  u64 index; // into ops, pairs or triples
+  u64 count;
+  u32 length;
+} Bc_Stats_Sequence;
+
+int bc_stats_sequence_compare(const void *a, const void *b) {
+  u64 x = ((Bc_Stats_Sequence *)a)->count*(((Bc_Stats_Sequence *)a)->length - 1);
+  u64 y = ((Bc_Stats_Sequence *)b)->count*(((Bc_Stats_Sequence *)b)->length - 1);
+  int result = (x < y) - (x > y);
+  return result;
+}
+
+// NOTE(lvl5): the pairs or triples that ran, most frequent first
+Bc_Stats_Sequence *bc_stats_sort(Arena *arena, u64 *counts, u32 length, b32 fusable_only, u64 *count_out) {
+  u64 total = 1;
+  for (u32 i = 0; i < length; i++) total *= I_COUNT;
+  
+  u64 count = 0;
+  for (u64 i = 0; i < total; i++) {
+    if (counts[i]) count++;
+  }
+  Bc_Stats_Sequence *result = arena_push_array(arena, Bc_Stats_Sequence, count + 1);
+  count = 0;
+  for (u64 i = 0; i < total; i++) {
+    if (!counts[i]) continue;
+    b32 fusable = true;
+    u64 rest = i/I_COUNT;
+    for (u32 j = 1; j < length; j++) {
+      fusable = fusable && bc_stats_straight((u32)(rest % I_COUNT));
+      rest /= I_COUNT;
+    }
+    if (fusable || !fusable_only) {
+      result[count++] = (Bc_Stats_Sequence){ .index = i, .count = counts[i], .length = length };
+    }
+  }
+  qsort(result, count, sizeof(Bc_Stats_Sequence), bc_stats_sequence_compare);
+  *count_out = count;
+  return result;
+}
+
+void bc_stats_write_sequence(FILE *file, Bc_Stats_Sequence *sequence) {
+  u32 kinds[3];
+  u64 rest = sequence->index;
+  for (u32 j = sequence->length; j > 0; j--) {
+    kinds[j - 1] = (u32)(rest % I_COUNT);
+    rest /= I_COUNT;
+  }
+  for (u32 j = 0; j < sequence->length; j++) {
+    fprintf(file, j ? " %s" : "%s", Instruction_Kind_To_String[kinds[j]]);
+  }
+}
+
+void bc_stats_write_sequences(FILE *file, Arena *arena, char *name, u64 *counts, u32 length) {
+  u64 count;
+  Bc_Stats_Sequence *sorted = bc_stats_sort(arena, counts, length, false, &count);
+  fprintf(file, "  \"%s\": [", name);
+  for (u64 i = 0; i < count && i < BC_STATS_TOP; i++) {
+    fprintf(file, "%s\n    {\"ops\": \"", i ? "," : "");
+    bc_stats_write_sequence(file, sorted + i);
+    fprintf(file, "\", \"count\": %llu}", sorted[i].count);
+  }
+  fprintf(file, "\n  ],\n");
+}
+
+void bc_stats_write_sizes(FILE *file, char *name, Bc_Stats_Sizes *sizes) {
+  fprintf(file, "  \"%s\": {\n    \"exact\": {", name);
+  b32 first = true;
+  for (u32 i = 0; i <= BC_STATS_EXACT_SIZES; i++) {
+    if (sizes->exact[i]) {
+      fprintf(file, "%s\"%u\": %llu", first ? "" : ", ", i, sizes->exact[i]);
+      first = false;
+    }
+  }
+  fprintf(file, "},\n    \"log2\": {");
+  first = true;
+  for (u32 i = 0; i < array_count(sizes->log2); i++) {
+    if (sizes->log2[i]) {
+      fprintf(file, "%s\"%llu\": %llu", first ? "" : ", ", i ? 1ull << (i - 1) : 0, sizes->log2[i]);
+      first = false;
+    }
+  }
+  fprintf(file, "}\n  },\n");
+}
+
+// NOTE(lvl5): the sorted sequences go in the VM's arena, there can be too
+// many for the scratch arena
+void bc_stats_report(Bc_Stats *stats, Bc_Emitter *e, Arena *scratch) {
+  u64 mark = arena_get_mark(stats->arena);
+  
+  u64 instruction_count = 0;
+  for (u32 i = 0; i < I_COUNT; i++) {
+    instruction_count += stats->ops[i];
+  }
+  
+  FILE *file = bc_open_file(BC_STATS_FILE);
+  if (file) {
+    fprintf(file, "{\n  \"instructions\": %llu,\n  \"opcodes\": {", instruction_count);
+    b32 first = true;
+    for (u32 i = 0; i < I_COUNT; i++) {
+      if (stats->ops[i]) {
+        fprintf(file, "%s\n    \"%s\": %llu", first ? "" : ",", Instruction_Kind_To_String[i], stats->ops[i]);
+        first = false;
+      }
+    }
+    fprintf(file, "\n  },\n");
+    
+    bc_stats_write_sequences(file, stats->arena, "pairs", stats->pairs, 2);
+    bc_stats_write_sequences(file, stats->arena, "triples", stats->triples, 3);
+    
+    bc_stats_write_sizes(file, "memcopy_sizes", &stats->memcopy);
+    bc_stats_write_sizes(file, "memcopy_n_sizes", &stats->memcopy_n);
+    
+    fprintf(file, "  \"foreign_calls\": %llu,\n  \"calls\": {", stats->foreign_calls);
+    first = true;
+    for (u32 i = 0; i < sb_count(stats->calls); i++) {
+      if (stats->calls[i]) {
+        fprintf(file, "%s\n    \"%s\": %llu", first ? "" : ",", to_c_string(scratch, e->functions[i]->name), stats->calls[i]);
+        first = false;
+      }
+    }
+    fprintf(file, "\n  }\n}\n");
+    fclose(file);
+  }
+  
+  // NOTE(lvl5): fusing n instructions saves n - 1 dispatches every time
+  // the sequence runs
+  u64 pair_count, triple_count;
+  Bc_Stats_Sequence *pairs = bc_stats_sort(stats->arena, stats->pairs, 2, true, &pair_count);
+  Bc_Stats_Sequence *triples = bc_stats_sort(stats->arena, stats->triples, 3, true, &triple_count);
+  
+  printf("stats: %llu instructions, written to %s\n", instruction_count, BC_STATS_FILE);
+  printf("   saved%%  dispatches saved  fusion\n");
+  f64 percent = instruction_count ? 100.0/(f64)instruction_count : 0;
+  u64 p = 0, t = 0;
+  for (u32 n = 0; n < BC_STATS_FUSION_COUNT && (p < pair_count || t < triple_count); n++) {
+    Bc_Stats_Sequence *best;
+    if (t == triple_count || (p < pair_count && bc_stats_sequence_compare(pairs + p, triples + t) <= 0)) {
+      best = pairs + p++;
+    } else {
+      best = triples + t++;
+    }
+    u64 saved = best->count*(best->length - 1);
+    printf("  %7.2f  %16llu  ", saved*percent, saved);
+    bc_stats_write_sequence(stdout, best);
+    printf("\n");
+  }
+  
+  arena_set_mark(stats->arena, mark);
+}
+
+#endif
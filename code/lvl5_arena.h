@@ -2,6 +2,17 @@
 #define LVL5_ARENA_VERSION 0
 
 #include "lvl5_types.h"
+#include <string.h>
+
+// NOTE(lvl5): the bulk paths use sse2 when the target has it, anything
+// else moves 8 bytes at a time
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LVL5_SSE2 1
+#include <emmintrin.h>
+#else
+#define LVL5_SSE2 0
+#endif
+
 
 typedef struct {
   byte *data;
@@ -26,6 +37,178 @@ void zero_memory_slow(void *dst, u64 size) {
   }
 } 
 
+// NOTE(lvl5): the fast versions dispatch on size:
+// 0-15 bytes are done with (possibly overlapping) 8/4/2/1 byte moves,
+// 16-32 bytes with two overlapping unaligned 16 byte moves,
+// anything bigger aligns the destination to 16 and moves 64 bytes at a time,
+// finishing with an overlapping unaligned 16 byte tail.
+// dst and src must not overlap, same as memcpy.
+// the unaligned word moves go through memcpy into locals, which compiles
+// to a single load or store and doesn't break strict aliasing
+
+void copy_memory_small(byte *d, byte *s, u64 size) {
+  if (size >= 8) {
+    u64 a, b;
+    memcpy(&a, s, 8);
+    memcpy(&b, s + size - 8, 8);
+    memcpy(d, &a, 8);
+    memcpy(d + size - 8, &b, 8);
+  } else if (size >= 4) {
+    u32 a, b;
+    memcpy(&a, s, 4);
+    memcpy(&b, s + size - 4, 4);
+    memcpy(d, &a, 4);
+    memcpy(d + size - 4, &b, 4);
+  } else if (size >= 2) {
+    u16 a, b;
+    memcpy(&a, s, 2);
+    memcpy(&b, s + size - 2, 2);
+    memcpy(d, &a, 2);
+    memcpy(d + size - 2, &b, 2);
+  } else if (size == 1) {
+    *d = *s;
+  }
+}
+
+void copy_memory(void *dst, void *src, u64 size) {
+  byte *d = (byte *)dst;
+  byte *s = (byte *)src;
+  
+  if (size < 16) {
+    copy_memory_small(d, s, size);
+  } else {
+#if LVL5_SSE2
+    __m128i head = _mm_loadu_si128((__m128i *)s);
+    __m128i tail = _mm_loadu_si128((__m128i *)(s + size - 16));
+    byte *end = d + size;
+    
+    _mm_storeu_si128((__m128i *)d, head);
+    if (size > 32) {
+      u64 skip = 16 - ((u64)d & 15);
+      d += skip;
+      s += skip;
+      
+      while (end - d >= 64) {
+        __m128i r0 = _mm_loadu_si128((__m128i *)(s + 0));
+        __m128i r1 = _mm_loadu_si128((__m128i *)(s + 16));
+        __m128i r2 = _mm_loadu_si128((__m128i *)(s + 32));
+        __m128i r3 = _mm_loadu_si128((__m128i *)(s + 48));
+        _mm_store_si128((__m128i *)(d + 0), r0);
+        _mm_store_si128((__m128i *)(d + 16), r1);
+        _mm_store_si128((__m128i *)(d + 32), r2);
+        _mm_store_si128((__m128i *)(d + 48), r3);
+        d += 64;
+        s += 64;
+      }
+      while (end - d >= 16) {
+        _mm_store_si128((__m128i *)d, _mm_loadu_si128((__m128i *)s));
+        d += 16;
+        s += 16;
+      }
+    }
+    _mm_storeu_si128((__m128i *)(end - 16), tail);
+#else
+    u64 tail;
+    memcpy(&tail, s + size - 8, 8);
+    byte *end = d + size;
+    
+    while (end - d >= 8) {
+      u64 r;
+      memcpy(&r, s, 8);
+      memcpy(d, &r, 8);
+      d += 8;
+      s += 8;
+    }
+    memcpy(end - 8, &tail, 8);
+#endif
+  }
+}
+
+void set_memory(void *dst, byte value, u64 size) {
+  byte *d = (byte *)dst;
+  u64 v = 0x0101010101010101ULL*value;
+  
+  if (size < 16) {
+    if (size >= 8) {
+      memcpy(d, &v, 8);
+      memcpy(d + size - 8, &v, 8);
+    } else if (size >= 4) {
+      u32 v32 = (u32)v;
+      memcpy(d, &v32, 4);
+      memcpy(d + size - 4, &v32, 4);
+    } else if (size >= 2) {
+      u16 v16 = (u16)v;
+      memcpy(d, &v16, 2);
+      memcpy(d + size - 2, &v16, 2);
+    } else if (size == 1) {
+      *d = value;
+    }
+  } else {
+    byte *end = d + size;
+#if LVL5_SSE2
+    __m128i v128 = _mm_set1_epi8((char)value);
+    
+    _mm_storeu_si128((__m128i *)d, v128);
+    _mm_storeu_si128((__m128i *)(end - 16), v128);
+    if (size > 32) {
+      d += 16 - ((u64)d & 15);
+      while (end - d >= 64) {
+        _mm_store_si128((__m128i *)(d + 0), v128);
+        _mm_store_si128((__m128i *)(d + 16), v128);
+        _mm_store_si128((__m128i *)(d + 32), v128);
+        _mm_store_si128((__m128i *)(d + 48), v128);
+        d += 64;
+      }
+      while (end - d >= 16) {
+        _mm_store_si128((__m128i *)d, v128);
+        d += 16;
+      }
+    }
+#else
+    while (end - d >= 8) {
+      memcpy(d, &v, 8);
+      d += 8;
+    }
+    memcpy(end - 8, &v, 8);
+#endif
+  }
+}
+
+void zero_memory(void *dst, u64 size) {
+  set_memory(dst, 0, size);
+}
+
+b32 compare_memory(void *a_ptr, void *b_ptr, u64 size) {
+  byte *a = (byte *)a_ptr;
+  byte *b = (byte *)b_ptr;
+  
+#if LVL5_SSE2
+  while (size >= 16) {
+    __m128i va = _mm_loadu_si128((__m128i *)a);
+    __m128i vb = _mm_loadu_si128((__m128i *)b);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xFFFF) {
+      return false;
+    }
+    a += 16;
+    b += 16;
+    size -= 16;
+  }
+#endif
+  while (size >= 8) {
+    u64 wa, wb;
+    memcpy(&wa, a, 8);
+    memcpy(&wb, b, 8);
+    if (wa != wb) return false;
+    a += 8;
+    b += 8;
+    size -= 8;
+  }
+  for (u64 i = 0; i < size; i++) {
+    if (a[i] != b[i]) return false;
+  }
+  return true;
+}
+
 void arena_init(Arena *arena, void *data, u64 capacity) {
   arena->data = (byte *)data;
   arena->capacity = capacity;
@@ -49,7 +49,7 @@ void *__grow(void *arr_ptr_, u64 item_size) {
   u32 header_size = sizeof(sb_Header);
   void *data = arena_push_size(header->arena, 
                                new_capacity*item_size + header_size) + header_size;
-  copy_memory_slow(data, arr, header->capacity*item_size);
+  copy_memory(data, arr, header->capacity*item_size);
   
   sb_Header *new_header = __get_header(data);
   new_header->arena = header->arena;
@@ -25,7 +25,7 @@ String make_string(char *data, u32 count) {
 String alloc_string(Arena *arena, char *data, u32 count) {
   String result;
   result.data = arena_push_array(arena, char, count);
-  copy_memory_slow(result.data, data, count);
+  copy_memory(result.data, data, count);
   result.count = count;
   return result;
 }
@@ -93,14 +93,14 @@ String concat(Arena *arena, String a, String b) {
   String result;
   result.data = arena_push_array(arena, char, a.count + b.count);
   result.count = a.count + b.count;
-  copy_memory_slow(result.data, a.data, a.count);
-  copy_memory_slow(result.data + a.count, b.data, b.count);
+  copy_memory(result.data, a.data, a.count);
+  copy_memory(result.data + a.count, b.data, b.count);
   return result;
 }
 
 char *to_c_string(Arena *arena, String a) {
   char *result = arena_push_array(arena, char, a.count + 1);
-  copy_memory_slow(result, a.data, a.count);
+  copy_memory(result, a.data, a.count);
   result[a.count] = '\0';
   return result;
 }
@@ -133,12 +133,8 @@ b32 string_compare(String a, String b) {
   if (a.count != b.count) {
     return false;
   }
-  for (i32 i = 0; i < a.count; i++) {
-    if (a.data[i] != b.data[i]) {
-      return false;
-    }
-  }
-  return true;
+  b32 result = compare_memory(a.data, b.data, a.count);
+  return result;
 }
 
 
@@ -351,7 +347,7 @@ String arena_sprintf(Arena *arena, String fmt, ...) {
       } else if (fmt.data[i+1] == '.') {
         byte decimal_count = fmt.data[i+2] - '0';
         assert(fmt.data[i+3] == 'f');
-        f32 num = va_arg(args, f32);
+        f32 num = (f32)va_arg(args, f64);
         String str = f32_to_string(arena, num, decimal_count);
         result = concat(arena, result, str);
         i += 3;
@@ -23,16 +23,16 @@ void compiler_error(Parser *p, Token t, char *fmt, ...) {
   va_start(args, fmt);
   
   char *buf = arena_push_array(scratch_arena, char, BUF_COUNT);
-  i32 count = vsprintf_s(buf, BUF_COUNT, fmt, args);
+  i32 count = vsnprintf(buf, BUF_COUNT, fmt, args);
   va_end(args);
-  assert(count > 0 && count <= BUF_COUNT);
+  assert(count > 0 && count < BUF_COUNT);
   
   
   String line_str = get_line_from_index(p->src, (u32)(t.value.data - p->src.data));
   char *line = to_c_string(p->arena, line_str);
   
   char *buf2 = arena_push_array(scratch_arena, char, BUF_COUNT);
-  char *line_pointer = arena_push_array(scratch_arena, char, line_str.count);
+  char *line_pointer = arena_push_array(scratch_arena, char, t.col + 2);
   i32 i = 0;
   for (; i < t.col; i++) {
     line_pointer[i] = ' ';
@@ -40,11 +40,11 @@ void compiler_error(Parser *p, Token t, char *fmt, ...) {
   line_pointer[i-1] = '^';
   line_pointer[i] = '\0';
   
-  i32 count2 = sprintf_s(buf2, BUF_COUNT, " at %d:%d\n%04d   %s\n       %s", t.line, t.col, t.line, line, line_pointer);
-  assert(count2 > 0 && count2 <= BUF_COUNT);
+  i32 count2 = snprintf(buf2, BUF_COUNT, " at %d:%d\n%04d   %s\n       %s", t.line, t.col, t.line, line, line_pointer);
+  assert(count2 > 0 && count2 < BUF_COUNT);
   
   
-  String err_string = concat(scratch_arena, make_string(buf, (u32)count-1), make_string(buf2, (u32)count2));
+  String err_string = concat(scratch_arena, make_string(buf, (u32)count), make_string(buf2, (u32)count2));
   
   p->error = err_string;
 }
@@ -100,7 +100,7 @@ Token parser_expect(Parser *p, Token_Kind kind) {
     Token t = parser_get(p, 0);
     char *expected = Token_Kind_To_String[kind].data;
     char *got = to_c_string(p->arena, t.value);
-    compiler_error(p, t, "Expected token \"%s\", got \"%s\" ", expected, got);
+    compiler_error(p, t, "Expected token \"%s\", got \"%s\"", expected, got);
     p->i++;
   }
   return result;
@@ -265,7 +265,7 @@ Code_Node *parse_stmt(Parser *p, b32 expect_semi) {
     
     if (init->kind == Code_Kind_STMT_EXPR &&
         parser_accept(p, T_DOUBLE_DOT)) {
-      Code_Node *min = init;
+      Code_Node *min = init->s_expr.expr;
       Code_Node *max = parse_expr(p);
       init = code_stmt_decl(p, const_string("it"), null, min, false);
       
@@ -295,6 +295,8 @@ Code_Node *parse_stmt(Parser *p, b32 expect_semi) {
     Code_Node *stmt = 0;
     if (!parser_peek(p, 0, T_SEMI)) {
       stmt = parse_stmt(p, true);
+    } else if (expect_semi) {
+      parser_expect(p, T_SEMI);
     }
     result = code_stmt_keyword(p, keyword, stmt, null);
   } else if (parser_peek(p, 0, T_PUSH_CONTEXT)) {
@@ -403,6 +405,11 @@ Code_Node *parse_expr_unary(Parser *p) {
     Token_Kind op = parser_prev(p).kind;
     Code_Node *expr = parse_expr_unary(p);
     result = code_expr_unary(p, op, expr);
+  } else if (parser_peek(p, 0, T_POUND) &&
+             string_compare(parser_get(p, 0).value, const_string("run"))) {
+    parser_next(p);
+    Code_Node *expr = parse_expr_unary(p);
+    result = code_expr_run(p, expr);
   } else {
     result = parse_expr_call(p);
   }
@@ -523,6 +530,7 @@ Code_Node *parse_decl(Parser *p) {
           }
           Token tok_module = parser_expect(p, T_STRING);
           Code_Func *func = &code_func(p, sig, null, true)->func;
+          sig->t_func.foreign = true;
           func->module = tok_module.value;
           // NOTE(lvl5): trim the string
           func->module.data++;
@@ -530,6 +538,16 @@ Code_Node *parse_decl(Parser *p) {
           func->foreign_name = foreign_name;
           value = (Code_Node *)func;
           parser_expect(p, T_SEMI);
+        } else if (string_compare(t.value, const_string("callback"))) {
+          // NOTE(lvl5): marks a type native code calls back through. any
+          // function can be passed to a foreign one, the VM makes the
+          // trampoline when it's passed, so there's nothing to record.
+          // the ; is left to parse_stmt_decl, same as for any type
+          value = (Code_Node *)sig;
+        } else if (string_compare(t.value, const_string("init"))) {
+          Code_Node *body = parse_stmt_block(p);
+          value = code_func(p, sig, body, false);
+          value->func.init = true;
         } else {
           assert(false);
         }
@@ -43,9 +43,10 @@ typedef struct {
 
 typedef struct Scope Scope;
 struct Scope {
-  Scope_Entry *entries;
+  Scope_Entry *entries; // NOTE(lvl5): allocated on the first scope_add
   Code_Stmt **deferred_statements;
   Scope *parent;
+  Arena *arena;
 };
 
 typedef struct {
@@ -72,6 +73,8 @@ typedef struct {
 typedef struct {
   Code_Node **params;
   Code_Node *return_type;
+  b32 foreign; // #foreign functions don't take ctx
+  b32 has_ctx; // ctx has been added to params, see typecheck_type
 } Code_Type_Func;
 
 typedef struct {
@@ -158,6 +161,15 @@ typedef struct {
   char value;
 } Code_Expr_Char;
 
+// NOTE(lvl5): #run expr, evaluated at compile time and replaced by the
+// value it produced. expr sees the globals and a ctx of its own
+typedef struct {
+  Code_Node *expr;
+  Scope *scope;
+  Code_Node *ctx;
+  Placeholder *placeholder; // where a struct or array value goes
+} Code_Expr_Run;
+
 typedef struct {
   Code_Node **members;
   String name;
@@ -170,6 +182,7 @@ typedef struct {
   b32 foreign;
   String module;
   String foreign_name;
+  b32 init; // #init, see bytecode_snapshot.c
   
   Scope *scope;
   i32 stack_size;
@@ -197,6 +210,7 @@ typedef struct {
   Code_Node *cond;
   Code_Node *post;
   Code_Node *body;
+  Scope *scope; // when init declares the loop variable
 } Code_Stmt_For;
 
 typedef struct {
@@ -218,6 +232,9 @@ struct Code_Stmt_Decl {
   
   Storage_Kind storage_kind;
   u32 offset; // offset from the BSS or the stack (or beginning of the struct)
+  b32 emitted; // functions only, see bc_declare_function
+  i64 function; // and the Bc_Function it got
+  b32 address_taken; // something may point at it, see mark_address_taken
 };
 
 typedef struct {
@@ -260,7 +277,8 @@ typedef enum {
   Code_Kind_EXPR_TYPE,
   Code_Kind_EXPR_NULL,
   Code_Kind_EXPR_CHAR,
-  Code_Kind_EXPR_LAST = Code_Kind_EXPR_CHAR,
+  Code_Kind_EXPR_RUN,
+  Code_Kind_EXPR_LAST = Code_Kind_EXPR_RUN,
   
   Code_Kind_STMT_ASSIGN,
   Code_Kind_STMT_FIRST = Code_Kind_STMT_ASSIGN,
@@ -301,6 +319,7 @@ struct Code_Node {
     Code_Expr_Name e_name;
     Code_Expr_Null e_null;
     Code_Expr_Char e_char;
+    Code_Expr_Run e_run;
     
     Code_Stmt_Assign s_assign;
     Code_Stmt_Expr s_expr;
@@ -333,30 +352,42 @@ Scope *alloc_scope(Arena *arena, Scope *parent) {
   Scope *result = arena_push_struct(arena, Scope);
   Scope zero_scope = {0};
   *result = zero_scope;
-  result->entries = sb_new(arena, Scope_Entry, 32);
   result->parent = parent;
+  result->arena = arena;
   return result;
 }
 
-Scope_Entry *scope_get(Scope *scope, String name) {
+// NOTE(lvl5): only looks at scope itself, a decl there can shadow one
+// in a parent scope
+Scope_Entry *scope_get_local(Scope *scope, String name) {
   Scope_Entry *result = 0;
-  for (u32 i = 0; i < sb_count(scope->entries); i++) {
-    Scope_Entry *test = scope->entries + i;
-    if (string_compare(test->decl->s_decl.name, name)) {
-      result = test;
-      break;
+  if (scope->entries) {
+    for (u32 i = 0; i < sb_count(scope->entries); i++) {
+      Scope_Entry *test = scope->entries + i;
+      if (string_compare(test->decl->s_decl.name, name)) {
+        result = test;
+        break;
+      }
     }
   }
-  if (!result && scope->parent) {
-    result = scope_get(scope->parent, name);
+  return result;
+}
+
+Scope_Entry *scope_get(Scope *scope, String name) {
+  Scope_Entry *result = 0;
+  for (; scope && !result; scope = scope->parent) {
+    result = scope_get_local(scope, name);
   }
   
   return result;
 }
 
 Scope_Entry *scope_add(Scope *scope, Code_Node *decl) {
-  Scope_Entry *entry = scope_get(scope, decl->s_decl.name);
+  Scope_Entry *entry = scope_get_local(scope, decl->s_decl.name);
   assert(!entry);
+  if (!scope->entries) {
+    scope->entries = sb_new(scope->arena, Scope_Entry, 8);
+  }
   sb_push(scope->entries, (Scope_Entry){0});
   entry = sb_peek(scope->entries);
   
@@ -365,6 +396,47 @@ Scope_Entry *scope_add(Scope *scope, Code_Node *decl) {
   return entry;
 }
 
+// NOTE(lvl5): a statement that puts a decl into the scope it's in. a for
+// loop's variable goes in the loop's own scope, see typecheck_stmt, but
+// the block still gets one so the loop can't see into a sibling's
+b32 stmt_declares(Code_Node *stmt) {
+  b32 result = false;
+  switch (stmt->kind) {
+    case Code_Kind_STMT_DECL: {
+      result = true;
+    } break;
+    case Code_Kind_STMT_FOR: {
+      result = stmt->s_for.init->kind == Code_Kind_STMT_DECL;
+    } break;
+    case Code_Kind_STMT_IF: {
+      result = stmt_declares(stmt->s_if.then_branch) ||
+        (stmt->s_if.else_branch && stmt_declares(stmt->s_if.else_branch));
+    } break;
+    case Code_Kind_STMT_WHILE: {
+      result = stmt_declares(stmt->s_while.body);
+    } break;
+    case Code_Kind_STMT_KEYWORD: {
+      result = stmt->s_keyword.keyword == T_DEFER ||
+        (stmt->s_keyword.stmt && stmt_declares(stmt->s_keyword.stmt));
+    } break;
+    default: break;
+  }
+  return result;
+}
+
+// NOTE(lvl5): blocks that don't declare anything (most if/while bodies)
+// don't get a scope of their own, lookups just go to the enclosing one
+b32 block_needs_scope(Code_Node *block) {
+  b32 result = false;
+  for (u32 i = 0; i < sb_count(block->s_block.statements); i++) {
+    if (stmt_declares(block->s_block.statements[i])) {
+      result = true;
+      break;
+    }
+  }
+  return result;
+}
+
 
 Code_Node *code_node(Parser *p, Code_Kind kind) {
   Code_Node *node = arena_push_struct(p->arena, Code_Node);
@@ -436,6 +508,12 @@ Code_Node *code_expr_char(Parser *p, char value) {
   return node;
 }
 
+Code_Node *code_expr_run(Parser *p, Code_Node *expr) {
+  Code_Node *node = code_node(p, Code_Kind_EXPR_RUN);
+  node->e_run.expr = expr;
+  return node;
+}
+
 Code_Node *code_type_struct(Parser *p, Code_Node **members) {
   Code_Node *node = code_node(p, Code_Kind_TYPE_STRUCT);
   node->t_struct.members = members;
@@ -1,9 +1,12 @@
 //#include "c_emitter.c"
-//#include "typechecker.c"
-//#include "bytecode_emitter.c"
+// NOTE(lvl5): the VM looks up its thread's stack with pthread_getattr_np
+#ifndef _WIN32
+#define _GNU_SOURCE
+#endif
 #include "parser.c"
 #include "time.h"
 #include <setjmp.h>
+#include <string.h>
 
 
 /*
@@ -97,7 +100,11 @@ Buffer read_entire_file(Arena *arena, String file_name) {
   Buffer result;
   FILE *file;
   char *c_file_name = to_c_string(arena, file_name);
+#ifdef _WIN32
   fopen_s(&file, c_file_name, "rb");
+#else
+  file = fopen(c_file_name, "rb");
+#endif
   fseek(file, 0, SEEK_END);
   result.size = ftell(file);
   fseek(file, 0, SEEK_SET);
@@ -112,7 +119,11 @@ Buffer read_entire_file(Arena *arena, String file_name) {
 void builder_to_file(String file_name, String_Builder *builder) {
   FILE *file;
   char *c_file_name = to_c_string(scratch_arena, file_name);
+#ifdef _WIN32
   fopen_s(&file, c_file_name, "wb");
+#else
+  file = fopen(c_file_name, "wb");
+#endif
   
   for (String_Builder_Block *block = &builder->first; block; block = block->next) {
     u64 size = block == builder->last 
@@ -132,75 +143,268 @@ typedef enum {
   Stage_RUN,
 } Stage;
 
+// NOTE(lvl5): what the checks of all the top level decls share
+typedef struct {
+  Parser *parser;
+  Scope *global_scope;
+  u32 bss_size; // string constants while checking, then globals and function slots
+  Code_Node **runs; // the #run expressions, see size_runs
+} Program;
+
 typedef struct {
   jmp_buf return_buf;
   Stage stage;
   Parser *parser;
+  Program *program;
+  Code_Node *blocked_on; // the name the last yield was waiting for
 } Check_State_Common;
 
 typedef struct {
   Check_State_Common *common;
   Scope *scope;
+  Code_Node *func; // the function the code being checked is in
+  Code_Node *context_arg; // what calls pass as ctx, see push_context
+  b32 in_loop;
 } Check_State;
 
-#define yield() longjmp(state.common->return_buf, 1)
+// NOTE(lvl5): gives up on the top level decl until the next round, it's
+// checked again from the start
+#define yield(node) { state.common->blocked_on = node; longjmp(state.common->return_buf, 1); }
+
+// NOTE(lvl5): the first error is kept in the parser, the decl isn't
+// checked again and main stops after checking
+void typecheck_error(Check_State state, Code_Node *node, char *fmt, ...) {
+  char buffer[256];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(buffer, sizeof(buffer), fmt, args);
+  va_end(args);
+
+  Parser *p = state.common->parser;
+  if (string_is_empty(p->error)) {
+    compiler_error(p, p->tokens[node->first_token], "%s", buffer);
+  }
+  longjmp(state.common->return_buf, 2);
+}
+
+u32 program_bss_push(Program *program, u32 size) {
+  u32 result = program->bss_size;
+  program->bss_size += (size + 7) & ~7;
+  return result;
+}
+
+Code_Node *get_final_type(Code_Node *type) {
+  Code_Node *result = type;
+  while (result->kind == Code_Kind_TYPE_ALIAS) {
+    result = result->t_alias.base;
+  }
+  return result;
+}
 
 b32 types_are_equal(Code_Node *a, Code_Node *b) {
-  b32 result = false;
-  
-  if (a->kind == b->kind) {
+  a = get_final_type(a);
+  b = get_final_type(b);
+  b32 result = a == b;
+
+  if (!result && a->kind == b->kind) {
     switch (a->kind) {
-      case Code_Kind_TYPE_ALIAS: {
-        result = string_compare(a->t_alias.name, b->t_alias.name);
-      } break;
-      
       case Code_Kind_TYPE_POINTER: {
         result = types_are_equal(a->t_pointer.base, b->t_pointer.base);
       } break;
-      
+
       case Code_Kind_TYPE_ARRAY: {
-        // TODO(lvl5): fixed sized arrays
-        result = types_are_equal(a->t_array.item_type, b->t_array.item_type);
+        result = a->t_array.count == b->t_array.count &&
+          types_are_equal(a->t_array.item_type, b->t_array.item_type);
       } break;
-      
+
       case Code_Kind_TYPE_FUNC: {
-        if (types_are_equal(a->t_func.return_type, b->t_func.return_type)) {
+        Code_Type_Func *a_func = &a->t_func;
+        Code_Type_Func *b_func = &b->t_func;
+        if (a_func->foreign == b_func->foreign &&
+            sb_count(a_func->params) == sb_count(b_func->params) &&
+            types_are_equal(a_func->return_type, b_func->return_type)) {
           result = true;
-          if (sb_count(a->t_func.params) == sb_count(a->t_func.params)) {
-            for (u32 i = 0; i < sb_count(a->t_func.params); i++) {
-              Code_Node *a_param = a->t_func.params[i];
-              Code_Node *b_param = b->t_func.params[i];
-              if (!types_are_equal(a_param, b_param)) {
-                result = false;
-                break;
-              }
+          for (u32 i = 0; i < sb_count(a_func->params); i++) {
+            Code_Node *a_param = a_func->params[i]->s_decl.type;
+            Code_Node *b_param = b_func->params[i]->s_decl.type;
+            if (!types_are_equal(a_param, b_param)) {
+              result = false;
+              break;
             }
           }
         }
       } break;
-      
+
       case Code_Kind_TYPE_INT: {
         result = a->t_int.size == b->t_int.size &&
           a->t_int.is_signed == b->t_int.is_signed;
       } break;
-      
+
       case Code_Kind_TYPE_FLOAT: {
         result = a->t_float.size == b->t_float.size;
       } break;
-      
+
       case Code_Kind_TYPE_VOID: {
         result = true;
       } break;
-      
+
+      // NOTE(lvl5): structs and enums are only equal to themselves
       default: {
         result = false;
       } break;
     }
   }
-  
+
+  return result;
+}
+
+b32 is_type_kind(Code_Node *type, Code_Kind kind) {
+  b32 result = get_final_type(type)->kind == kind;
+  return result;
+}
+
+b32 is_int_type(Code_Node *type) {
+  b32 result = is_type_kind(type, Code_Kind_TYPE_INT);
+  return result;
+}
+
+b32 is_number_type(Code_Node *type) {
+  b32 result = is_type_kind(type, Code_Kind_TYPE_INT) ||
+    is_type_kind(type, Code_Kind_TYPE_FLOAT);
   return result;
 }
 
+// NOTE(lvl5): what fits in a register, can be compared, tested and cast
+b32 is_scalar_type(Code_Node *type) {
+  Code_Kind kind = get_final_type(type)->kind;
+  b32 result = kind == Code_Kind_TYPE_INT || kind == Code_Kind_TYPE_FLOAT ||
+    kind == Code_Kind_TYPE_POINTER || kind == Code_Kind_TYPE_ENUM ||
+    kind == Code_Kind_TYPE_FUNC;
+  return result;
+}
+
+// NOTE(lvl5): what #run can't hand out. a pointer points into the VM
+// that made it and a function is an index into its function table
+b32 type_has_addresses(Code_Node *type) {
+  Code_Node *final_type = get_final_type(type);
+  b32 result = false;
+  switch (final_type->kind) {
+    case Code_Kind_TYPE_POINTER:
+    case Code_Kind_TYPE_FUNC: {
+      result = true;
+    } break;
+    case Code_Kind_TYPE_STRUCT: {
+      for (u32 i = 0; i < sb_count(final_type->t_struct.members) && !result; i++) {
+        result = type_has_addresses(final_type->t_struct.members[i]->s_decl.type);
+      }
+    } break;
+    case Code_Kind_TYPE_ARRAY: {
+      result = type_has_addresses(final_type->t_array.item_type);
+    } break;
+    default: break;
+  }
+  return result;
+}
+
+// NOTE(lvl5): a literal, maybe negated, takes the type it's used as
+b32 is_int_literal(Code_Node *expr) {
+  if (expr->kind == Code_Kind_EXPR_UNARY && expr->e_unary.op == T_SUB) {
+    expr = expr->e_unary.val;
+  }
+  b32 result = (expr->kind == Code_Kind_EXPR_INT && !expr->e_int.placeholder) ||
+    expr->kind == Code_Kind_EXPR_CHAR;
+  return result;
+}
+
+b32 is_float_literal(Code_Node *expr) {
+  if (expr->kind == Code_Kind_EXPR_UNARY && expr->e_unary.op == T_SUB) {
+    expr = expr->e_unary.val;
+  }
+  b32 result = expr->kind == Code_Kind_EXPR_FLOAT;
+  return result;
+}
+
+b32 is_lvalue(Code_Node *expr) {
+  b32 result = false;
+  switch (expr->kind) {
+    case Code_Kind_EXPR_NAME: {
+      Code_Stmt_Decl *decl = &expr->e_name.decl->s_decl;
+      result = !(decl->value && decl->value->kind == Code_Kind_FUNC);
+    } break;
+    case Code_Kind_EXPR_BINARY: {
+      Code_Expr_Binary *bin = &expr->e_binary;
+      if (bin->op == T_MEMBER || bin->op == T_SUBSCRIPT) {
+        result = bin->op == T_MEMBER && bin->is_enum_member ? false :
+          is_type_kind(bin->left->type, Code_Kind_TYPE_POINTER) || is_lvalue(bin->left);
+      }
+    } break;
+    case Code_Kind_EXPR_UNARY: {
+      result = expr->e_unary.op == T_DEREF;
+    } break;
+    default: break;
+  }
+  return result;
+}
+
+// NOTE(lvl5): the variable *expr points into, if it's not behind a
+// pointer. the emitter can't keep one of those to itself
+void mark_address_taken(Code_Node *expr) {
+  switch (expr->kind) {
+    case Code_Kind_EXPR_NAME: {
+      expr->e_name.decl->s_decl.address_taken = true;
+    } break;
+    case Code_Kind_EXPR_BINARY: {
+      Code_Expr_Binary *bin = &expr->e_binary;
+      if ((bin->op == T_MEMBER || bin->op == T_SUBSCRIPT) &&
+          !is_type_kind(bin->left->type, Code_Kind_TYPE_POINTER)) {
+        mark_address_taken(bin->left);
+      }
+    } break;
+    default: break;
+  }
+}
+
+// NOTE(lvl5): the conversions that happen without a cast: a literal to
+// any int or float type, an int to a wider one that can hold all of its
+// values, null to any pointer and pointers to and from *void
+Code_Node *maybe_implicit_cast(Check_State state, Code_Node *expr, Code_Node *to) {
+  Code_Node *from = get_final_type(expr->type);
+  Code_Node *final_to = get_final_type(to);
+
+  b32 allow = false;
+  if (types_are_equal(from, final_to)) {
+  } else if (final_to->kind == Code_Kind_TYPE_POINTER) {
+    allow = expr->kind == Code_Kind_EXPR_NULL ||
+      (from->kind == Code_Kind_TYPE_POINTER &&
+       (is_type_kind(from->t_pointer.base, Code_Kind_TYPE_VOID) ||
+        is_type_kind(final_to->t_pointer.base, Code_Kind_TYPE_VOID)));
+  } else if (final_to->kind == Code_Kind_TYPE_INT) {
+    allow = is_int_literal(expr) ||
+      (from->kind == Code_Kind_TYPE_INT && from->t_int.size < final_to->t_int.size &&
+       (final_to->t_int.is_signed || !from->t_int.is_signed));
+  } else if (final_to->kind == Code_Kind_TYPE_FLOAT) {
+    allow = is_int_literal(expr) || is_float_literal(expr) ||
+      (from->kind == Code_Kind_TYPE_FLOAT && from->t_float.size < final_to->t_float.size);
+  }
+
+  Code_Node *result = expr;
+  if (allow) {
+    result = code_expr_cast(state.common->parser, to, expr, true);
+    result->type = to;
+    result->first_token = expr->first_token;
+    result->last_token = expr->last_token;
+  }
+  return result;
+}
+
+// NOTE(lvl5): *expr as a value of type to, or an error
+void typecheck_convert(Check_State state, Code_Node **expr, Code_Node *to) {
+  *expr = maybe_implicit_cast(state, *expr, to);
+  if (!types_are_equal((*expr)->type, to)) {
+    typecheck_error(state, *expr, "this isn't the type it needs to be");
+  }
+}
+
 
 void typecheck_decl(Check_State, Code_Node *);
 void typecheck_stmt(Check_State, Code_Node *);
@@ -208,14 +412,14 @@ void typecheck_expression(Check_State, Code_Node *);
 
 void typecheck_type(Check_State state, Code_Node *node) {
   if (node->type) return;
-  
+  Parser *p = state.common->parser;
+
   switch (node->kind) {
     case Code_Kind_TYPE_STRUCT: {
       if (!node->t_struct.scope) {
-        node->t_struct.scope = alloc_scope(state.common->parser->arena,
-                                           state.scope);
+        node->t_struct.scope = alloc_scope(p->arena, state.scope);
       }
-      
+
       state.scope = node->t_struct.scope;
       for (u32 i = 0; i < sb_count(node->t_struct.members); i++) {
         Code_Node *member = node->t_struct.members[i];
@@ -224,20 +428,19 @@ void typecheck_type(Check_State state, Code_Node *node) {
     } break;
     case Code_Kind_TYPE_ENUM: {
       if (!node->t_enum.scope) {
-        node->t_enum.scope = alloc_scope(state.common->parser->arena,
-                                         state.scope);
+        node->t_enum.scope = alloc_scope(p->arena, state.scope);
       }
-      
+      node->t_enum.item_type = builtin_i64;
+
       state.scope = node->t_enum.scope;
       for (u32 i = 0; i < sb_count(node->t_enum.members); i++) {
         String member = node->t_enum.members[i];
-        
-        Code_Node *decl = code_stmt_decl(
-          state.common->parser,
-          member,
-          builtin_i64,
-          code_expr_int(state.common->parser, (u64)i),
-          true);
+        if (scope_get_local(state.scope, member)) {
+          typecheck_error(state, node, "\"%s\" is in the enum twice", tcstring(member));
+        }
+
+        Code_Node *decl = code_stmt_decl(p, member, builtin_i64,
+                                         code_expr_int(p, (u64)i), true);
         scope_add(state.scope, decl);
       }
     } break;
@@ -248,53 +451,122 @@ void typecheck_type(Check_State state, Code_Node *node) {
       typecheck_type(state, node->t_array.item_type);
     } break;
     case Code_Kind_TYPE_FUNC: {
-      typecheck_type(state, node->t_func.return_type);
-      for (u32 i = 0; i < sb_count(node->t_func.params); i++) {
-        typecheck_type(state, node->t_func.params[i]);
+      Code_Type_Func *func = &node->t_func;
+      // NOTE(lvl5): everything but a #foreign function takes the context
+      // as a hidden last parameter, calls pass theirs along
+      if (!func->foreign && !func->has_ctx) {
+        Code_Node *ctx = code_stmt_decl(p, const_string("ctx"),
+                                        code_type_alias(p, const_string("Context")),
+                                        0, false);
+        ctx->first_token = node->first_token;
+        ctx->last_token = node->last_token;
+        sb_push(func->params, ctx);
+        func->has_ctx = true;
+      }
+
+      typecheck_type(state, func->return_type);
+      for (u32 i = 0; i < sb_count(func->params); i++) {
+        typecheck_type(state, func->params[i]->s_decl.type);
       }
     } break;
     case Code_Kind_TYPE_ALIAS: {
       Scope_Entry *entry = scope_get(state.scope, node->t_alias.name);
-      if (!entry) {
-        yield();
+      if (!entry || !entry->decl->s_decl.type) {
+        yield(node);
+      }
+      if (entry->decl->s_decl.type != builtin_Type) {
+        typecheck_error(state, node, "\"%s\" isn't a type", tcstring(node->t_alias.name));
       }
       node->t_alias.base = entry->decl->s_decl.value;
     } break;
+    case Code_Kind_TYPE_INT:
+    case Code_Kind_TYPE_FLOAT:
+    case Code_Kind_TYPE_VOID: break;
     default: assert(false);
   }
-  
+
   node->type = builtin_Type;
 }
 
 
 void typecheck_stmt_block(Check_State state, Code_Node *node, b32 is_function_body) {
-  if (!is_function_body) {
-    node->s_block.scope = alloc_scope(state.common->parser->arena, state.scope);
+  if (!is_function_body && block_needs_scope(node)) {
+    if (!node->s_block.scope) {
+      node->s_block.scope = alloc_scope(state.common->parser->arena, state.scope);
+    }
     state.scope = node->s_block.scope;
   }
-  
+
   for (u32 i = 0; i < sb_count(node->s_block.statements); i++) {
     typecheck_stmt(state, node->s_block.statements[i]);
   }
 }
 
+// NOTE(lvl5): an expression that has to be a value, not a type
+void typecheck_value(Check_State state, Code_Node *node) {
+  typecheck_expression(state, node);
+  if (is_type(node)) {
+    typecheck_error(state, node, "expected a value, not a type");
+  }
+}
+
+void typecheck_condition(Check_State state, Code_Node *node) {
+  typecheck_value(state, node);
+  if (!is_scalar_type(node->type)) {
+    typecheck_error(state, node, "a condition has to be a number or a pointer");
+  }
+}
+
 void typecheck_stmt(Check_State state, Code_Node *node) {
   if (node->type) return;
-  
+
   switch (node->kind) {
     case Code_Kind_STMT_ASSIGN: {
-      // TODO(lvl5): check operator and types
-      // TODO(lvl5): implicit conversions
-      typecheck_expression(state, node->s_assign.left);
-      typecheck_expression(state, node->s_assign.right);
-      assert(types_are_equal(node->s_assign.left->type,
-                             node->s_assign.right->type));
+      Code_Stmt_Assign *assign = &node->s_assign;
+      typecheck_value(state, assign->left);
+      typecheck_value(state, assign->right);
+      if (!is_lvalue(assign->left)) {
+        typecheck_error(state, assign->left, "can't assign to this");
+      }
+
+      Code_Node *left_type = assign->left->type;
+      switch (assign->op) {
+        case T_ASSIGN: {
+          typecheck_convert(state, &assign->right, left_type);
+        } break;
+
+        case T_ADD_ASSIGN:
+        case T_SUB_ASSIGN: {
+          if (is_type_kind(left_type, Code_Kind_TYPE_POINTER)) {
+            typecheck_convert(state, &assign->right, builtin_i64);
+          } else if (is_number_type(left_type)) {
+            typecheck_convert(state, &assign->right, left_type);
+          } else {
+            typecheck_error(state, node, "only numbers and pointers can be added to");
+          }
+        } break;
+
+        case T_MUL_ASSIGN:
+        case T_DIV_ASSIGN: {
+          if (!is_number_type(left_type)) {
+            typecheck_error(state, node, "only numbers can be multiplied or divided");
+          }
+          typecheck_convert(state, &assign->right, left_type);
+        } break;
+
+        default: {
+          if (!is_int_type(left_type)) {
+            typecheck_error(state, node, "only integers have this operator");
+          }
+          typecheck_convert(state, &assign->right, left_type);
+        } break;
+      }
     } break;
     case Code_Kind_STMT_EXPR: {
-      typecheck_expression(state, node->s_expr.expr);
+      typecheck_value(state, node->s_expr.expr);
     } break;
     case Code_Kind_STMT_IF: {
-      typecheck_expression(state, node->s_if.cond);
+      typecheck_condition(state, node->s_if.cond);
       typecheck_stmt(state, node->s_if.then_branch);
       if (node->s_if.else_branch) {
         typecheck_stmt(state, node->s_if.else_branch);
@@ -304,136 +576,388 @@ void typecheck_stmt(Check_State state, Code_Node *node) {
       typecheck_stmt_block(state, node, false);
     } break;
     case Code_Kind_STMT_FOR: {
+      // NOTE(lvl5): the loop variable is only visible inside the loop
+      if (node->s_for.init->kind == Code_Kind_STMT_DECL) {
+        if (!node->s_for.scope) {
+          node->s_for.scope = alloc_scope(state.common->parser->arena, state.scope);
+        }
+        state.scope = node->s_for.scope;
+      }
       typecheck_stmt(state, node->s_for.init);
-      typecheck_expression(state, node->s_for.cond);
+      typecheck_condition(state, node->s_for.cond);
       typecheck_stmt(state, node->s_for.post);
+      state.in_loop = true;
       typecheck_stmt(state, node->s_for.body);
     } break;
     case Code_Kind_STMT_KEYWORD: {
-      assert(false);
+      Code_Stmt_Keyword *keyword = &node->s_keyword;
+      switch (keyword->keyword) {
+        case T_RETURN: {
+          Code_Node *return_type = state.func->func.sig->t_func.return_type;
+          if (keyword->stmt) {
+            if (keyword->stmt->kind != Code_Kind_STMT_EXPR) {
+              typecheck_error(state, keyword->stmt, "return takes a value");
+            }
+            typecheck_value(state, keyword->stmt->s_expr.expr);
+            typecheck_convert(state, &keyword->stmt->s_expr.expr, return_type);
+          } else if (!is_type_kind(return_type, Code_Kind_TYPE_VOID)) {
+            typecheck_error(state, node, "return needs a value here");
+          }
+        } break;
+
+        case T_BREAK:
+        case T_CONTINUE: {
+          if (!state.in_loop) {
+            typecheck_error(state, node, "not inside a loop");
+          }
+          if (keyword->stmt) {
+            typecheck_error(state, keyword->stmt, "expected \";\"");
+          }
+        } break;
+
+        case T_DEFER: {
+          if (!keyword->stmt) {
+            typecheck_error(state, node, "nothing to defer");
+          }
+          typecheck_stmt(state, keyword->stmt);
+        } break;
+
+        case T_PUSH_CONTEXT: {
+          Scope_Entry *ctx = scope_get(state.scope, const_string("ctx"));
+          if (!ctx) {
+            typecheck_error(state, node, "there's no context to push here");
+          }
+          typecheck_value(state, keyword->extra);
+          typecheck_convert(state, &keyword->extra, ctx->decl->s_decl.type);
+          state.context_arg = keyword->extra;
+          typecheck_stmt(state, keyword->stmt);
+        } break;
+
+        default: assert(false);
+      }
     } break;
     case Code_Kind_STMT_DECL: {
       typecheck_decl(state, node);
     } break;
     case Code_Kind_STMT_WHILE: {
-      typecheck_expression(state, node->s_while.cond);
+      typecheck_condition(state, node->s_while.cond);
+      state.in_loop = true;
       typecheck_stmt(state, node->s_while.body);
     } break;
-    
+
     default: assert(false);
   }
-  
+
   node->type = builtin_statement_type;
 }
 
+// NOTE(lvl5): the scope is made once, a yield checks the body again
+// with the same one
 void typecheck_func(Check_State state, Code_Node *node) {
   Code_Func *func = &node->func;
-  
-  typecheck_type(state, func->sig);
-  
-  node->func.scope = alloc_scope(state.common->parser->arena, state.scope);
-  
-  state.scope = node->func.scope;
+  if (func->foreign) return;
+
+  if (!func->scope) {
+    func->scope = alloc_scope(state.common->parser->arena, state.scope);
+    Code_Node **params = func->sig->t_func.params;
+    for (u32 i = 0; i < sb_count(params); i++) {
+      if (scope_get_local(func->scope, params[i]->s_decl.name)) {
+        typecheck_error(state, params[i], "two parameters are called \"%s\"",
+                        tcstring(params[i]->s_decl.name));
+      }
+      scope_add(func->scope, params[i]);
+    }
+  }
+
+  state.scope = func->scope;
+  state.func = node;
+  state.context_arg = 0;
+  state.in_loop = false;
   typecheck_stmt_block(state, func->body, true);
 }
 
-Code_Node *get_final_type(Code_Node *type) {
-  Code_Node *result = type;
-  while (result->kind == Code_Kind_TYPE_ALIAS) {
-    result = result->t_alias.base;
+// NOTE(lvl5): makes both sides the same type, a literal or a narrower
+// int takes the type of the other side. a literal goes first, x + 1
+// stays the type of x
+void typecheck_same_types(Check_State state, Code_Node *node) {
+  Code_Expr_Binary *bin = &node->e_binary;
+  if (is_int_literal(bin->left) || is_float_literal(bin->left)) {
+    bin->left = maybe_implicit_cast(state, bin->left, bin->right->type);
+  } else {
+    bin->right = maybe_implicit_cast(state, bin->right, bin->left->type);
+    bin->left = maybe_implicit_cast(state, bin->left, bin->right->type);
+  }
+  if (!types_are_equal(bin->left->type, bin->right->type)) {
+    typecheck_error(state, node, "the two sides have different types");
+  }
+}
+
+void typecheck_binary(Check_State state, Code_Node *node) {
+  Code_Expr_Binary *bin = &node->e_binary;
+
+  switch (bin->op) {
+    case T_MEMBER: {
+      if (bin->right->kind != Code_Kind_EXPR_NAME) {
+        typecheck_error(state, bin->right, "expected a member name");
+      }
+      String name = bin->right->e_name.name;
+      typecheck_expression(state, bin->left);
+
+      if (is_type(bin->left)) {
+        // NOTE(lvl5): Enum.MEMBER
+        Code_Node *enum_type = get_final_type(bin->left);
+        if (enum_type->kind != Code_Kind_TYPE_ENUM) {
+          typecheck_error(state, node, "only enums have members on the type");
+        }
+        if (!scope_get_local(enum_type->t_enum.scope, name)) {
+          typecheck_error(state, bin->right, "the enum has no \"%s\"", tcstring(name));
+        }
+        bin->is_enum_member = true;
+        node->type = bin->left;
+      } else {
+        // NOTE(lvl5): a pointer to a struct is dereferenced
+        Code_Node *struct_type = get_final_type(bin->left->type);
+        if (struct_type->kind == Code_Kind_TYPE_POINTER) {
+          struct_type = get_final_type(struct_type->t_pointer.base);
+        }
+        if (struct_type->kind != Code_Kind_TYPE_STRUCT) {
+          typecheck_error(state, node, "only structs have members");
+        }
+        if (!struct_type->type) {
+          yield(bin->left);
+        }
+
+        Code_Node *member = 0;
+        for (u32 i = 0; i < sb_count(struct_type->t_struct.members); i++) {
+          Code_Node *test = struct_type->t_struct.members[i];
+          if (string_compare(test->s_decl.name, name)) {
+            member = test;
+            break;
+          }
+        }
+        if (!member) {
+          typecheck_error(state, bin->right, "no member called \"%s\"", tcstring(name));
+        }
+        bin->right->e_name.decl = member;
+        bin->right->type = member->s_decl.type;
+        node->type = member->s_decl.type;
+      }
+    } break;
+
+    case T_SUBSCRIPT: {
+      typecheck_value(state, bin->left);
+      typecheck_value(state, bin->right);
+      Code_Node *left_type = get_final_type(bin->left->type);
+      Code_Node *item_type = 0;
+      if (left_type->kind == Code_Kind_TYPE_POINTER) {
+        item_type = left_type->t_pointer.base;
+      } else if (left_type->kind == Code_Kind_TYPE_ARRAY) {
+        item_type = left_type->t_array.item_type;
+      }
+      if (!item_type || is_type_kind(item_type, Code_Kind_TYPE_VOID)) {
+        typecheck_error(state, node, "only pointers and arrays can be indexed");
+      }
+      if (!is_int_type(bin->right->type)) {
+        typecheck_error(state, bin->right, "an index has to be an integer");
+      }
+      node->type = item_type;
+    } break;
+
+    case T_ADD:
+    case T_SUB: {
+      typecheck_value(state, bin->left);
+      typecheck_value(state, bin->right);
+      b32 left_pointer = is_type_kind(bin->left->type, Code_Kind_TYPE_POINTER);
+      b32 right_pointer = is_type_kind(bin->right->type, Code_Kind_TYPE_POINTER);
+
+      if (left_pointer && right_pointer && bin->op == T_SUB) {
+        if (!types_are_equal(bin->left->type, bin->right->type)) {
+          typecheck_error(state, node, "the pointers point at different types");
+        }
+        node->type = builtin_i64;
+      } else if (left_pointer) {
+        typecheck_convert(state, &bin->right, builtin_i64);
+        node->type = bin->left->type;
+      } else {
+        typecheck_same_types(state, node);
+        if (!is_number_type(bin->left->type)) {
+          typecheck_error(state, node, "only numbers can be added");
+        }
+        node->type = bin->left->type;
+      }
+    } break;
+
+    case T_MUL:
+    case T_DIV: {
+      typecheck_value(state, bin->left);
+      typecheck_value(state, bin->right);
+      typecheck_same_types(state, node);
+      if (!is_number_type(bin->left->type)) {
+        typecheck_error(state, node, "only numbers can be multiplied or divided");
+      }
+      node->type = bin->left->type;
+    } break;
+
+    case T_MOD:
+    case T_BIT_AND:
+    case T_BIT_OR:
+    case T_BIT_XOR: {
+      typecheck_value(state, bin->left);
+      typecheck_value(state, bin->right);
+      typecheck_same_types(state, node);
+      if (!is_int_type(bin->left->type)) {
+        typecheck_error(state, node, "only integers have this operator");
+      }
+      node->type = bin->left->type;
+    } break;
+
+    case T_LESS:
+    case T_LESS_EQUALS:
+    case T_GREATER:
+    case T_GREATER_EQUALS:
+    case T_EQUALS:
+    case T_NOT_EQUALS: {
+      typecheck_value(state, bin->left);
+      typecheck_value(state, bin->right);
+      typecheck_same_types(state, node);
+      if (!is_scalar_type(bin->left->type)) {
+        typecheck_error(state, node, "only numbers, enums and pointers can be compared");
+      }
+      node->type = builtin_i32;
+    } break;
+
+    case T_AND:
+    case T_OR: {
+      typecheck_condition(state, bin->left);
+      typecheck_condition(state, bin->right);
+      node->type = builtin_i32;
+    } break;
+
+    default: {
+      // TODO(lvl5): shifts, the VM has no instructions for them
+      typecheck_error(state, node, "this operator isn't supported yet");
+    } break;
   }
-  return result;
 }
 
 void typecheck_expression(Check_State state, Code_Node *node) {
   if (node->type) return;
-  
+  Parser *p = state.common->parser;
+
   switch (node->kind) {
     case Code_Kind_EXPR_CAST: {
-      // TODO(lvl5): check that the conversion makes sense
-      node->type = node->e_cast.cast_type;
+      Code_Expr_Cast *cast = &node->e_cast;
+      typecheck_type(state, cast->cast_type);
+      typecheck_value(state, cast->expr);
+
+      Code_Node *from = get_final_type(cast->expr->type);
+      Code_Node *to = get_final_type(cast->cast_type);
+      b32 is_float = from->kind == Code_Kind_TYPE_FLOAT || to->kind == Code_Kind_TYPE_FLOAT;
+      b32 is_pointer = from->kind == Code_Kind_TYPE_POINTER || to->kind == Code_Kind_TYPE_POINTER;
+      if (!types_are_equal(from, to) &&
+          (!is_scalar_type(from) || !is_scalar_type(to) || (is_float && is_pointer))) {
+        typecheck_error(state, node, "can't cast this to that type");
+      }
+      node->type = cast->cast_type;
     } break;
     case Code_Kind_EXPR_UNARY: {
       Code_Expr_Unary *unary = &node->e_unary;
       typecheck_expression(state, unary->val);
       // NOTE(lvl5): may be an address expression OR a pointer type
       if (is_type(unary->val)) {
-        Code_Node *ptr = code_type_pointer(state.common->parser,
-                                           unary->val);
+        if (unary->op != T_REF) {
+          typecheck_error(state, node, "expected a value, not a type");
+        }
+        Code_Node *ptr = code_type_pointer(p, unary->val);
+        ptr->first_token = node->first_token;
+        ptr->last_token = node->last_token;
         *node = *ptr;
         typecheck_type(state, node);
       } else {
-        if (unary->op == T_REF) {
-          node->type = code_type_pointer(state.common->parser, 
-                                         unary->val->type);
-        } else if (unary->op == T_DEREF) {
-          assert(unary->val->type->kind == Code_Kind_TYPE_POINTER);
-          node->type = unary->val->type->t_pointer.base;
-        } else {
-          node->type = unary->val->type;
+        Code_Node *type = unary->val->type;
+        switch (unary->op) {
+          case T_REF: {
+            if (!is_lvalue(unary->val)) {
+              typecheck_error(state, node, "can't take the address of this");
+            }
+            mark_address_taken(unary->val);
+            node->type = code_type_pointer(p, type);
+            node->type->type = builtin_Type;
+          } break;
+          case T_DEREF: {
+            if (!is_type_kind(type, Code_Kind_TYPE_POINTER) ||
+                is_type_kind(get_final_type(type)->t_pointer.base, Code_Kind_TYPE_VOID)) {
+              typecheck_error(state, node, "only pointers can be dereferenced");
+            }
+            node->type = get_final_type(type)->t_pointer.base;
+          } break;
+          case T_SUB: {
+            if (!is_number_type(type)) {
+              typecheck_error(state, node, "only numbers can be negated");
+            }
+            node->type = type;
+          } break;
+          case T_BIT_NOT: {
+            if (!is_int_type(type)) {
+              typecheck_error(state, node, "only integers have this operator");
+            }
+            node->type = type;
+          } break;
+          default: {
+            assert(unary->op == T_NOT);
+            typecheck_condition(state, unary->val);
+            node->type = builtin_i32;
+          } break;
         }
       }
     } break;
     case Code_Kind_EXPR_BINARY: {
-      Code_Expr_Binary *bin = &node->e_binary;
-      
-      switch (bin->op) {
-        case T_MEMBER: {
-          assert(bin->right->kind == Code_Kind_EXPR_NAME);
-          typecheck_expression(state, bin->left);
-          Code_Node *left_type = get_final_type(bin->left->type);
-          
-          if (left_type->kind == Code_Kind_TYPE_STRUCT) {
-            Code_Node *expr_type = null;
-            for (u32 i = 0; i < sb_count(left_type->t_struct.members); i++) {
-              Code_Stmt_Decl *member = &left_type->t_struct.members[i]->s_decl;
-              if (string_compare(member->name, bin->right->e_name.name)) {
-                expr_type = member->type;
-              }
-            }
-            assert(expr_type);
-            node->type = expr_type;
-          } else if (left_type->kind == Code_Kind_TYPE_ENUM) {
-            b32 member_found = false;
-            for (u32 i = 0; i < sb_count(left_type->t_enum.members); i++) {
-              String member = left_type->t_enum.members[i];
-              if (string_compare(member, bin->right->e_name.name)) {
-                member_found = true;
-              }
-            }
-            assert(member_found);
-            node->type = left_type->t_enum.item_type;
-          }
-        } break;
-        
-        assert(false);
-      }
-      
-      assert(types_are_equal(bin->left->type, bin->right->type));
-      
-      node->type = bin->left->type;
+      typecheck_binary(state, node);
     } break;
     case Code_Kind_EXPR_CALL: {
       // NOTE(lvl5): may be a function call OR a cast
-      typecheck_expression(state, node->e_call.func);
-      if (is_type(node->e_call.func)) {
-        Code_Node *cast = code_expr_cast(state.common->parser,
-                                         node->e_call.func,
-                                         node->e_call.args[0],
-                                         false);
+      Code_Expr_Call *call = &node->e_call;
+      typecheck_expression(state, call->func);
+      if (is_type(call->func)) {
+        if (sb_count(call->args) != 1) {
+          typecheck_error(state, node, "a cast takes one value");
+        }
+        Code_Node *cast = code_expr_cast(p, call->func, call->args[0], false);
+        cast->first_token = node->first_token;
+        cast->last_token = node->last_token;
         *node = *cast;
         typecheck_expression(state, node);
       } else {
-        assert(node->e_call.func->type->kind == Code_Kind_TYPE_FUNC);
-        Code_Type_Func *sig = &node->e_call.func->type->t_func;
-        
-        for (u32 i = 0; i < sb_count(node->e_call.args); i++) {
-          Code_Node *param = sig->params[i];
-          Code_Node *arg = node->e_call.args[i];
-          typecheck_expression(state, arg);
-          assert(types_are_equal(arg->type, param->type));
+        Code_Node *func_type = get_final_type(call->func->type);
+        if (func_type->kind != Code_Kind_TYPE_FUNC) {
+          typecheck_error(state, call->func, "this isn't a function");
         }
-        
+        // NOTE(lvl5): the ctx param is only there once the type is done
+        if (!func_type->type) {
+          yield(call->func);
+        }
+        Code_Type_Func *sig = &func_type->t_func;
+
+        if (sig->has_ctx && sb_count(call->args) + 1 == sb_count(sig->params)) {
+          Code_Node *ctx = state.context_arg;
+          if (!ctx) {
+            ctx = code_expr_name(p, const_string("ctx"));
+            ctx->first_token = node->first_token;
+            ctx->last_token = node->last_token;
+          }
+          sb_push(call->args, ctx);
+        }
+        if (sb_count(call->args) != sb_count(sig->params)) {
+          typecheck_error(state, node, "expected %d arguments, got %d",
+                          sb_count(sig->params) - (sig->has_ctx ? 1 : 0),
+                          sb_count(call->args) - (sig->has_ctx ? 1 : 0));
+        }
+
+        for (u32 i = 0; i < sb_count(call->args); i++) {
+          typecheck_value(state, call->args[i]);
+          typecheck_convert(state, call->args + i, sig->params[i]->s_decl.type);
+        }
+
         node->type = sig->return_type;
       }
     } break;
@@ -444,23 +968,44 @@ void typecheck_expression(Check_State state, Code_Node *node) {
       node->type = builtin_f64;
     } break;
     case Code_Kind_EXPR_STRING: {
-      // TODO(lvl5): the string alias needs its base to be set
-      node->type = builtin_string;
+      // NOTE(lvl5): the characters go on the BSS, with a 0 after them.
+      // the literal is __string_const(data, count)
+      String value = node->e_string.value;
+      Placeholder *placeholder = arena_push_struct(p->arena, Placeholder);
+      placeholder->storage_kind = Storage_Kind_BSS;
+      placeholder->offset = program_bss_push(state.common->program, value.count + 1);
+      placeholder->data = to_c_string(p->arena, value);
+      placeholder->size = value.count + 1;
+
+      Code_Node *data = code_expr_int(p, 0);
+      data->e_int.placeholder = placeholder;
+      data->type = builtin_voidptr;
+      Code_Node **args = sb_new(p->arena, Code_Node *, 4);
+      sb_push(args, data);
+      sb_push(args, code_expr_int(p, value.count));
+
+      Code_Node *call = code_expr_call(p, code_expr_name(p, const_string("__string_const")), args);
+      call->first_token = call->e_call.func->first_token = node->first_token;
+      call->last_token = call->e_call.func->last_token = node->last_token;
+      *node = *call;
+      typecheck_expression(state, node);
     } break;
     case Code_Kind_EXPR_NAME: {
       Scope_Entry *entry = scope_get(state.scope, node->e_name.name);
       if (!entry || !entry->decl->s_decl.type) {
-        yield();
+        yield(node);
       }
-      
+
       if (entry->decl->s_decl.type == builtin_Type) {
-        Code_Node *type = code_type_alias(state.common->parser, 
-                                          node->e_name.name);
+        Code_Node *type = code_type_alias(p, node->e_name.name);
+        type->first_token = node->first_token;
+        type->last_token = node->last_token;
         *node = *type;
         typecheck_type(state, node);
+      } else {
+        node->e_name.decl = entry->decl;
+        node->type = entry->decl->s_decl.type;
       }
-      
-      node->type = entry->decl->s_decl.type;
     } break;
     case Code_Kind_EXPR_NULL: {
       node->type = builtin_voidptr;
@@ -468,39 +1013,97 @@ void typecheck_expression(Check_State state, Code_Node *node) {
     case Code_Kind_EXPR_CHAR: {
       node->type = builtin_i8;
     } break;
-    
+    case Code_Kind_EXPR_RUN: {
+      // NOTE(lvl5): checked at global scope with a ctx of its own, it's
+      // run when the code using it is emitted, see bc_run_expr
+      Code_Expr_Run *run = &node->e_run;
+      if (!run->scope) {
+        run->scope = alloc_scope(p->arena, state.common->program->global_scope);
+        run->ctx = code_stmt_decl(p, const_string("ctx"),
+                                  code_type_alias(p, const_string("Context")),
+                                  0, false);
+        run->ctx->first_token = node->first_token;
+        run->ctx->last_token = node->last_token;
+        run->ctx->s_decl.storage_kind = Storage_Kind_STACK;
+        run->ctx->s_decl.offset = 0;
+        scope_add(run->scope, run->ctx);
+        sb_push(state.common->program->runs, node);
+      }
+      typecheck_type(state, run->ctx->s_decl.type);
+
+      Check_State run_state = state;
+      run_state.scope = run->scope;
+      run_state.func = 0;
+      run_state.context_arg = 0;
+      run_state.in_loop = false;
+      typecheck_value(run_state, run->expr);
+      if (is_type_kind(run->expr->type, Code_Kind_TYPE_VOID)) {
+        typecheck_error(state, node, "#run needs an expression with a value");
+      }
+      if (type_has_addresses(run->expr->type)) {
+        typecheck_error(state, node, "#run can't make pointers or functions, they only mean something inside the VM");
+      }
+      node->type = run->expr->type;
+    } break;
+
     default: assert(false);
   }
 }
 
 void typecheck_decl(Check_State state, Code_Node *node) {
   Code_Stmt_Decl *decl = &node->s_decl;
-  
-  if (!scope_get(state.scope, decl->name)) {
+
+  // NOTE(lvl5): a decl is checked again after a yield, it's only added
+  // the first time. one with the same name in a parent scope is shadowed
+  Scope_Entry *entry = scope_get_local(state.scope, decl->name);
+  if (!entry) {
     scope_add(state.scope, node);
+  } else if (entry->decl != node) {
+    typecheck_error(state, node, "\"%s\" is already declared", tcstring(decl->name));
   }
-  
+
   if (decl->type) {
     typecheck_type(state, decl->type);
   }
-  
-  if (decl->value) {
-    if (decl->value->kind == Code_Kind_FUNC) {
-      typecheck_func(state, decl->value);
-    } else if (is_expression(decl->value)) {
-      typecheck_expression(state, decl->value);
-    } else if (is_type(decl->value)) {
-      typecheck_type(state, decl->value);
-    } else {
-      assert(false);
-    }
-    
-    if (decl->type) {
-      assert(types_are_equal(decl->value->type, decl->type));
+
+  Code_Node *value = decl->value;
+  if (value) {
+    if (value->kind == Code_Kind_FUNC) {
+      if (value->func.foreign && !value->func.foreign_name.count) {
+        value->func.foreign_name = decl->name;
+      }
+      // NOTE(lvl5): the type is known before the body is checked, so the
+      // function can call itself
+      typecheck_type(state, value->func.sig);
+      value->type = value->func.sig;
+      if (!decl->type) {
+        decl->type = value->type;
+      }
+      typecheck_func(state, value);
+    } else if (is_type(value)) {
+      // NOTE(lvl5): set first, a struct can have pointers to itself
+      decl->type = builtin_Type;
+      typecheck_type(state, value);
     } else {
-      decl->type = decl->value->type;
+      assert(is_expression(value));
+      typecheck_expression(state, value);
+      if (decl->type) {
+        if (is_type(decl->value)) {
+          typecheck_error(state, value, "expected a value, not a type");
+        }
+        typecheck_convert(state, &decl->value, decl->type);
+      } else {
+        decl->type = value->type;
+      }
     }
   }
+
+  if (!decl->type) {
+    typecheck_error(state, node, "\"%s\" needs a type or a value", tcstring(decl->name));
+  }
+  if (decl->type != builtin_Type && is_type_kind(decl->type, Code_Kind_TYPE_VOID)) {
+    typecheck_error(state, node, "\"%s\" can't be void", tcstring(decl->name));
+  }
 }
 
 void typecheck_top_decl(Check_State state, Code_Node *node) {
@@ -508,7 +1111,188 @@ void typecheck_top_decl(Check_State state, Code_Node *node) {
   state.common->stage = Stage_TYPECHECK;
 }
 
-int main() {
+
+// NOTE(lvl5): sizes and storage, after everything is checked. members
+// and stack variables are laid out one after the other without alignment,
+// see the TODOs at the top
+i32 get_size_of_type(Code_Node *type) {
+  Code_Node *final_type = get_final_type(type);
+  i32 result = 0;
+  switch (final_type->kind) {
+    case Code_Kind_TYPE_STRUCT: {
+      if (!final_type->t_struct.size) {
+        i32 offset = 0;
+        for (u32 i = 0; i < sb_count(final_type->t_struct.members); i++) {
+          Code_Stmt_Decl *member = &final_type->t_struct.members[i]->s_decl;
+          member->storage_kind = Storage_Kind_NONE;
+          member->offset = offset;
+          offset += get_size_of_type(member->type);
+        }
+        final_type->t_struct.size = offset;
+      }
+      result = final_type->t_struct.size;
+    } break;
+    case Code_Kind_TYPE_ARRAY: {
+      result = (i32)final_type->t_array.count*get_size_of_type(final_type->t_array.item_type);
+    } break;
+    case Code_Kind_TYPE_INT: {
+      result = final_type->t_int.size;
+    } break;
+    case Code_Kind_TYPE_FLOAT: {
+      result = final_type->t_float.size;
+    } break;
+    case Code_Kind_TYPE_VOID: {
+      result = 0;
+    } break;
+    default: {
+      // NOTE(lvl5): enums, pointers and functions
+      result = 8;
+    } break;
+  }
+  return result;
+}
+
+void size_decl(Program *, Code_Func *, Code_Node *);
+
+void size_stmt(Program *program, Code_Func *func, Code_Node *node) {
+  switch (node->kind) {
+    case Code_Kind_STMT_DECL: {
+      size_decl(program, func, node);
+    } break;
+    case Code_Kind_STMT_IF: {
+      size_stmt(program, func, node->s_if.then_branch);
+      if (node->s_if.else_branch) {
+        size_stmt(program, func, node->s_if.else_branch);
+      }
+    } break;
+    case Code_Kind_STMT_BLOCK: {
+      for (u32 i = 0; i < sb_count(node->s_block.statements); i++) {
+        size_stmt(program, func, node->s_block.statements[i]);
+      }
+    } break;
+    case Code_Kind_STMT_FOR: {
+      size_stmt(program, func, node->s_for.init);
+      size_stmt(program, func, node->s_for.body);
+    } break;
+    case Code_Kind_STMT_KEYWORD: {
+      if (node->s_keyword.stmt) {
+        size_stmt(program, func, node->s_keyword.stmt);
+      }
+    } break;
+    case Code_Kind_STMT_WHILE: {
+      size_stmt(program, func, node->s_while.body);
+    } break;
+    default: break;
+  }
+}
+
+// NOTE(lvl5): the frame is the return value, the params, then the locals
+void size_func(Program *program, Code_Node *node) {
+  Code_Func *func = &node->func;
+  Code_Type_Func *sig = &func->sig->t_func;
+
+  func->stack_size = get_size_of_type(sig->return_type);
+  for (u32 i = 0; i < sb_count(sig->params); i++) {
+    Code_Stmt_Decl *param = &sig->params[i]->s_decl;
+    param->storage_kind = Storage_Kind_STACK;
+    param->offset = func->stack_size;
+    func->stack_size += get_size_of_type(param->type);
+  }
+  size_stmt(program, func, func->body);
+}
+
+// NOTE(lvl5): func is 0 for globals. a function gets a slot on the BSS
+// wherever it's declared, it holds its index or foreign address
+void size_decl(Program *program, Code_Func *func, Code_Node *node) {
+  Code_Stmt_Decl *decl = &node->s_decl;
+  if (decl->type == builtin_Type) {
+    get_size_of_type(decl->value);
+  } else if (decl->value && decl->value->kind == Code_Kind_FUNC) {
+    decl->storage_kind = Storage_Kind_BSS;
+    decl->offset = program_bss_push(program, 8);
+    if (!decl->value->func.foreign) {
+      size_func(program, decl->value);
+    }
+  } else if (!func) {
+    decl->storage_kind = Storage_Kind_BSS;
+    decl->offset = program_bss_push(program, get_size_of_type(decl->type));
+  } else {
+    decl->storage_kind = Storage_Kind_STACK;
+    decl->offset = func->stack_size;
+    func->stack_size += get_size_of_type(decl->type);
+  }
+}
+
+// NOTE(lvl5): a #run that makes a struct or an array leaves it on the
+// BSS like a string constant, after the globals
+void size_runs(Program *program) {
+  for (u32 i = 0; i < sb_count(program->runs); i++) {
+    Code_Node *node = program->runs[i];
+    Code_Node *type = node->type;
+    if (is_type_kind(type, Code_Kind_TYPE_STRUCT) || is_type_kind(type, Code_Kind_TYPE_ARRAY)) {
+      Placeholder *placeholder = arena_push_struct(program->parser->arena, Placeholder);
+      zero_memory(placeholder, sizeof(Placeholder));
+      placeholder->storage_kind = Storage_Kind_BSS;
+      placeholder->size = get_size_of_type(type);
+      placeholder->offset = program_bss_push(program, placeholder->size);
+      node->e_run.placeholder = placeholder;
+    }
+  }
+}
+
+#include "bytecode_emitter.c"
+
+
+void memory_benchmark(Arena *arena) {
+  u64 max_size = megabytes(1);
+  byte *src = arena_push_array(arena, byte, max_size + 64);
+  byte *dst = arena_push_array(arena, byte, max_size + 64);
+  for (u64 i = 0; i < max_size + 64; i++) {
+    src[i] = (byte)i;
+  }
+  
+  volatile u64 sink = 0;
+  printf("%8s %10s %10s %10s %10s %10s %10s\n", "size",
+         "copy", "memcpy", "set", "memset", "compare", "memcmp");
+  
+  for (u64 size = 1; size <= max_size; size *= 2) {
+    // NOTE(lvl5): odd offsets so the unaligned paths get measured too
+    u64 sizes[] = { size, size + 3 };
+    for (u32 size_index = 0; size_index < array_count(sizes); size_index++) {
+      u64 n = sizes[size_index];
+      if (n > max_size) break;
+      
+      u64 iterations = megabytes(64)/n;
+      if (iterations > 4*1024*1024) iterations = 4*1024*1024;
+      if (iterations < 64) iterations = 64;
+      
+      f64 times[6];
+      for (u32 kind = 0; kind < array_count(times); kind++) {
+        clock_t start = clock();
+        for (u64 it = 0; it < iterations; it++) {
+          byte *d = dst + (it & 7);
+          byte *s = src + (it & 3);
+          switch (kind) {
+            case 0: copy_memory(d, s, n); break;
+            case 1: memcpy(d, s, n); break;
+            case 2: set_memory(d, (byte)it, n); break;
+            case 3: memset(d, (byte)it, n); break;
+            case 4: sink += compare_memory(d, s, n); break;
+            case 5: sink += memcmp(d, s, n); break;
+          }
+          sink += d[0];
+        }
+        clock_t end = clock();
+        times[kind] = (f64)(end - start)/(f64)CLOCKS_PER_SEC*1e9/(f64)iterations;
+      }
+      
+      printf("%8llu %8.2fns %8.2fns %8.2fns %8.2fns %8.2fns %8.2fns\n", n,
+             times[0], times[1], times[2], times[3], times[4], times[5]);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
   clock_t front_start = clock();
   
   Arena _arena;
@@ -516,11 +1300,55 @@ int main() {
   arena_init(arena, malloc(megabytes(100)), megabytes(100));
   arena_init(scratch_arena, malloc(megabytes(1)), megabytes(1));
   
+  // NOTE(lvl5): `run file.lbc` runs a bytecode image, without the front
+  // end
+  if (argc > 2 && strcmp(argv[1], "run") == 0) {
+    Bc_Emitter emitter;
+    if (bc_image_load(&emitter, arena, argv[2])) {
+      bytecode_run(arena, &emitter);
+    }
+    return 0;
+  }
+  
+  // NOTE(lvl5): `bench-memory` times the lvl5_arena.h memory functions
+  // against the crt ones
+  if (argc > 1 && strcmp(argv[1], "bench-memory") == 0) {
+    memory_benchmark(arena);
+    return 0;
+  }
+  
   //bytecode_test(arena);
   
   Scope *global_scope = alloc_scope(arena, null);
   
-  Buffer file = read_entire_file(arena, const_string("code\\test.lang"));
+  // NOTE(lvl5): -snapshot runs the #init functions while compiling, see
+  // bytecode_snapshot.c. -o file.lbc writes a bytecode image instead of
+  // running the program, see bytecode_image.c. after a run -print lists
+  // the bytecode of every function and -function-stats counts the ones
+  // that were emitted, with BC_LAZY that's the ones that got called.
+  // -threads n runs the program on n VMs at once, each on its own thread
+  String file_name = const_string("code\\test.lang");
+  b32 snapshot = false;
+  b32 print_bytecode = false;
+  b32 function_stats = false;
+  i32 thread_count = 0;
+  char *image_name = 0;
+  for (i32 i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-snapshot") == 0) {
+      snapshot = true;
+    } else if (strcmp(argv[i], "-print") == 0) {
+      print_bytecode = true;
+    } else if (strcmp(argv[i], "-function-stats") == 0) {
+      function_stats = true;
+    } else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+      thread_count = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      image_name = argv[++i];
+    } else {
+      file_name = from_c_string(argv[i]);
+    }
+  }
+  Buffer file = read_entire_file(arena, file_name);
   file.data[file.size++] = 0;
   String src = make_string((char *)file.data, (u32)file.size);
   Token *tokens = tokenize(arena, src);
@@ -572,103 +1400,121 @@ int main() {
   
   Parse_Result parse_result = parse(p, src, tokens);
   if (parse_result.success) {
+    Program program = {0};
+    program.parser = p;
+    program.global_scope = global_scope;
+    program.runs = sb_new(arena, Code_Node *, 16);
+    
     u32 top_decl_count = sb_count(parse_result.decls);
     Check_State *states = sb_new(arena, Check_State, 
                                  top_decl_count);
-    zero_memory_slow(states, sizeof(Check_State)*top_decl_count);
+    zero_memory(states, sizeof(Check_State)*top_decl_count);
     Check_State_Common *commons = sb_new(arena, Check_State_Common,
                                          top_decl_count);
-    zero_memory_slow(commons, sizeof(Check_State_Common)*top_decl_count);
+    zero_memory(commons, sizeof(Check_State_Common)*top_decl_count);
     
     for (u32 i = 0; i < top_decl_count; i++) {
       Check_State *state = states + i;
       state->common = commons + i;
       state->scope = global_scope;
       state->common->parser = p;
+      state->common->program = &program;
     }
     
+    // NOTE(lvl5): a decl that yields is checked again on the next round,
+    // a round where nothing gets done means the rest wait on each other
+    // or on a name that isn't there
     u32 completed_count = 0;
-    while (completed_count < top_decl_count) {
+    b32 progress = true;
+    while (completed_count < top_decl_count && progress && string_is_empty(p->error)) {
+      progress = false;
       for (u32 top_decl_index = 0; 
-           top_decl_index < sb_count(parse_result.decls);
+           top_decl_index < top_decl_count;
            top_decl_index++) {
         Code_Node *top_decl = parse_result.decls[top_decl_index];
         Check_State state = states[top_decl_index];
+        if (state.common->stage != Stage_NONE) continue;
         
-        Stage old_stage = state.common->stage;
-        if (!setjmp(state.common->return_buf)) {
-          switch (state.common->stage) {
-            case Stage_NONE: {
-              typecheck_top_decl(state, top_decl);
-            } break;
-          }
+        int jump = setjmp(state.common->return_buf);
+        if (!jump) {
+          typecheck_top_decl(state, top_decl);
+        } else if (jump == 2) {
+          state.common->stage = Stage_TYPECHECK;
         }
-        if (state.common->stage != old_stage) {
+        if (state.common->stage != Stage_NONE) {
           completed_count++;
+          progress = true;
         }
+        if (!string_is_empty(p->error)) break;
       }
     }
-  }
-  
-  
-  
-  
-  
-#if 0
-  if (parse_result.success) {
-    Resolver_Common common = {0};
-    Resolver res = {0};
-    res.common = &common;
-    res.common->top_decls = parse_result.decls;
-    res.common->parser = p;
-    
-    Bc_Emitter emitter = {0};
-    emitter.bss_segment = arena_push_array(arena, byte, megabytes(2));
-    emitter.instructions = arena_push_array(arena, Bc_Instruction, 2048);
-    emitter.parser = p;
-    res.common->bc_emitter = &emitter;
-    
-    
-    resolve_decls(res, parse_result, global_scope);
-    
     
-    clock_t front_end = clock();
-    
-    f64 front_time = (f64)(front_end - front_start)/(f64)(CLOCKS_PER_SEC);
-    printf("front time: %0.3f s\n", front_time);
-    
-    if (sb_count(p->errors) == 0) {
-      bytecode_print(&emitter);
-      __debugbreak();
-      bytecode_run(arena, &emitter);
-      return;
+    if (string_is_empty(p->error) && completed_count < top_decl_count) {
+      for (u32 i = 0; i < top_decl_count; i++) {
+        Code_Node *blocked_on = commons[i].blocked_on;
+        if (commons[i].stage == Stage_NONE && blocked_on) {
+          String name = blocked_on->kind == Code_Kind_EXPR_NAME
+            ? blocked_on->e_name.name : blocked_on->t_alias.name;
+          if (scope_get(global_scope, name)) {
+            compiler_error(p, p->tokens[blocked_on->first_token], "circular dependency on \"%s\"", tcstring(name));
+          } else {
+            compiler_error(p, p->tokens[blocked_on->first_token], "undeclared name \"%s\"", tcstring(name));
+          }
+          break;
+        }
+      }
     }
-  }
-  
-  if (sb_count(p->errors)) {
-    
-  } else {
-    char compiler_flags[] = "-Od -MTd -nologo -Oi -GR- -EHa- -WX -W4 -wd4101 -wd4702 -wd4005 -wd4505 -wd4456 -wd4201 -wd4100 -wd4189 -wd4204 -wd4459 -Zi -FC";
-    
-    char linker_flags[] = "-incremental:no -opt:ref OpenGL32.lib Winmm.lib user32.lib Gdi32.lib";
-    
-    char buffer[1024];
-    sprintf_s(buffer, 1024, "cl %s code\\out.c /link %s", compiler_flags, linker_flags);
-    
-    clock_t front_end = clock();
     
-    f64 front_time = (f64)(front_end - front_start)/(f64)(CLOCKS_PER_SEC);
-    printf("front time: %0.3f s\n", front_time);
-    
-    clock_t cl_start = clock();
-    system(buffer);
-    
-    clock_t cl_end = clock();
-    f64 cl_time = (f64)(cl_end - cl_start)/(f64)(CLOCKS_PER_SEC);
-    printf("cl time: %0.3f s\n", cl_time);
+    if (!string_is_empty(p->error)) {
+      printf("Typecheck error: %s\n\n", tcstring(p->error));
+    } else {
+      for (u32 i = 0; i < top_decl_count; i++) {
+        size_decl(&program, 0, parse_result.decls[i]);
+      }
+      size_runs(&program);
+      
+      Bc_Emitter emitter;
+      bc_emitter_init(&emitter, arena, p);
+      if (program.bss_size > BC_BSS_SIZE) {
+        printf("Error: the globals don't fit in the BSS\n");
+      } else if (!bc_emit_program(&emitter, parse_result.decls)) {
+        printf("Error: there's no __entry\n");
+      } else if (!bc_fold_runs(&emitter, program.runs)) {
+        printf("#run error: %s\n\n", tcstring(p->error));
+      } else if (snapshot && !bc_snapshot(&emitter, parse_result.decls)) {
+        // NOTE(lvl5): bc_snapshot says why
+      } else if (image_name) {
+        if (!bc_image_write(&emitter, image_name)) {
+          printf("Error: can't write %s\n", image_name);
+        }
+      } else {
+        clock_t front_end = clock();
+        f64 front_time = (f64)(front_end - front_start)/(f64)(CLOCKS_PER_SEC);
+        fprintf(stderr, "front time: %0.3f s\n", front_time);
+        
+        clock_t run_start = clock();
+        if (thread_count > 0) {
+          bytecode_run_threads(&emitter, thread_count);
+        } else {
+          bytecode_run(arena, &emitter);
+        }
+        clock_t run_end = clock();
+        
+        f64 run_time = (f64)(run_end - run_start)/(f64)(CLOCKS_PER_SEC);
+        fprintf(stderr, "run time (%s): %0.3f s\n", BC_THREADED ? "threaded" : "switch", run_time);
+        
+        if (print_bytecode) {
+          bytecode_print(&emitter);
+        }
+        if (function_stats) {
+          bytecode_print_function_stats(&emitter);
+        }
+      }
+    }
   }
-#endif
   
+#ifdef _WIN32
   getchar();
+#endif
   return 0;
 }
@@ -0,0 +1,90 @@
+#!/bin/sh
+# NOTE: builds the VM with each dispatch loop and with the JIT, and runs
+# every lang_build/code/tests/*.lang with each build. a test passes when
+# what it prints is its .expected file, with and without -snapshot running
+# its #init functions while compiling, and again when it's written to a
+# .lbc image with -o and run from that. threads.lang also runs on
+# several VMs at once with -threads, each prints the same line
+
+MODES="switch:-DBC_THREADED=0:-DBC_JIT=0
+threaded:-DBC_THREADED=1:-DBC_JIT=0
+jit_switch:-DBC_THREADED=0:-DBC_JIT=1
+jit_threaded:-DBC_THREADED=1:-DBC_JIT=1"
+
+# NOTE: a function far bigger than anything hand written, 4000 lines of
+# two statements that don't fit the register forms. what it prints is
+# worked out here too
+large=build/test_large_function.lang
+mkdir -p build
+{
+  echo 'Context :: struct { allocator_data: *void; }'
+  echo 'putchar :: func(c: i32) i32 #foreign "msvcrt";'
+  echo 'print :: func(n: i64) { if n >= 10 { print(n / 10); } putchar(i32(n % 10 + 48)); }'
+  echo '__entry :: func() {'
+  echo '  x: i64 = 1;'
+  echo '  y: i64 = 0;'
+  x=1
+  y=0
+  i=0
+  while [ $i -lt 4000 ]; do
+    echo "  x = (x*7 + $i) % 1000003; y = (y + x/3) % 1000003;"
+    x=$(((x*7 + i) % 1000003))
+    y=$(((y + x/3) % 1000003))
+    i=$((i + 1))
+  done
+  echo '  print(x);'
+  echo '  putchar(10);'
+  echo '  print(y);'
+  echo '  putchar(10);'
+  echo '}'
+} > "$large"
+printf '%s\n%s\n' $x $y > "${large%.lang}.expected"
+
+failed=0
+for mode in $MODES; do
+  name=${mode%%:*}
+  flags=$(echo "${mode#*:}" | tr ':' ' ')
+  if ! OUT="lang_$name" ./build.sh $flags; then
+    echo "build failed: $name"
+    failed=1
+    continue
+  fi
+  
+  for test in lang_build/code/tests/*.lang "$large"; do
+    expected="${test%.lang}.expected"
+    case "$test" in
+      lang_build/*) source="${test#lang_build/}" ;;
+      *) source="../$test" ;;
+    esac
+    for run in "" -snapshot "-o" "-snapshot -o"; do
+      image="../build/test_$name.lbc"
+      rm -f "build/test_$name.lbc"
+      case "$run" in
+        *-o) output=$(cd lang_build && ../build/lang_$name $run "$image" "$source" 2>/dev/null;
+                      [ -f "$image" ] && ../build/lang_$name run "$image" 2>/dev/null) ;;
+        *) output=$(cd lang_build && ../build/lang_$name $run "$source" 2>/dev/null) ;;
+      esac
+      if [ "$output" = "$(cat "$expected")" ]; then
+        echo "ok   $name $(basename "$test") $run"
+      else
+        echo "FAIL $name $(basename "$test") $run"
+        echo "$output" | diff "$expected" - | head -20
+        failed=1
+      fi
+    done
+  done
+  rm -f "build/test_$name.lbc"
+  
+  threads=8
+  output=$(cd lang_build && ../build/lang_$name -threads $threads code/tests/threads.lang 2>/dev/null)
+  expected=$(i=0; while [ $i -lt $threads ]; do cat lang_build/code/tests/threads.expected; i=$((i + 1)); done)
+  if [ "$output" = "$expected" ]; then
+    echo "ok   $name threads.lang -threads $threads"
+  else
+    echo "FAIL $name threads.lang -threads $threads"
+    echo "$output" | head -20
+    failed=1
+  fi
+done
+
+exit $failed